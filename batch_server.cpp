@@ -0,0 +1,202 @@
+/*
+ * Copyright (C) 2009-2012 Simon A. Berger
+ *
+ * This file is part of papara.
+ *
+ *  papara is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  papara is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with papara.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+
+#ifndef WIN32
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#include "batch_server.h"
+
+namespace {
+
+const char *batch_terminator = "//";
+
+// the connections are served one after the other, so a client that stops sending (or reading) must not block the
+// server: it is dropped if a read or write makes no progress for this long
+const int client_timeout_s = 30;
+
+// runs the handler, and turns exceptions into an error message for the client
+std::string handle_batch( papara::batch_handler *handler, const std::string &batch ) {
+    std::istringstream in( batch );
+    std::ostringstream out;
+
+    try {
+        handler->handle( in, out );
+    } catch( std::exception &x ) {
+        std::ostringstream err;
+        err << "ERROR: " << x.what() << "\n";
+        return err.str();
+    }
+
+    return out.str();
+}
+
+#ifndef WIN32
+std::string errno_string() {
+    return std::string( std::strerror( errno ));
+}
+
+void set_timeouts( int fd ) {
+    timeval tv;
+    tv.tv_sec = client_timeout_s;
+    tv.tv_usec = 0;
+
+    setsockopt( fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv) );
+    setsockopt( fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv) );
+}
+
+// false on errors, including the timeouts (EAGAIN)
+bool read_all( int fd, std::string *data ) {
+    char buf[64 * 1024];
+
+    while( true ) {
+        const ssize_t n = read( fd, buf, sizeof(buf) );
+
+        if( n == 0 ) {
+            return true;
+        } else if( n < 0 ) {
+            if( errno == EINTR ) {
+                continue;
+            }
+            return false;
+        }
+
+        data->append( buf, size_t(n) );
+    }
+}
+
+bool write_all( int fd, const std::string &data ) {
+    size_t pos = 0;
+
+    while( pos < data.size() ) {
+        const ssize_t n = write( fd, data.data() + pos, data.size() - pos );
+
+        if( n < 0 ) {
+            if( errno == EINTR ) {
+                continue;
+            }
+            return false;
+        }
+
+        pos += size_t(n);
+    }
+
+    return true;
+}
+#endif
+
+}
+
+void papara::serve_unix_socket( const std::string &path, batch_handler *handler ) {
+#ifndef WIN32
+    sockaddr_un addr;
+    std::memset( &addr, 0, sizeof(addr) );
+    addr.sun_family = AF_UNIX;
+
+    if( path.size() >= sizeof(addr.sun_path) ) {
+        throw std::runtime_error( "socket path is too long: " + path );
+    }
+    std::strcpy( addr.sun_path, path.c_str() );
+
+    // a client that goes away before reading its answer must not kill the server
+    signal( SIGPIPE, SIG_IGN );
+
+    const int server_fd = socket( AF_UNIX, SOCK_STREAM, 0 );
+    if( server_fd == -1 ) {
+        throw std::runtime_error( "cannot create socket: " + errno_string() );
+    }
+
+    // remove the socket file of a previous run, but nothing else
+    struct stat st;
+    if( lstat( path.c_str(), &st ) == 0 ) {
+        if( !S_ISSOCK( st.st_mode )) {
+            close( server_fd );
+            throw std::runtime_error( "cannot listen on socket " + path + ": the file exists and is not a socket" );
+        }
+
+        unlink( path.c_str() );
+    }
+
+    if( bind( server_fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr) ) != 0 || listen( server_fd, 16 ) != 0 ) {
+        const std::string err = errno_string();
+        close( server_fd );
+        throw std::runtime_error( "cannot listen on socket " + path + ": " + err );
+    }
+
+    while( true ) {
+        const int fd = accept( server_fd, 0, 0 );
+
+        if( fd == -1 ) {
+            if( errno == EINTR || errno == ECONNABORTED ) {
+                continue;
+            }
+
+            const std::string err = errno_string();
+            close( server_fd );
+            throw std::runtime_error( "accept failed: " + err );
+        }
+
+        set_timeouts( fd );
+
+        std::string batch;
+        if( read_all( fd, &batch )) {
+            write_all( fd, handle_batch( handler, batch ));
+        }
+
+        close( fd );
+    }
+#else
+    throw std::runtime_error( "unix sockets are not supported on this platform (use the stdin/stdout transport)" );
+#endif
+}
+
+void papara::serve_stream( std::istream &is, std::ostream &os, batch_handler *handler ) {
+    std::string batch;
+    std::string line;
+
+    while( true ) {
+        const bool good = std::getline( is, line );
+
+        // a batch ends at the terminator line (or, if not empty, at the end of the input)
+        if( !good || line == batch_terminator || line == std::string( batch_terminator ) + "\r" ) {
+            if( good || !batch.empty() ) {
+                os << handle_batch( handler, batch ) << batch_terminator << std::endl;
+            }
+
+            batch.clear();
+
+            if( !good ) {
+                break;
+            }
+        } else {
+            batch.append( line ).append( "\n" );
+        }
+    }
+}
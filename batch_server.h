@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2009-2012 Simon A. Berger
+ *
+ * This file is part of papara.
+ *
+ *  papara is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  papara is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with papara.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __batch_server_h
+#define __batch_server_h
+
+#include <iostream>
+#include <string>
+
+// Transport of the daemon mode (papara -D): the references are loaded once, then query batches are received and
+// answered until the process is terminated. A batch is a set of fasta records, the answer consists of one
+// '<name> <aligned sequence>' line per query (or a single 'ERROR: <message>' line if the batch could not be processed).
+//
+// Two transports are supported:
+// - unix socket: one batch per connection. The client sends the records and shuts down its sending side, the server
+//   replies and closes the connection (e.g., 'socat - UNIX-CONNECT:<path> < batch.fa'). The connections are served
+//   one after the other; a client that neither sends nor reads for 30 seconds is disconnected.
+// - stdin/stdout: the batches and the answers are terminated by a line containing only '//'.
+
+namespace papara {
+
+class batch_handler {
+public:
+    virtual ~batch_handler() {}
+
+    // processes one batch (fasta records in 'in') and writes the answer to 'out'. Exceptions are reported to the client.
+    virtual void handle( std::istream &in, std::ostream &out ) = 0;
+};
+
+// serves batches on a unix socket (an existing socket file is replaced, any other existing file is an error). Does not
+// return.
+void serve_unix_socket( const std::string &path, batch_handler *handler );
+
+// serves batches from is to os, until is is exhausted.
+void serve_stream( std::istream &is, std::ostream &os, batch_handler *handler );
+
+}
+
+#endif
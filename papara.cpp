@@ -22,11 +22,21 @@
 #include <boost/bind.hpp>
 #include <boost/dynamic_bitset.hpp>
 #include <iterator>
+#include <sstream>
+#include <cstdio>
 
 #include "ivymike/fasta.h"
 #include "ivymike/demangle.h"
 #include "ivymike/time.h"
 
+#ifndef WIN32
+#include <unistd.h>
+#endif
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
 #include "papara.h"
 #include "vec_unit.h"
 #include "align_pvec_vec.h"
@@ -43,21 +53,24 @@ using namespace ivy_mike::tree_parser_ms;
 
 using namespace papara;
 
-bool papara::g_dump_aux = false;
 
+static ivy_mike::mutex log_buffer_mutex;
 
+// the log may be written by several threads (e.g., the scoring threads, or independent references/queries used
+// concurrently by an embedding program). Therefore the buffer has no put area: every write is passed on
+// to the tees and sinks directly, under the log mutex.
 class log_stream_buffer : public std::streambuf
 {
 
 public:
     
-    log_stream_buffer() : buffer_(120) {
+    log_stream_buffer() {
         
     }
 
-    void post( char overflow, char *start, char *end ) {
+    void post( char overflow, const char *start, const char *end ) {
         for( std::vector< std::ostream* >::iterator it = log_tees.begin(); it != log_tees.end(); ++it ) {
-            std::copy( start, end, std::ostream_iterator<char>( *(*it) ));
+            (*it)->write( start, end - start );
             
             if( overflow != 0 ) {
                 (*it)->put(overflow);
@@ -70,23 +83,25 @@ public:
         }
     }
     
-    int_type overflow(int c) {
+    int_type overflow(int_type c) {
+        if( traits_type::eq_int_type( c, traits_type::eof() )) {
+            return traits_type::not_eof(c);
+        }
 
+        ivy_mike::lock_guard<ivy_mike::mutex> lock( log_buffer_mutex );
+        post( traits_type::to_char_type(c), 0, 0 );
 
-        post( c, pbase(), epptr() );
+        return c;
+    }
 
-        setp(&buffer_.front(), (&buffer_.back()) + 1);
+    std::streamsize xsputn( const char *s, std::streamsize n ) {
+        ivy_mike::lock_guard<ivy_mike::mutex> lock( log_buffer_mutex );
+        post( 0, s, s + n );
 
-        return 1;
+        return n;
     }
 
     int sync() {
-        //            std::cout << "sync:";
-        //            std::copy( pbase(), pptr(), std::ostream_iterator<char>(std::cout));
-        //            std::cout << std::endl;
-        
-        post( 0, pbase(), pptr() );
-        setp(&buffer_.front(), (&buffer_.back()) + 1);
         return 0;
     }
     
@@ -116,7 +131,6 @@ private:
     log_stream_buffer(const log_stream_buffer &);
     log_stream_buffer &operator= (const log_stream_buffer &);
 
-    std::vector<char> buffer_;
     std::vector<std::ostream *> log_tees;
     std::vector<log_sink *> log_sinks;
 };
@@ -178,8 +192,6 @@ private:
 static log_stream_buffer ls_buf;
 std::ostream papara::lout(&ls_buf);
 
-static ivy_mike::mutex log_buffer_mutex;
-
 
 // open_log_file::open_log_file( const char *filename ) {
 //     
@@ -232,7 +244,7 @@ std::string papara::get_version_string() {
 }
 
 template<typename seq_tag>
-queries<seq_tag>::queries( const std::string &opt_qs_name ) {
+queries<seq_tag>::queries( const std::string &opt_qs_name, size_t n_threads ) {
 
 
 //        if( !opt_qs_name.empty() ) {
@@ -248,21 +260,15 @@ queries<seq_tag>::queries( const std::string &opt_qs_name ) {
         }
         
         // mix them with the qs from the ref alignment <-- WTF? must have been sniffing whiteboard cleaner... the qs are read before the ref seqs...
-        read_fasta( qsf, m_qs_names, m_qs_seqs);
+        // (the names are normalized by the parser threads)
+        read_fasta_parallel( opt_qs_name.c_str(), n_threads, &queries<seq_tag>::normalize_name, &m_qs_names, &m_qs_seqs );
     }
     
     //            if( m_qs_names.empty() ) {
         //                throw std::runtime_error( "no qs" );
         //            }
         
-        std::for_each( m_qs_names.begin(), m_qs_names.end(), std::ptr_fun( normalize_name ));
-        
-        //
-        // setup qs best-score/best-edge lists
-        //
-        
         
-        m_qs_pvecs.resize( m_qs_names.size() );
         //        }
         //        m_qs_bestscore.resize(m_qs_names.size());
         //        std::fill( m_qs_bestscore.begin(), m_qs_bestscore.end(), 32000);
@@ -272,84 +278,145 @@ queries<seq_tag>::queries( const std::string &opt_qs_name ) {
         
         
 }
+template<typename seq_tag>
+queries<seq_tag>::queries( const uint8_t *fasta, size_t fasta_size, size_t n_threads ) {
+    read_fasta_parallel( fasta, fasta + fasta_size, n_threads, &queries<seq_tag>::normalize_name, &m_qs_names, &m_qs_seqs );
+}
+
+template<typename seq_tag>
+queries<seq_tag>::queries( std::vector<std::string> *names, std::vector<std::vector<uint8_t> > *seqs ) {
+    if( names->size() != seqs->size() ) {
+        throw std::runtime_error( "queries: inconsistent number of names and sequences" );
+    }
+
+    m_qs_names.swap( *names );
+
+    std::for_each( m_qs_names.begin(), m_qs_names.end(), std::ptr_fun( normalize_name ));
+
+    for( std::vector<std::vector<uint8_t> >::const_iterator it = seqs->begin(); it != seqs->end(); ++it ) {
+        m_qs_seqs.push_back( it->begin(), it->end() );
+    }
+
+    seqs->clear();
+}
+
+fasta_batch_reader::fasta_batch_reader( const std::string &name ) : is_( name.c_str() ) {
+    if( !is_.good() ) {
+        throw std::runtime_error( "cannot open qs file");
+    }
+}
+
+bool fasta_batch_reader::read( size_t max_records, std::vector<std::string> *names, std::vector<std::vector<uint8_t> > *seqs ) {
+    assert( max_records > 0 );
+
+    names->clear();
+    seqs->clear();
+
+    // collect the lines of the next max_records records, and let read_fasta parse them
+    std::string chunk;
+    size_t num_records = 0;
+
+    if( !next_header_.empty() ) {
+        chunk.append( next_header_ ).append( "\n" );
+        next_header_.clear();
+        ++num_records;
+    }
+
+    std::string line;
+    while( std::getline( is_, line ) ) {
+        if( !line.empty() && line[0] == '>' ) {
+            if( num_records == max_records ) {
+                next_header_ = line;
+                break;
+            }
+
+            ++num_records;
+        }
+
+        chunk.append( line ).append( "\n" );
+    }
+
+    std::istringstream cs( chunk );
+    read_fasta( cs, *names, *seqs );
+
+    return !names->empty();
+}
+
 template<typename seq_tag>
 void queries<seq_tag>::preprocess() {
     //
     // preprocess query sequences
     //
-    if( m_qs_seqs.empty() ) {
+    if( m_qs_seqs.size() == 0 ) {
         throw std::runtime_error( "no query sequences" );
     }
 
     assert( m_qs_seqs.size() == m_qs_names.size() );
-    m_qs_pvecs.resize(m_qs_seqs.size());
-    m_qs_cseqs.resize(m_qs_seqs.size());
+
+    // lookup table for the per-character work below: is_known_sstate, s2c and cstate_is_single
+    const int unknown_char = -1;
+    const int gap_char = -2;
+    std::vector<int> char_to_cstate( 256, unknown_char );
+
+    for( size_t c = 0; c < char_to_cstate.size(); ++c ) {
+        if( seq_model::is_known_sstate( c ) ) {
+            const uint8_t cs = seq_model::s2c( c );
+
+            char_to_cstate[c] = seq_model::cstate_is_single( cs ) ? int(cs) : gap_char;
+        }
+    }
 
     std::vector<bool> bad_characters( 256, false );
     
-    
-    
+    // the unsupported characters are removed from the sequences (so they are re-built), and the gaps are removed from
+    // the c-state representation.
+    seq_arena seqs;
+    seq_arena cseqs;
+
+    seqs.reserve( m_qs_seqs.size(), m_qs_seqs.bytes() );
+    cseqs.reserve( m_qs_seqs.size(), m_qs_seqs.bytes() );
+
+    std::vector<uint8_t> qs_tmp;
+    std::vector<uint8_t> cs_tmp;
+
     for( size_t i = 0; i < m_qs_seqs.size(); i++ ) {
-//            seq_to_nongappy_pvec( m_qs_seqs[i], m_qs_pvecs[i] );
-        //          static void seq_to_nongappy_pvec( std::vector<uint8_t> &seq, std::vector<uint8_t> &pvec ) {
+        qs_tmp.clear();
+        cs_tmp.clear();
 
-        // the following line means: transform sequence to pvec using seq_model::s2p as mapping
-        // function and only append the mapped character into pvec, if it corresponds to a single (=non gap)
-        // character.
-        
-        std::vector<uint8_t> qs_tmp;
-        qs_tmp.reserve( m_qs_seqs[i].size() );
-        bool bad_char = false;
-        for( std::vector<uint8_t>::iterator it = m_qs_seqs[i].begin(), e = m_qs_seqs[i].end(); it != e; ++it ) {
-            if( !seq_model::is_known_sstate( *it ) ) {
+        for( const uint8_t *it = m_qs_seqs.begin(i), *e = m_qs_seqs.end(i); it != e; ++it ) {
+            const int cs = char_to_cstate[*it];
+
+            if( cs == unknown_char ) {
                 bad_characters.at( *it ) = true;
-                bad_char = true;
             } else {
                 qs_tmp.push_back( *it );
-            }
-        }
-        if( bad_char ) {
-            m_qs_seqs[i].swap( qs_tmp );
-        }
-
-        std::transform( m_qs_seqs[i].begin(), m_qs_seqs[i].end(),
-                        back_insert_ifer(m_qs_cseqs[i], seq_model::cstate_is_single),
-                        seq_model::s2c );
 
-        std::transform( m_qs_seqs[i].begin(), m_qs_seqs[i].end(),
-                        back_insert_ifer(m_qs_pvecs[i], seq_model::pstate_is_single),
-                        seq_model::s2p );
-
-//         std::cout << "preprocess: " << i << " " << m_qs_cseqs[i].size() << " " << m_qs_pvecs[i].size() << "\n";
-        
-        if( m_qs_cseqs[i].size() != m_qs_pvecs[i].size() ) {
-            // check for quirks related to the p-state vs c-state representation
-            throw std::runtime_error( "mismatch between lengths of c-state and p-state representations of query sequence." );
+                if( cs != gap_char ) {
+                    cs_tmp.push_back( uint8_t(cs) );
+                }
+            }
         }
-        
-//            for( unsigned int i = 0; i < seq.size(); i++ ) {
-//                seq_model::pars_state_t ps = seq_model::s2p(seq[i]);
-//
-//                if( seq_model::is_single(ps)) {
-//                    pvec.push_back(ps);
-//                }
-//
-//            }
-
 
+        seqs.push_back( qs_tmp.begin(), qs_tmp.end() );
 
+        // REMARK: the p-state representation (see pvec_at) is c2p of the c-states. This is the same as the original
+        // (s2p of the non-gap characters) because s2p == c2p(s2c) for all sequence models.
+        cseqs.push_back( cs_tmp.begin(), cs_tmp.end() );
     }
 
+    m_qs_seqs.swap( seqs );
+    m_qs_cseqs.swap( cseqs );
+
     // print warnings about deleted characters
     bool warn_header = false;
     for( std::vector<bool>::iterator it = bad_characters.begin(), e = bad_characters.end(); it != e; ++it ) {
         if( *it ) {
             if( !warn_header ) {
-                std::cout << "WARNING: there were unsupported characters in the query sequences. They will be deleted:\n";
+                lout << "WARNING: there were unsupported characters in the query sequences. They will be deleted:\n";
                 warn_header = true;
             }
             
-            std::cout << "deleted character: '" << uint8_t(std::distance( bad_characters.begin(), it )) << "'\n";
+            lout << "deleted character: '" << uint8_t(std::distance( bad_characters.begin(), it )) << "'\n";
         }
     }
     
@@ -362,6 +429,87 @@ void queries<seq_tag>::preprocess() {
 }
 
 
+template<typename seq_tag>
+size_t queries<seq_tag>::collapse_duplicates() {
+    assert( m_out_query.empty() );
+    assert( m_qs_cseqs.size() == size() );
+
+    const size_t num_qs = size();
+
+    // unique queries (as indices into the current queries) and the unique query of each query
+    std::vector<size_t> unique_qs;
+    std::vector<size_t> out_query( num_qs );
+
+    // hash of c-states and bounds -> unique queries with this hash
+    std::map<uint64_t, std::vector<size_t> > buckets;
+
+    for( size_t i = 0; i < num_qs; ++i ) {
+        const std::pair<size_t,size_t> bounds = get_per_qs_bounds(i);
+
+        content_hash h;
+        h.update( m_qs_cseqs.begin(i), m_qs_cseqs.length(i) );
+        h.update( &bounds.first, sizeof(bounds.first) );
+        h.update( &bounds.second, sizeof(bounds.second) );
+
+        std::vector<size_t> &bucket = buckets[h.value()];
+
+        size_t u = size_t(-1);
+
+        for( std::vector<size_t>::iterator it = bucket.begin(); it != bucket.end(); ++it ) {
+            const size_t j = unique_qs[*it];
+
+            // the raw sequences are compared, so that the collapsed queries are really identical (i.e., also in the gaps
+            // and the characters that are not in the c-state representation)
+            if( m_qs_seqs.length(i) == m_qs_seqs.length(j) && std::equal( m_qs_seqs.begin(i), m_qs_seqs.end(i), m_qs_seqs.begin(j) )
+                && bounds == get_per_qs_bounds(j) )
+            {
+                u = *it;
+                break;
+            }
+        }
+
+        if( u == size_t(-1) ) {
+            u = unique_qs.size();
+            unique_qs.push_back( i );
+            bucket.push_back( u );
+        }
+
+        out_query[i] = u;
+    }
+
+    if( unique_qs.size() == num_qs ) {
+        return 0;
+    }
+
+    //
+    // keep only the unique queries
+    //
+    std::vector <std::string> names;
+    seq_arena seqs;
+    seq_arena cseqs;
+    std::vector<std::pair<size_t,size_t> > bounds;
+
+    for( std::vector<size_t>::iterator it = unique_qs.begin(); it != unique_qs.end(); ++it ) {
+        names.push_back( m_qs_names[*it] );
+        seqs.push_back( m_qs_seqs.begin(*it), m_qs_seqs.end(*it) );
+        cseqs.push_back( m_qs_cseqs.begin(*it), m_qs_cseqs.end(*it) );
+
+        if( !per_qs_bounds_.empty() ) {
+            bounds.push_back( per_qs_bounds_[*it] );
+        }
+    }
+
+    m_out_names.swap( m_qs_names );
+    m_out_query.swap( out_query );
+
+    m_qs_names.swap( names );
+    m_qs_seqs.swap( seqs );
+    m_qs_cseqs.swap( cseqs );
+    per_qs_bounds_.swap( bounds );
+
+    return num_qs - unique_qs.size();
+}
+
 // template<typename pvec_t, typename seq_tag>
 // void queries<seq_tag>::init_partition_assignments( partassign::part_assignment &part_assign, references<pvec_t,seq_tag> &refs ) {
 //     
@@ -372,23 +520,31 @@ void queries<seq_tag>::preprocess() {
 template<typename seq_tag>
 void queries<seq_tag>::add( const std::string& name, std::vector< uint8_t >& qs ) {
     m_qs_names.push_back(name);
-    ivy_mike::push_back_swap(m_qs_seqs, qs );
+    m_qs_seqs.push_back( qs.begin(), qs.end() );
+    std::vector<uint8_t>().swap( qs );
 }
 template<typename seq_tag>
 void queries<seq_tag>::write_pvecs(const char* name) {
     std::ofstream os( name );
 
-    os << m_qs_pvecs.size();
-    for( typename std::vector< std::vector< pars_state_t > >::iterator it = m_qs_pvecs.begin(); it != m_qs_pvecs.end(); ++it ) {
-        os << " " << it->size() << " ";
-        os.write( (char *)it->data(), it->size() );
+    os << size();
+
+    std::vector<pars_state_t> pvec;
+    for( size_t i = 0; i < size(); ++i ) {
+        pvec_at( i, &pvec );
+
+        os << " " << pvec.size() << " ";
+        os.write( (char *)pvec.data(), pvec.size() );
 
     }
 }
 template<typename seq_tag>
 size_t queries<seq_tag>::max_name_length() const {
+    // (the names of the collapsed duplicates are only in m_out_names)
+    const std::vector<std::string> &names = m_out_names.empty() ? m_qs_names : m_out_names;
+
     size_t len = 0;
-    for( std::vector <std::string >::const_iterator it = m_qs_names.begin(); it != m_qs_names.end(); ++it ) {
+    for( std::vector <std::string >::const_iterator it = names.begin(); it != names.end(); ++it ) {
         len = std::max( len, it->size() );
     }
 
@@ -396,15 +552,15 @@ size_t queries<seq_tag>::max_name_length() const {
 }
 
 template<typename seq_tag>
-size_t queries<seq_tag>::calc_cups_per_ref(size_t ref_len) const {
+size_t queries<seq_tag>::calc_cups_per_ref(size_t ref_len, size_t qs_begin, size_t qs_end) const {
     size_t ct = 0;
 
-    typename std::vector<std::vector <pars_state_t> >::const_iterator first = m_qs_pvecs.begin();
-    const typename std::vector<std::vector <pars_state_t> >::const_iterator last = m_qs_pvecs.end();
+    qs_end = std::min( qs_end, m_qs_cseqs.size() );
+    assert( qs_begin <= qs_end );
 
-    for(; first != last; ++first ) {
-        //ct += (ref_len - first->size()) * first->size();
-        ct += ref_len * first->size(); // papara now uses the 'unbanded' aligner
+    for( size_t i = qs_begin; i != qs_end; ++i ) {
+        //ct += (ref_len - cseq_size(i)) * cseq_size(i);
+        ct += ref_len * cseq_size(i); // papara now uses the 'unbanded' aligner
     }
 
 
@@ -442,8 +598,110 @@ void queries<seq_tag>::normalize_name(std::string& str) {
 // references stuff
 //////////////////////////////////////////////////////////////
 
+namespace {
+
+// site-pattern compression of the reference alignment: columns with the same parsimony state in every reference
+// sequence get the same ancestral state vectors, so build_ref_vecs only calculates one column per distinct pattern.
+// pattern_of[j] is the pattern of column j, pattern_cols[p] the first column of pattern p (patterns are numbered
+// in the order of their first column).
+template<typename seq_model>
+void compress_site_patterns( const std::vector<std::vector<uint8_t> > &seqs, std::vector<uint32_t> *pattern_of, std::vector<size_t> *pattern_cols ) {
+    const size_t num_cols = seqs.empty() ? 0 : seqs.front().size();
+
+    // hash of each column (row by row, to walk the sequences sequentially)
+    std::vector<content_hash> col_hashes( num_cols );
+
+    for( size_t i = 0; i < seqs.size(); ++i ) {
+        const std::vector<uint8_t> &seq = seqs[i];
+
+        for( size_t j = 0; j < num_cols; ++j ) {
+            const typename seq_model::pars_state_t state = seq_model::s2p(seq[j]);
+            col_hashes[j].update( &state, sizeof(state) );
+        }
+    }
+
+    std::vector<std::pair<uint64_t,size_t> > hashes( num_cols );
+    for( size_t j = 0; j < num_cols; ++j ) {
+        hashes[j] = std::make_pair( col_hashes[j].value(), j );
+    }
+
+    std::sort( hashes.begin(), hashes.end() );
+
+    // within a run of equal hashes, each column is compared to the first column of the patterns found so far. rep_of
+    // is the first column of the pattern of each column.
+    std::vector<size_t> rep_of( num_cols );
+    std::vector<size_t> reps;
+
+    for( size_t b = 0; b < num_cols; ) {
+        size_t e = b + 1;
+        while( e < num_cols && hashes[e].first == hashes[b].first ) {
+            ++e;
+        }
+
+        reps.clear();
+
+        for( size_t k = b; k < e; ++k ) {
+            const size_t j = hashes[k].second;
+
+            size_t r = 0;
+            for( ; r < reps.size(); ++r ) {
+                size_t i = 0;
+                while( i < seqs.size() && seq_model::s2p(seqs[i][j]) == seq_model::s2p(seqs[i][reps[r]]) ) {
+                    ++i;
+                }
+
+                if( i == seqs.size() ) {
+                    break;
+                }
+            }
+
+            if( r == reps.size() ) {
+                reps.push_back( j );
+            }
+
+            rep_of[j] = reps[r];
+        }
+
+        b = e;
+    }
+
+    pattern_of->resize( num_cols );
+    pattern_cols->clear();
+
+    for( size_t j = 0; j < num_cols; ++j ) {
+        if( rep_of[j] == j ) {
+            (*pattern_of)[j] = uint32_t(pattern_cols->size());
+            pattern_cols->push_back( j );
+        } else {
+            (*pattern_of)[j] = (*pattern_of)[rep_of[j]];
+        }
+    }
+}
+
+}
+
+template<typename pvec_t, typename seq_tag>
+references<pvec_t,seq_tag>::references(const char* opt_tree_name, const char* opt_alignment_name, queries<seq_tag>* qs, size_t n_threads) : m_ln_pool(new ln_pool( std::auto_ptr<node_data_factory>(new my_fact<my_adata>) ))
+{
+    std::vector<std::string> ref_ma_names;
+    seq_arena ref_ma_seqs;
+    read_phylip_parallel( opt_alignment_name, n_threads, &ref_ma_names, &ref_ma_seqs );
+
+    init( opt_tree_name, &ref_ma_names, ref_ma_seqs, qs );
+}
+
 template<typename pvec_t, typename seq_tag>
-references<pvec_t,seq_tag>::references(const char* opt_tree_name, const char* opt_alignment_name, queries<seq_tag>* qs) : m_ln_pool(new ln_pool( std::auto_ptr<node_data_factory>(new my_fact<my_adata>) )), spg_(pvec_pgap::pgap_model, &pm_)
+references<pvec_t,seq_tag>::references(const char* opt_tree_name, const uint8_t *alignment, size_t alignment_size, queries<seq_tag>* qs, size_t n_threads) : m_ln_pool(new ln_pool( std::auto_ptr<node_data_factory>(new my_fact<my_adata>) ))
+{
+    std::vector<std::string> ref_ma_names;
+    seq_arena ref_ma_seqs;
+    read_phylip_parallel( alignment, alignment + alignment_size, n_threads, &ref_ma_names, &ref_ma_seqs );
+
+    init( opt_tree_name, &ref_ma_names, ref_ma_seqs, qs );
+}
+
+template<typename pvec_t, typename seq_tag>
+void references<pvec_t,seq_tag>::init(const char* opt_tree_name, std::vector<std::string> *ref_ma_names_ptr, const seq_arena &ref_ma_seqs, queries<seq_tag>* qs)
 {
 
     //std::cerr << "papara_nt instantiated as: " << typeid(*this).name() << "\n";
@@ -492,17 +750,18 @@ references<pvec_t,seq_tag>::references(const char* opt_tree_name, const char* op
 
     {
         //
-        // read reference alignment: store the ref-seqs in the tips of the ref-tree
+        // reference alignment: store the ref-seqs in the tips of the ref-tree
         //
-        multiple_alignment ref_ma;
-        ref_ma.load_phylip( opt_alignment_name );
+        std::vector<std::string> &ref_ma_names = *ref_ma_names_ptr;
+
+        align_qs_begin_ = qs->size();
 
         std::vector<my_adata *> tmp_adata;
         boost::dynamic_bitset<> unmasked;
 
-        for( unsigned int i = 0; i < ref_ma.names.size(); i++ ) {
+        for( unsigned int i = 0; i < ref_ma_names.size(); i++ ) {
 
-            std::map< std::string, sptr::shared_ptr<lnode> >::iterator it = name_to_lnode.find(ref_ma.names[i]);
+            std::map< std::string, sptr::shared_ptr<lnode> >::iterator it = name_to_lnode.find(ref_ma_names[i]);
 
             // process sequences from the ref_ma depending on, if they are contained in the tree.
             // if they are, they are 'swapped' into m_ref_seqs
@@ -527,8 +786,8 @@ references<pvec_t,seq_tag>::references(const char* opt_tree_name, const char* op
                 m_ref_names.push_back(std::string() );
                 m_ref_seqs.push_back(std::vector<uint8_t>() );
 
-                m_ref_names.back().swap( ref_ma.names[i] );
-                m_ref_seqs.back().swap( ref_ma.data[i] );
+                m_ref_names.back().swap( ref_ma_names[i] );
+                m_ref_seqs.back().assign( ref_ma_seqs.begin(i), ref_ma_seqs.end(i) );
 
                 // mark all non-gap positions of the current reference in bit-vector 'unmasked'
                 const std::vector<uint8_t> &seq = m_ref_seqs.back();
@@ -546,10 +805,13 @@ references<pvec_t,seq_tag>::references(const char* opt_tree_name, const char* op
                 name_to_lnode.erase(it);
 
             } else {
-                qs->add(ref_ma.names[i], ref_ma.data[i]); // REMARK: the second parameter is 'moved-from' (should be an rvalue-ref)
+                std::vector<uint8_t> seq( ref_ma_seqs.begin(i), ref_ma_seqs.end(i) );
+                qs->add(ref_ma_names[i], seq); // REMARK: the second parameter is 'moved-from' (should be an rvalue-ref)
             }
         }
 
+        align_qs_end_ = qs->size();
+
         if( !name_to_lnode.empty() ) {
             std::cerr << "error: there are " << name_to_lnode.size() << " taxa in the tree with no corresponding sequence in the reference alignment. names:\n";
 
@@ -592,14 +854,28 @@ references<pvec_t,seq_tag>::references(const char* opt_tree_name, const char* op
                     seq_tmp.push_back( seq_orig[*it] );
                 }
                 m_ref_seqs[i].swap( seq_tmp );
+            }
+        }
+
+        {
+            // initialize the adata objects of the tips with one column per site pattern of the cleaned ref seqs
+            std::vector<size_t> pattern_cols;
+            compress_site_patterns<seq_model>( m_ref_seqs, &m_site_patterns, &pattern_cols );
+
+            std::vector<uint8_t> pattern_seq( pattern_cols.size() );
 
-                //initialize the corresponding adata object with the cleaned ref seq.
-                tmp_adata.at(i)->init_pvec( m_ref_seqs[i] );
+            for( size_t i = 0, e = m_ref_seqs.size(); i != e; ++i ) {
+                for( size_t p = 0; p < pattern_cols.size(); ++p ) {
+                    pattern_seq[p] = m_ref_seqs[i][pattern_cols[p]];
+                }
+
+                tmp_adata.at(i)->init_pvec( pattern_seq, &pm_ );
             }
+
+            lout << "site patterns: " << pattern_cols.size() << " of " << m_site_patterns.size() << " columns\n";
         }
     }
     pm_.reset( m_ref_seqs );
-    std::cout << "p: " << pm_.setup_pmatrix(0.1) << "\n";
 
     // initialize empty non-gap map. It is lazily filled as needed when necessary
     ref_ng_map_.resize( m_ref_seqs.size() );
@@ -610,171 +886,1361 @@ references<pvec_t,seq_tag>::references(const char* opt_tree_name, const char* op
 
     visit_edges( n, m_ec );
 
+    // the topology of the tree. The lnodes of one node share their adata, which therefore identifies the node.
+    std::map<const void *, uint32_t> node_ids;
+    for( typename edge_collector<lnode>::container::const_iterator it = m_ec.m_edges.begin(); it != m_ec.m_edges.end(); ++it ) {
+        const uint32_t id1 = node_ids.insert( std::make_pair( it->first->m_data.get(), uint32_t(node_ids.size()) )).first->second;
+        const uint32_t id2 = node_ids.insert( std::make_pair( it->second->m_data.get(), uint32_t(node_ids.size()) )).first->second;
+
+        m_edge_nodes.push_back( std::make_pair( id1, id2 ));
+    }
+
     lout << "edges: " << m_ec.m_edges.size() << "\n";
 
 }
 
 template<typename pvec_t, typename seq_tag>
-void references<pvec_t,seq_tag>::build_ref_vecs() {
-    // pre-create the ancestral state vectors. This step is necessary for the threaded version, because otherwise, each
-    // thread would need an independent copy of the tree to do concurrent newviews. Anyway, having a copy of the tree
-    // in each thread will most likely use more memory than storing the pre-calculated vectors.
+uint32_t references<pvec_t,seq_tag>::index_flags() {
+    uint32_t flags = 0;
 
-    // TODO: maybe try lazy create/cache of the asv's in the threads
+    if( vu_config<seq_tag>::is_aa ) {
+        flags |= ref_index_header::flag_aa;
+    }
+    if( ivy_mike::same_type<pvec_t,pvec_cgap>::result ) {
+        flags |= ref_index_header::flag_cgap;
+    }
 
-    ivy_mike::timer t1;
+    return flags;
+}
 
+template<typename pvec_t, typename seq_tag>
+references<pvec_t,seq_tag>::references( sptr::shared_ptr<mapped_file> index, uint64_t key, queries<seq_tag>* qs ) : m_ln_pool(new ln_pool( std::auto_ptr<node_data_factory>(new my_fact<my_adata>) )), index_(index)
+{
+    lout << "references container instantiated as: " << ivy_mike::demangle(typeid(*this).name()) << " (from reference index)\n";
 
+    index_reader r( index_->data(), index_->size() );
 
-    assert( m_ref_aux.empty() && m_ref_pvecs.empty() );
+    const ref_index_header h = ref_index_header::read( &r );
 
-    m_ref_pvecs.reserve( m_ec.m_edges.size() );
-    m_ref_aux.reserve( m_ec.m_edges.size() );
+    if( h.flags != index_flags() ) {
+        throw std::runtime_error( "reference index was built for a different data type or gap model (-a/-c)" );
+    }
 
+    if( key != 0 && h.key != key ) {
+        throw std::runtime_error( "reference index does not match the reference tree and alignment" );
+    }
 
-    for( size_t i = 0; i < m_ec.m_edges.size(); i++ ) {
-        pvec_t root_pvec;
+    // reference sequences (all-gap columns are already removed)
+    m_ref_names.resize( size_t(r.get<uint64_t>()) );
+    m_ref_seqs.resize( m_ref_names.size() );
 
-//             std::cout << "newview for branch " << i << ": " << *(m_ec.m_edges[i].first->m_data) << " " << *(m_ec.m_edges[i].second->m_data) << "\n";
+    for( size_t i = 0; i < m_ref_names.size(); ++i ) {
+        m_ref_names[i] = r.get_string();
+        r.get_vector( &m_ref_seqs[i] );
+    }
 
-        if( i == 340 ) {
-            g_dump_aux = true;
-        }
+    ref_ng_map_.resize( m_ref_seqs.size() );
 
-        driver<pvec_t,seq_tag>::do_newview( root_pvec, m_ec.m_edges[i].first, m_ec.m_edges[i].second, true );
+    // sequences of the reference alignment that are not in the tree
+    align_qs_begin_ = qs->size();
 
-        g_dump_aux = false;
-        // TODO: try something fancy with rvalue refs...
+    const size_t num_align_qs = size_t(r.get<uint64_t>());
+    for( size_t i = 0; i < num_align_qs; ++i ) {
+        const std::string name = r.get_string();
 
-        m_ref_pvecs.push_back( std::vector<int>() );
-        m_ref_aux.push_back( std::vector<unsigned int>() );
+        std::vector<uint8_t> seq;
+        r.get_vector( &seq );
 
-        root_pvec.to_int_vec(m_ref_pvecs.back());
-        root_pvec.to_aux_vec(m_ref_aux.back());
+        qs->add( name, seq );
+    }
 
+    align_qs_end_ = qs->size();
 
-        m_ref_gapp.push_back( std::vector<double>() );
+    // ancestral state vectors of the edges, bound to the mapped index
+    m_ref_vecs.resize( size_t(r.get<uint64_t>()) );
+    const size_t ref_len = size_t(r.get<uint64_t>());
 
-        if( ivy_mike::same_type<pvec_t,pvec_pgap>::result ) {
-            // WTF: this is why mixing static and dynamic polymorphism is a BAD idea!
-            pvec_pgap *rvp = reinterpret_cast<pvec_pgap *>(&root_pvec);
-            rvp->to_gap_post_vec(m_ref_gapp.back());
+    for( size_t i = 0; i < m_ref_vecs.size(); ++i ) {
+        const size_t state_bits = size_t(r.get<uint64_t>());
 
-//              std::transform( m_ref_gapp.back().begin(), m_ref_gapp.back().end(), std::ostream_iterator<int>(std::cout), ivy_mike::scaler_clamp<double>(10,0,9) );
-//
-//              std::cout << "\n";
-        }
+        // bind first to check the state width and to get the sizes of the packed data
+        packed_ref_vec &v = m_ref_vecs[i];
+        v.bind( ref_len, state_bits, 0, 0 );
 
+        const uint8_t *states = r.get_bytes( v.state_bytes() );
+        const uint8_t *aux = r.get_bytes( v.aux_bytes() );
 
+        v.bind( ref_len, state_bits, states, aux );
     }
 
-//     std::cout << "pvecs created: " << t1.elapsed() << "\n";
-
-}
-template<typename pvec_t, typename seq_tag>
-const std::vector<int> &references<pvec_t,seq_tag>::ng_map_at( size_t i ) {
-    std::vector<int> &ng_map = ref_ng_map_.at(i);
-    
-    if( !ng_map.empty() ) {
-        return ng_map;
+    // topology of the tree (see edge_nodes)
+    m_edge_nodes.resize( m_ref_vecs.size() );
+    for( size_t i = 0; i < m_edge_nodes.size(); ++i ) {
+        m_edge_nodes[i].first = r.get<uint32_t>();
+        m_edge_nodes[i].second = r.get<uint32_t>();
     }
-    
-    //std::vector<int> map;
-    
-    std::vector< uint8_t > &seq = m_ref_seqs.at(i);
-    assert( seq.size() < size_t(std::numeric_limits<int>::max()) );
-    for( size_t i = 0; i < seq.size(); ++i ) {
-        bool is_gap = seq_model::pstate_is_gap( seq_model::s2p(seq[i]));
-        
-        if( !is_gap ) {
-            ng_map.push_back(int(i));
-        }
+
+    // directional vectors for incremental updates (see build_index_vecs)
+    if( r.get<uint64_t>() != 0 ) {
+        m_dir_state.reset( new directional_state( &r ));
     }
-    
-    //ng_map.shrink_to_fit();
-    std::vector<int>(ng_map).swap(ng_map); // old fashioned shrink_to_fit
-    
-    return ng_map;
-}
 
+    share_duplicate_vecs();
+
+    lout << "edges: " << m_ref_vecs.size() << " (" << m_distinct_edges.size() << " distinct ancestral state vectors)\n";
+}
 
 template<typename pvec_t, typename seq_tag>
-void references<pvec_t,seq_tag>::write_pvecs(const char* name) {
-    std::ofstream os( name );
+void references<pvec_t,seq_tag>::write_index( const char *name, uint64_t key, const queries<seq_tag> &qs ) const {
+    assert( has_ref_vecs() );
 
-    os << m_ref_pvecs.size();
-    for( size_t i = 0; i < m_ref_pvecs.size(); ++i ) {
-        os << " " << m_ref_pvecs[i].size() << " ";
-        os.write( (char *)m_ref_pvecs[i].data(), m_ref_pvecs[i].size() * sizeof(int));
-        os.write( (char *)m_ref_aux[i].data(), m_ref_aux[i].size() * sizeof(unsigned int));
+    if( lazy_ref_vecs() ) {
+        throw std::runtime_error( "the reference index needs the ancestral state vectors of all edges (it can not be built with a memory limit)" );
     }
-}
 
-template<typename pvec_t, typename seq_tag>
-size_t references<pvec_t,seq_tag>::max_name_length() const {
-    size_t len = 0;
-    for( std::vector <std::string >::const_iterator it = m_ref_names.begin(); it != m_ref_names.end(); ++it ) {
-        len = std::max( len, it->size() );
+    index_writer w( name );
+
+    ref_index_header( index_flags(), key ).write( &w );
+
+    w.put<uint64_t>( m_ref_names.size() );
+    for( size_t i = 0; i < m_ref_names.size(); ++i ) {
+        w.put_string( m_ref_names[i] );
+        w.put_vector( m_ref_seqs[i] );
     }
 
-    return len;
-}
+    w.put<uint64_t>( align_qs_end_ - align_qs_begin_ );
+    for( size_t i = align_qs_begin_; i < align_qs_end_; ++i ) {
+        w.put_string( qs.name_at(i) );
+        w.put_vector( qs.seq_at(i) );
+    }
 
+    w.put<uint64_t>( m_ref_vecs.size() );
+    w.put<uint64_t>( pvec_size() );
 
-bool scoring_results::offer(size_t qs, size_t ref, int score) {
-    ivy_mike::lock_guard<ivy_mike::mutex> lock(mtx_);
+    for( size_t i = 0; i < m_ref_vecs.size(); ++i ) {
+        const packed_ref_vec &v = m_ref_vecs[i];
 
-    candss_.at( qs ).offer( score, ref );
+        w.put<uint64_t>( v.state_bits() );
+        w.put_bytes( v.state_data(), v.state_bytes() );
+        w.put_bytes( v.aux_data(), v.aux_bytes() );
+    }
 
-    if( best_score_.at(qs) < score || (best_score_.at(qs) == score && ref < best_ref_.at(qs))) {
-        best_score_[qs] = score;
-        best_ref_.at(qs) = ref;
-        return true;
+    assert( m_edge_nodes.size() == m_ref_vecs.size() );
+    for( size_t i = 0; i < m_edge_nodes.size(); ++i ) {
+        w.put<uint32_t>( m_edge_nodes[i].first );
+        w.put<uint32_t>( m_edge_nodes[i].second );
     }
 
-    return false;
+    w.put<uint64_t>( m_dir_state.get() != 0 );
+    if( m_dir_state.get() != 0 ) {
+        m_dir_state->write( &w );
+    }
 
+    w.close();
 }
 
+namespace {
 
+// sets a directional vector to states and aux flags taken from a directional_state (or packed by directional_vectors).
+// Only the vectors of the 'hard' gap model consist of plain states (see references::build_index_vecs).
+void restore_pvec( pvec_cgap &p, const std::vector<int> &states, const std::vector<unsigned int> &aux ) {
+    p.assign( states, aux );
+}
 
+void restore_pvec( pvec_pgap &, const std::vector<int> &, const std::vector<unsigned int> & ) {
+    throw std::logic_error( "directional vectors of the probabilistic gap model can not be restored" );
+}
 
-namespace papara {
-void scoring_results::candidates::offer(int score, size_t ref) {
+// memory used by a directional vector
+size_t pvec_bytes( pvec_cgap &p ) {
+    return p.get_v().size() * sizeof(parsimony_state) + p.get_auxv().size() * sizeof(int);
+}
 
-    candidate c( score,ref);
+size_t pvec_bytes( pvec_pgap &p ) {
+    return p.get_v().size() * sizeof(parsimony_state) + p.get_gap_prob().size1() * p.get_gap_prob().size2() * sizeof(double);
+}
 
-    insert(std::lower_bound( begin(), end(), c), c );
+// Directional ancestral state vectors of the reference tree, used by build_ref_vecs: for each inner lnode p, the vector of the
+// subtree 'behind' p (i.e., the subtree that does not contain p->back) is calculated from the vectors of its two children.
+// In contrast to the incremental newview on the tree itself (which keeps only one vector per node and re-orients it
+// for each edge), all vectors are kept at the same time, so that they can be calculated concurrently. The vectors are
+// grouped into levels, where each vector only depends on vectors of lower levels.
+// If packed is set (memory budget mode, where the vectors are kept during the scoring), the vectors are stored as packed
+// states and aux flags, and unpacked into temporaries whenever they are needed to calculate another vector. This is only
+// possible for the 'hard' gap model (see restore_pvec).
+template<typename pvec_t, typename seq_tag>
+class directional_vectors {
+    typedef my_adata_gen<pvec_t, seq_tag > my_adata;
 
-    if( size() > max_num_) {
-        pop_back();
-    }
-}
+public:
+    template<typename edge_iter>
+    directional_vectors( edge_iter start, edge_iter end, bool packed = false ) : packed_(packed) {
+        // each inner lnode is the endpoint of exactly one edge
+        for( ; start != end; ++start ) {
+            add_node( start->first );
+            add_node( start->second );
+        }
 
-bool scoring_results::candidate::operator<(const scoring_results::candidate& other) const {
-    if( score_ > other.score_ ) {
-        return true;
-    } else {
-        if( score_ == other.score_ ) {
-            return ref_ < other.ref_;
+        if( packed_ ) {
+            packed_pvecs_.resize( nodes_.size() );
         } else {
-            return false;
+            pvecs_.resize( nodes_.size() );
         }
-    }
-}
 
+        // Kahn's algorithm: a vector is ready, as soon as the vectors of all its inner children are finished
+        std::vector<size_t> num_pending( nodes_.size(), 0 );
+        std::vector<std::vector<size_t> > dependents( nodes_.size() );
 
-////////////////////////////////////////////////////////
-// driver stuff
-////////////////////////////////////////////////////////
+        for( size_t i = 0; i < nodes_.size(); ++i ) {
+            lnode *c[2] = { nodes_[i]->next->back, nodes_[i]->next->next->back };
+
+            for( size_t j = 0; j < 2; ++j ) {
+                if( !c[j]->m_data->isTip ) {
+                    dependents[index_of(c[j])].push_back(i);
+                    ++num_pending[i];
+                }
+            }
+        }
+
+        std::vector<size_t> level;
+        for( size_t i = 0; i < nodes_.size(); ++i ) {
+            if( num_pending[i] == 0 ) {
+                level.push_back(i);
+            }
+        }
+
+        while( !level.empty() ) {
+            std::vector<size_t> next_level;
+
+            for( std::vector<size_t>::iterator it = level.begin(); it != level.end(); ++it ) {
+                for( std::vector<size_t>::iterator dit = dependents[*it].begin(); dit != dependents[*it].end(); ++dit ) {
+                    if( --num_pending[*dit] == 0 ) {
+                        next_level.push_back( *dit );
+                    }
+                }
+            }
+
+            levels_.push_back( std::vector<size_t>() );
+            levels_.back().swap( level );
+            level.swap( next_level );
+        }
+    }
+
+    size_t num_levels() const {
+        return levels_.size();
+    }
+
+    const std::vector<size_t> &level_at( size_t i ) const {
+        return levels_.at(i);
+    }
+
+    // number of inner lnodes
+    size_t size() const {
+        return nodes_.size();
+    }
+
+    lnode *node_at( size_t i ) const {
+        return nodes_[i];
+    }
+
+    size_t index_of( lnode *n ) const {
+        typename std::map<lnode *, size_t>::const_iterator it = index_.find(n);
+        assert( it != index_.end() );
+
+        return it->second;
+    }
+
+    // only available if the vectors are not packed
+    pvec_t &pvec_of( size_t i ) {
+        assert( !packed_ );
+        return pvecs_[i];
+    }
+
+    // memory used by the vectors
+    size_t bytes() {
+        size_t b = 0;
+
+        for( size_t i = 0; i < packed_pvecs_.size(); ++i ) {
+            b += packed_pvecs_[i].bytes();
+        }
+
+        for( size_t i = 0; i < pvecs_.size(); ++i ) {
+            b += pvec_bytes( pvecs_[i] );
+        }
+
+        return b;
+    }
+
+    // calculate the vector of the i-th inner lnode. The vectors of its children must already be there.
+    void newview( size_t i ) {
+        lnode *n = nodes_[i];
+        lnode *n1 = n->next->back;
+        lnode *n2 = n->next->next->back;
+
+        pvec_t tmp1;
+        pvec_t tmp2;
+        pvec_t tmp_p;
+        pvec_t &p = packed_ ? tmp_p : pvecs_[i];
+
+        // same child order and tip cases as in rooted_traversal_order
+        if( n1->m_data->isTip && n2->m_data->isTip ) {
+            pvec_t::newview( p, pvec_at(n1, &tmp1), pvec_at(n2, &tmp2), n1->backLen, n2->backLen, TIP_TIP );
+        } else if( n1->m_data->isTip && !n2->m_data->isTip ) {
+            pvec_t::newview( p, pvec_at(n1, &tmp1), pvec_at(n2, &tmp2), n1->backLen, n2->backLen, TIP_INNER );
+        } else if( !n1->m_data->isTip && n2->m_data->isTip ) {
+            pvec_t::newview( p, pvec_at(n2, &tmp2), pvec_at(n1, &tmp1), n2->backLen, n1->backLen, TIP_INNER );
+        } else {
+            pvec_t::newview( p, pvec_at(n1, &tmp1), pvec_at(n2, &tmp2), n1->backLen, n2->backLen, INNER_INNER );
+        }
+
+        if( packed_ ) {
+            std::vector<int> states;
+            std::vector<unsigned int> aux;
+
+            p.to_int_vec( states );
+            p.to_aux_vec( aux );
+            packed_pvecs_[i].assign( states, aux );
+        }
+    }
+
+    // ancestral state vector at the edge between n1 and n2 (same as driver::do_newview). Only reads the directional
+    // vectors, so it can be called concurrently.
+    void root_newview( pvec_t &root_pvec, lnode *n1, lnode *n2 ) {
+        pvec_t tmp1;
+        pvec_t tmp2;
+
+        pvec_t &c1 = pvec_at(n1, &tmp1);
+        pvec_t &c2 = pvec_at(n2, &tmp2);
+
+        if( n1->m_data->isTip && n2->m_data->isTip ) {
+            pvec_t::newview(root_pvec, c1, c2, n1->backLen, n2->backLen, TIP_TIP );
+        } else if( n1->m_data->isTip && !n2->m_data->isTip ) {
+            pvec_t::newview(root_pvec, c1, c2, n1->backLen, n2->backLen, TIP_INNER );
+        } else if( !n1->m_data->isTip && n2->m_data->isTip ) {
+            pvec_t::newview(root_pvec, c2, c1, n1->backLen, n2->backLen, TIP_INNER );
+        } else {
+            pvec_t::newview(root_pvec, c1, c2, n1->backLen, n2->backLen, INNER_INNER );
+        }
+    }
+
+private:
+    void add_node( lnode *n ) {
+        if( !n->m_data->isTip ) {
+            index_.insert( std::make_pair( n, nodes_.size() ));
+            nodes_.push_back( n );
+        }
+    }
+
+    // the vector of a tip or of an inner lnode. Packed vectors are unpacked into tmp.
+    pvec_t &pvec_at( lnode *n, pvec_t *tmp ) {
+        if( n->m_data->isTip ) {
+            return n->m_data->get_as<my_adata>()->get_pvec();
+        } else if( !packed_ ) {
+            return pvecs_[index_of(n)];
+        } else {
+            std::vector<int> states;
+            std::vector<unsigned int> aux;
+
+            packed_pvecs_[index_of(n)].unpack( &states, &aux );
+            restore_pvec( *tmp, states, aux );
+
+            return *tmp;
+        }
+    }
+
+    const bool packed_;
+
+    std::vector<lnode *> nodes_;
+    std::map<lnode *, size_t> index_;
+    std::vector<pvec_t> pvecs_;
+    std::vector<packed_ref_vec> packed_pvecs_;
+    std::vector<std::vector<size_t> > levels_;
+};
+
+// calculates the vectors of one level of directional_vectors. The vectors are distributed round-robin over the threads.
+template<typename pvec_t, typename seq_tag>
+class dir_newview_worker {
+public:
+    dir_newview_worker( directional_vectors<pvec_t,seq_tag> *dv, const std::vector<size_t> &level, size_t rank, size_t n_threads )
+      : dv_(*dv), level_(level), rank_(rank), n_threads_(n_threads)
+    {}
+
+    void operator()() {
+        for( size_t i = rank_; i < level_.size(); i += n_threads_ ) {
+            dv_.newview( level_[i] );
+        }
+    }
+
+private:
+    directional_vectors<pvec_t,seq_tag> &dv_;
+    const std::vector<size_t> &level_;
+    const size_t rank_;
+    const size_t n_threads_;
+};
+
+// calculates the ancestral state vector at the edge between n1 and n2 from the directional vectors, and expands it from
+// site patterns to the columns of the reference alignment
+template<typename pvec_t, typename seq_tag>
+void build_edge_vec( directional_vectors<pvec_t,seq_tag> &dv, lnode *n1, lnode *n2, const std::vector<uint32_t> &site_patterns, packed_ref_vec *v ) {
+    pvec_t root_pvec;
+    dv.root_newview( root_pvec, n1, n2 );
+
+    std::vector<int> pattern_pvec;
+    std::vector<unsigned int> pattern_aux;
+
+    root_pvec.to_int_vec(pattern_pvec);
+    root_pvec.to_aux_vec(pattern_aux);
+
+    std::vector<int> pvec( site_patterns.size() );
+    std::vector<unsigned int> aux( site_patterns.size() );
+
+    for( size_t j = 0; j < site_patterns.size(); ++j ) {
+        pvec[j] = pattern_pvec[site_patterns[j]];
+        aux[j] = pattern_aux[site_patterns[j]];
+    }
+
+    v->assign( pvec, aux );
+}
+
+// calculates the ancestral state vectors of all edges. The edges are distributed round-robin over the threads.
+template<typename pvec_t, typename seq_tag>
+class ref_vec_worker {
+    typedef typename edge_collector<lnode>::container edge_container;
+
+public:
+    ref_vec_worker( directional_vectors<pvec_t,seq_tag> *dv, const edge_container &edges, const std::vector<uint32_t> &site_patterns, size_t rank, size_t n_threads, std::vector<packed_ref_vec> *ref_vecs )
+      : dv_(*dv), edges_(edges), site_patterns_(site_patterns), rank_(rank), n_threads_(n_threads), ref_vecs_(*ref_vecs)
+    {}
+
+    void operator()() {
+        for( size_t i = rank_; i < edges_.size(); i += n_threads_ ) {
+            build_edge_vec( dv_, edges_[i].first, edges_[i].second, site_patterns_, &ref_vecs_[i] );
+        }
+    }
+
+private:
+    directional_vectors<pvec_t,seq_tag> &dv_;
+    const edge_container &edges_;
+    const std::vector<uint32_t> &site_patterns_;
+    const size_t rank_;
+    const size_t n_threads_;
+
+    std::vector<packed_ref_vec> &ref_vecs_;
+};
+
+// builds the vectors of single edges on demand (memory budget mode, see references::build_ref_vecs). The directional
+// vectors are only read, so the scoring threads can share them.
+template<typename pvec_t, typename seq_tag>
+class lazy_ref_vec_builder : public ref_vec_cache::builder {
+    typedef typename edge_collector<lnode>::container edge_container;
+
+public:
+    lazy_ref_vec_builder( sptr::shared_ptr<directional_vectors<pvec_t,seq_tag> > dv, const edge_container &edges, const std::vector<uint32_t> &site_patterns )
+      : dv_(dv), edges_(edges), site_patterns_(site_patterns)
+    {}
+
+    void build( size_t edge, packed_ref_vec *v ) const {
+        build_edge_vec( *dv_, edges_.at(edge).first, edges_.at(edge).second, site_patterns_, v );
+    }
+
+private:
+    sptr::shared_ptr<directional_vectors<pvec_t,seq_tag> > dv_;
+    const edge_container &edges_;
+    const std::vector<uint32_t> &site_patterns_;
+};
+
+// shared_ptr to an object that is owned by someone else
+struct null_deleter {
+    void operator()( const void * ) const {}
+};
+
+// calculates the directional vectors and the vectors of the edges of a tree, and takes them from the directional_state of
+// an older version of the tree (if not 0) where possible (see ref_update.h): each subtree of the new tree is matched to
+// a subtree of the old tree with the same vector (tips: same name and sequence). A directional vector whose two
+// children match the children of an old one is copied, all others are calculated and matched to an old vector with
+// equal states (the old vectors of their children, or the parents of these), so that the copying resumes above the
+// changed parts of the tree.
+//
+// The copied vectors are only unpacked if they are needed to calculate another vector, so the work is proportional to
+// the number of vectors that change. Each level (and the edges) is processed in three steps: plan (sequential) decides
+// which vectors are copied, restored or calculated, then the vectors are restored and calculated concurrently.
+template<typename pvec_t, typename seq_tag>
+class incremental_update {
+    typedef directional_state::ref ref;
+    typedef typename edge_collector<lnode>::container edge_container;
+
+public:
+    // tips: index of the reference sequence of each tip. tip_match: matching old tip of each reference sequence (or
+    // no_ref). old_vecs: the vectors of the edges of the old tree (the canonical edge of each edge, so that the copies
+    // do not point into other vectors).
+    incremental_update( directional_vectors<pvec_t,seq_tag> *dv, const edge_container &edges, const std::vector<uint32_t> &site_patterns, const std::map<lnode *, size_t> &tips, const directional_state *old, const std::vector<ref> &tip_match, const std::vector<const packed_ref_vec *> &old_vecs )
+      : dv_(*dv), edges_(edges), site_patterns_(site_patterns), tips_(tips), old_(old), tip_match_(tip_match), old_vecs_(old_vecs),
+        same_patterns_(false), dir_match_(dv->size(), directional_state::no_ref), dir_status_(dv->size(), pending), num_edges_calculated_(0)
+    {
+        if( old_ == 0 ) {
+            return;
+        }
+
+        assert( old_->site_patterns().size() == site_patterns_.size() );
+
+        // the packed old vectors can be used as they are if the patterns did not change
+        same_patterns_ = old_->site_patterns() == site_patterns_;
+
+        // first column of each new pattern, and the distinct pairs of new and old patterns of the columns
+        for( size_t j = 0; j < site_patterns_.size(); ++j ) {
+            if( site_patterns_[j] >= pattern_cols_.size() ) {
+                pattern_cols_.resize( site_patterns_[j] + 1, size_t(-1) );
+            }
+            if( pattern_cols_[site_patterns_[j]] == size_t(-1) ) {
+                pattern_cols_[site_patterns_[j]] = j;
+            }
+
+            pattern_pairs_.push_back( std::make_pair( site_patterns_[j], old_->site_patterns()[j] ));
+        }
+
+        std::sort( pattern_pairs_.begin(), pattern_pairs_.end() );
+        pattern_pairs_.erase( std::unique( pattern_pairs_.begin(), pattern_pairs_.end() ), pattern_pairs_.end() );
+    }
+
+    // the subtree behind lnode n, in the numbering of the new tree
+    ref subtree_of( lnode *n ) const {
+        if( n->m_data->isTip ) {
+            return directional_state::tip_ref( tip_at(n) );
+        } else {
+            return directional_state::dir_ref( dv_.index_of(n) );
+        }
+    }
+
+    // copies the directional vectors of a level that match an old vector. Returns the vectors that must be calculated
+    // in calc, and the copied vectors of lower levels they need in restore.
+    void plan_level( const std::vector<size_t> &level, std::vector<size_t> *calc, std::vector<size_t> *restore ) {
+        calc->clear();
+        restore->clear();
+
+        for( std::vector<size_t>::const_iterator it = level.begin(); it != level.end(); ++it ) {
+            lnode *n = dv_.node_at(*it);
+            lnode *c1 = n->next->back;
+            lnode *c2 = n->next->next->back;
+
+            const ref r1 = old_match( c1 );
+            const ref r2 = old_match( c2 );
+
+            if( r1 != directional_state::no_ref && r2 != directional_state::no_ref ) {
+                const ref r = old_->find_dir( r1, r2 );
+
+                if( r != directional_state::no_ref ) {
+                    dir_match_[*it] = r;
+                    dir_status_[*it] = copied;
+                    continue;
+                }
+            }
+
+            calc->push_back( *it );
+            need( c1, restore );
+            need( c2, restore );
+        }
+    }
+
+    // copies the vectors of the edges that match an old edge, same as plan_level
+    void plan_edges( std::vector<packed_ref_vec> *ref_vecs, std::vector<size_t> *calc, std::vector<size_t> *restore ) {
+        calc->clear();
+        restore->clear();
+
+        for( size_t i = 0; i < edges_.size(); ++i ) {
+            lnode *n1 = edges_[i].first;
+            lnode *n2 = edges_[i].second;
+
+            const ref r1 = old_match( n1 );
+            const ref r2 = old_match( n2 );
+
+            if( r1 != directional_state::no_ref && r2 != directional_state::no_ref ) {
+                const size_t e = old_->find_edge( r1, r2 );
+
+                if( e != size_t(-1) ) {
+                    (*ref_vecs)[i] = *old_vecs_[e];
+                    continue;
+                }
+            }
+
+            calc->push_back( i );
+            need( n1, restore );
+            need( n2, restore );
+        }
+
+        num_edges_calculated_ = calc->size();
+    }
+
+    // unpacks the old vector of copied directional vector i
+    void restore_dir( size_t i ) {
+        std::vector<int> states;
+        std::vector<unsigned int> aux;
+
+        unpack_old( i, &states, &aux );
+        restore_pvec( dv_.pvec_of(i), states, aux );
+    }
+
+    // calculates directional vector i (the vectors of its children must be there)
+    void calc_dir( size_t i ) {
+        dv_.newview(i);
+        dir_status_[i] = calculated;
+
+        if( old_ != 0 ) {
+            lnode *n = dv_.node_at(i);
+            dir_match_[i] = find_equal( dv_.pvec_of(i), old_match( n->next->back ), old_match( n->next->next->back ));
+        }
+    }
+
+    void calc_edge( size_t i, packed_ref_vec *v ) {
+        build_edge_vec( dv_, edges_[i].first, edges_[i].second, site_patterns_, v );
+    }
+
+    // packed directional vector i (at the resolution of the new site patterns)
+    void pack_dir( size_t i, packed_ref_vec *v ) const {
+        if( dir_status_[i] != calculated && same_patterns_ ) {
+            *v = old_->dir_at( directional_state::index_of( dir_match_[i] ));
+            return;
+        }
+
+        std::vector<int> states;
+        std::vector<unsigned int> aux;
+
+        if( dir_status_[i] == copied ) {
+            unpack_old( i, &states, &aux );
+        } else {
+            dv_.pvec_of(i).to_int_vec( states );
+            dv_.pvec_of(i).to_aux_vec( aux );
+        }
+
+        v->assign( states, aux );
+    }
+
+    size_t num_dirs_calculated() const {
+        return std::count( dir_status_.begin(), dir_status_.end(), uint8_t(calculated) );
+    }
+
+    size_t num_edges_calculated() const {
+        return num_edges_calculated_;
+    }
+
+private:
+    // status of each directional vector: copied vectors are only in the old state, restored ones are unpacked into dv_
+    enum { pending, copied, restored, calculated };
+
+    size_t tip_at( lnode *n ) const {
+        std::map<lnode *, size_t>::const_iterator it = tips_.find(n);
+        assert( it != tips_.end() );
+
+        return it->second;
+    }
+
+    // the old subtree with the same vector as the subtree behind n (or no_ref)
+    ref old_match( lnode *n ) const {
+        if( old_ == 0 ) {
+            return directional_state::no_ref;
+        } else if( n->m_data->isTip ) {
+            return tip_match_[tip_at(n)];
+        } else {
+            return dir_match_[dv_.index_of(n)];
+        }
+    }
+
+    // marks the vector behind n for restoring, if it is only in the old state
+    void need( lnode *n, std::vector<size_t> *restore ) {
+        if( n->m_data->isTip ) {
+            return;
+        }
+
+        const size_t i = dv_.index_of(n);
+
+        if( dir_status_[i] == copied ) {
+            dir_status_[i] = restored;
+            restore->push_back(i);
+        }
+    }
+
+    // the old vector of copied directional vector i, at the resolution of the new site patterns. All columns of a new
+    // pattern have the same states in the vectors that can be copied.
+    void unpack_old( size_t i, std::vector<int> *states, std::vector<unsigned int> *aux ) const {
+        const packed_ref_vec &v = old_->dir_at( directional_state::index_of( dir_match_[i] ));
+
+        if( same_patterns_ ) {
+            v.unpack( states, aux );
+            return;
+        }
+
+        std::vector<int> old_states;
+        std::vector<unsigned int> old_aux;
+        v.unpack( &old_states, &old_aux );
+
+        states->resize( pattern_cols_.size() );
+        aux->resize( pattern_cols_.size() );
+
+        for( size_t p = 0; p < pattern_cols_.size(); ++p ) {
+            const uint32_t op = old_->site_patterns()[pattern_cols_[p]];
+
+            (*states)[p] = old_states[op];
+            (*aux)[p] = old_aux[op];
+        }
+    }
+
+    // an old directional vector with the same states as p: the matches of the children of p, or their parents
+    ref find_equal( pvec_t &p, ref r1, ref r2 ) const {
+        std::vector<int> states;
+        std::vector<unsigned int> aux;
+        p.to_int_vec( states );
+        p.to_aux_vec( aux );
+
+        std::vector<int> old_states;
+        std::vector<unsigned int> old_aux;
+
+        const ref rs[2] = { r1, r2 };
+
+        for( size_t k = 0; k < 2; ++k ) {
+            if( rs[k] == directional_state::no_ref ) {
+                continue;
+            }
+
+            // the tip cases of the parents must not change, so only directional vectors are candidates
+            if( !directional_state::is_tip( rs[k] ) && is_equal( states, aux, rs[k], &old_states, &old_aux )) {
+                return rs[k];
+            }
+
+            const std::pair<const ref *, const ref *> parents = old_->parents_of( rs[k] );
+            for( const ref *it = parents.first; it != parents.second; ++it ) {
+                if( is_equal( states, aux, *it, &old_states, &old_aux )) {
+                    return *it;
+                }
+            }
+        }
+
+        return directional_state::no_ref;
+    }
+
+    bool is_equal( const std::vector<int> &states, const std::vector<unsigned int> &aux, ref r, std::vector<int> *old_states, std::vector<unsigned int> *old_aux ) const {
+        old_->dir_at( directional_state::index_of(r) ).unpack( old_states, old_aux );
+
+        for( std::vector<std::pair<uint32_t,uint32_t> >::const_iterator it = pattern_pairs_.begin(); it != pattern_pairs_.end(); ++it ) {
+            if( states[it->first] != (*old_states)[it->second] || aux[it->first] != (*old_aux)[it->second] ) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    directional_vectors<pvec_t,seq_tag> &dv_;
+    const edge_container &edges_;
+    const std::vector<uint32_t> &site_patterns_;
+    const std::map<lnode *, size_t> &tips_;
+
+    const directional_state *old_;
+    const std::vector<ref> &tip_match_;
+    const std::vector<const packed_ref_vec *> &old_vecs_;
+
+    bool same_patterns_;
+    std::vector<size_t> pattern_cols_;
+    std::vector<std::pair<uint32_t,uint32_t> > pattern_pairs_;
+
+    // calc_dir and restore_dir write the elements of their vectors only
+    std::vector<ref> dir_match_;
+    std::vector<uint8_t> dir_status_;
+
+    size_t num_edges_calculated_;
+};
+
+// restores or calculates a list of directional vectors (see incremental_update), distributed round-robin over the threads
+template<typename pvec_t, typename seq_tag>
+class incremental_dir_worker {
+public:
+    typedef void (incremental_update<pvec_t,seq_tag>::*step_t)( size_t );
+
+    incremental_dir_worker( incremental_update<pvec_t,seq_tag> *update, step_t step, const std::vector<size_t> &dirs, size_t rank, size_t n_threads )
+      : update_(*update), step_(step), dirs_(dirs), rank_(rank), n_threads_(n_threads)
+    {}
+
+    void operator()() {
+        for( size_t i = rank_; i < dirs_.size(); i += n_threads_ ) {
+            (update_.*step_)( dirs_[i] );
+        }
+    }
+
+private:
+    incremental_update<pvec_t,seq_tag> &update_;
+    const step_t step_;
+    const std::vector<size_t> &dirs_;
+    const size_t rank_;
+    const size_t n_threads_;
+};
+
+// calculates the vectors of a list of edges, distributed round-robin over the threads
+template<typename pvec_t, typename seq_tag>
+class incremental_edge_worker {
+public:
+    incremental_edge_worker( incremental_update<pvec_t,seq_tag> *update, const std::vector<size_t> &edges, size_t rank, size_t n_threads, std::vector<packed_ref_vec> *ref_vecs )
+      : update_(*update), edges_(edges), rank_(rank), n_threads_(n_threads), ref_vecs_(*ref_vecs)
+    {}
+
+    void operator()() {
+        for( size_t i = rank_; i < edges_.size(); i += n_threads_ ) {
+            update_.calc_edge( edges_[i], &ref_vecs_[edges_[i]] );
+        }
+    }
+
+private:
+    incremental_update<pvec_t,seq_tag> &update_;
+    const std::vector<size_t> &edges_;
+    const size_t rank_;
+    const size_t n_threads_;
+
+    std::vector<packed_ref_vec> &ref_vecs_;
+};
+
+// packs the directional vectors (see incremental_update::pack_dir), distributed round-robin over the threads
+template<typename pvec_t, typename seq_tag>
+class incremental_pack_worker {
+public:
+    incremental_pack_worker( const incremental_update<pvec_t,seq_tag> *update, size_t rank, size_t n_threads, std::vector<packed_ref_vec> *dirs )
+      : update_(*update), rank_(rank), n_threads_(n_threads), dirs_(*dirs)
+    {}
+
+    void operator()() {
+        for( size_t i = rank_; i < dirs_.size(); i += n_threads_ ) {
+            update_.pack_dir( i, &dirs_[i] );
+        }
+    }
+
+private:
+    const incremental_update<pvec_t,seq_tag> &update_;
+    const size_t rank_;
+    const size_t n_threads_;
+
+    std::vector<packed_ref_vec> &dirs_;
+};
+
+// runs one step of incremental_update on a list of directional vectors. Small lists are processed without threads.
+template<typename pvec_t, typename seq_tag>
+void run_dir_workers( incremental_update<pvec_t,seq_tag> *update, typename incremental_dir_worker<pvec_t,seq_tag>::step_t step, const std::vector<size_t> &dirs, size_t n_threads ) {
+    typedef incremental_dir_worker<pvec_t,seq_tag> worker_t;
+
+    const size_t threads = dirs.size() >= 2 * n_threads ? n_threads : 1;
+
+    ivy_mike::thread_group tg;
+    for( size_t r = 1; r < threads; ++r ) {
+        tg.create_thread( worker_t( update, step, dirs, r, threads ));
+    }
+
+    worker_t w0( update, step, dirs, 0, threads );
+    w0();
+
+    tg.join_all();
+}
+
+}
+
+template<typename pvec_t, typename seq_tag>
+void references<pvec_t,seq_tag>::build_ref_vecs( size_t n_threads, size_t mem_limit ) {
+    // pre-create the ancestral state vectors. This step is necessary for the threaded version, because otherwise, each
+    // thread would need an independent copy of the tree to do concurrent newviews. Anyway, having a copy of the tree
+    // in each thread will most likely use more memory than storing the pre-calculated vectors.
+    //
+    // If the vectors do not fit into mem_limit, only the directional vectors are kept, and the vectors of the edges
+    // are created lazily by the scoring threads and cached (see ref_vec_cache.h).
+
+    ivy_mike::timer t1;
+
+    typedef directional_vectors<pvec_t,seq_tag> dir_vecs_t;
+    typedef dir_newview_worker<pvec_t,seq_tag> dir_worker_t;
+    typedef ref_vec_worker<pvec_t,seq_tag> ref_worker_t;
+
+    assert( m_ref_vecs.empty() && !lazy_ref_vecs() );
+
+    n_threads = std::max( n_threads, size_t(1) );
+
+    // with a memory limit, the directional vectors may be kept during the scoring, so they are packed where possible
+    const bool pack_dir_vecs = mem_limit != 0 && ivy_mike::same_type<pvec_t,pvec_cgap>::result;
+
+    sptr::shared_ptr<dir_vecs_t> dir_vecs_ptr( new dir_vecs_t( m_ec.m_edges.begin(), m_ec.m_edges.end(), pack_dir_vecs ));
+    dir_vecs_t &dir_vecs = *dir_vecs_ptr;
+
+    for( size_t l = 0; l < dir_vecs.num_levels(); ++l ) {
+        const std::vector<size_t> &level = dir_vecs.level_at(l);
+
+        // it is not worth to start threads for small levels (e.g., in caterpillar-like parts of the tree)
+        const size_t level_threads = level.size() >= 2 * n_threads ? n_threads : 1;
+
+        ivy_mike::thread_group tg;
+        for( size_t r = 1; r < level_threads; ++r ) {
+            tg.create_thread( dir_worker_t( &dir_vecs, level, r, level_threads ));
+        }
+
+        dir_worker_t w0( &dir_vecs, level, 0, level_threads );
+        w0();
+
+        tg.join_all();
+    }
+
+    if( mem_limit != 0 && !m_ec.m_edges.empty() ) {
+        // estimate the size of all vectors from the first one
+        packed_ref_vec probe;
+        build_edge_vec( dir_vecs, m_ec.m_edges.front().first, m_ec.m_edges.front().second, m_site_patterns, &probe );
+
+        const double all_bytes = double(probe.bytes()) * m_ec.m_edges.size();
+
+        if( all_bytes > mem_limit ) {
+            // the directional vectors stay in memory, so they count against the limit
+            const size_t dir_bytes = dir_vecs.bytes();
+
+            if( dir_bytes >= mem_limit ) {
+                std::stringstream ss;
+                ss << "memory limit too small: the directional vectors alone need " << dir_bytes / (1024 * 1024) + 1 << "mb";
+
+                if( !pack_dir_vecs ) {
+                    ss << " (they are stored more compactly with -c)";
+                }
+
+                throw std::runtime_error( ss.str() );
+            }
+
+            const size_t cache_bytes = mem_limit - dir_bytes;
+
+#ifdef __GLIBC__
+            // the cached vectors are small and long-lived, while the kernels allocate large temporary buffers for each
+            // tile. With glibc's dynamic mmap threshold these buffers are taken from the heap as soon as the first one is
+            // freed, and the cached vectors fragment it (the process grew to twice the size it has without -M). A fixed
+            // threshold keeps the large buffers out of the heap.
+            mallopt( M_MMAP_THRESHOLD, 128 * 1024 );
+#endif
+
+            m_lazy_builder.reset( new lazy_ref_vec_builder<pvec_t,seq_tag>( dir_vecs_ptr, m_ec.m_edges, m_site_patterns ));
+            m_ref_vec_cache.reset( new ref_vec_cache( m_lazy_builder.get(), cache_bytes ));
+
+            share_duplicate_vecs();
+
+            lout << "ancestral state vectors: built on demand (all edges: " << size_t(all_bytes / (1024 * 1024)) << "mb, directional vectors: " << dir_bytes / (1024 * 1024) << "mb, cache: " << cache_bytes / (1024 * 1024) << "mb): " << t1.elapsed() << "s" << std::endl;
+            return;
+        }
+    }
+
+    m_ref_vecs.resize( m_ec.m_edges.size() );
+
+    {
+        ivy_mike::thread_group tg;
+        for( size_t r = 1; r < n_threads; ++r ) {
+            tg.create_thread( ref_worker_t( &dir_vecs, m_ec.m_edges, m_site_patterns, r, n_threads, &m_ref_vecs ));
+        }
+
+        ref_worker_t w0( &dir_vecs, m_ec.m_edges, m_site_patterns, 0, n_threads, &m_ref_vecs );
+        w0();
+
+        tg.join_all();
+    }
+
+    share_duplicate_vecs();
+
+    size_t ref_bytes = 0;
+    for( std::vector<uint32_t>::const_iterator it = m_distinct_edges.begin(); it != m_distinct_edges.end(); ++it ) {
+        ref_bytes += m_ref_vecs[*it].bytes();
+    }
+
+    lout << "ancestral state vectors: " << ref_bytes / (1024 * 1024) << "mb (" << m_distinct_edges.size() << " distinct of " << m_ref_vecs.size() << " edges)" << std::endl;
+
+//     std::cout << "pvecs created: " << t1.elapsed() << "\n";
+
+}
+
+template<typename pvec_t, typename seq_tag>
+void references<pvec_t,seq_tag>::build_index_vecs( size_t n_threads, const references *previous ) {
+    // the directional vectors of the probabilistic gap model can not be stored as states (and all of them depend on the
+    // gap frequencies of the whole alignment anyway), so they are always rebuilt.
+    if( !ivy_mike::same_type<pvec_t,pvec_cgap>::result ) {
+        if( previous != 0 ) {
+            lout << "incremental update is only supported for the 'hard' gap model (-c): rebuilding all vectors\n";
+        }
+
+        build_ref_vecs( n_threads );
+        return;
+    }
+
+    ivy_mike::timer t1;
+
+    typedef directional_vectors<pvec_t,seq_tag> dir_vecs_t;
+    typedef incremental_update<pvec_t,seq_tag> update_t;
+    typedef incremental_edge_worker<pvec_t,seq_tag> edge_worker_t;
+    typedef incremental_pack_worker<pvec_t,seq_tag> pack_worker_t;
+
+    assert( m_ref_vecs.empty() && !lazy_ref_vecs() );
+
+    n_threads = std::max( n_threads, size_t(1) );
+
+    const directional_state *old = previous != 0 ? previous->dir_state() : 0;
+
+    if( previous != 0 && old == 0 ) {
+        lout << "the previous references contain no directional vectors: rebuilding all vectors\n";
+    } else if( old != 0 && old->site_patterns().size() != m_site_patterns.size() ) {
+        lout << "the number of alignment columns changed: rebuilding all vectors\n";
+        old = 0;
+    }
+
+    // reference sequence of each tip, and the old tip with the same name and sequence
+    std::map<std::string, size_t> name_index;
+    for( size_t i = 0; i < m_ref_names.size(); ++i ) {
+        name_index[m_ref_names[i]] = i;
+    }
+
+    std::map<lnode *, size_t> tips;
+    for( typename edge_collector<lnode>::container::const_iterator it = m_ec.m_edges.begin(); it != m_ec.m_edges.end(); ++it ) {
+        lnode *ns[2] = { it->first, it->second };
+
+        for( size_t j = 0; j < 2; ++j ) {
+            if( ns[j]->m_data->isTip ) {
+                tips[ns[j]] = name_index.at( ns[j]->m_data->tipName );
+            }
+        }
+    }
+
+    std::vector<directional_state::ref> tip_match( m_ref_seqs.size(), directional_state::no_ref );
+    if( old != 0 ) {
+        for( size_t i = 0; i < previous->num_seqs(); ++i ) {
+            std::map<std::string, size_t>::const_iterator it = name_index.find( previous->name_at(i) );
+
+            if( it != name_index.end() && m_ref_seqs[it->second] == previous->seq_at(i) ) {
+                tip_match[it->second] = directional_state::tip_ref(i);
+            }
+        }
+    }
+
+    // the old vectors of the edges (the canonical ones, see incremental_update). They are only copied, and they stay
+    // valid as long as the index of the previous references is kept.
+    std::vector<const packed_ref_vec *> old_vecs;
+    if( old != 0 ) {
+        old_vecs.resize( previous->num_pvecs() );
+
+        for( size_t i = 0; i < old_vecs.size(); ++i ) {
+            old_vecs[i] = &previous->ref_vec_at( previous->canonical_edge(i) );
+        }
+
+        index_ = previous->index_;
+    }
+
+    dir_vecs_t dir_vecs( m_ec.m_edges.begin(), m_ec.m_edges.end() );
+    update_t update( &dir_vecs, m_ec.m_edges, m_site_patterns, tips, old, tip_match, old_vecs );
+
+    std::vector<size_t> calc;
+    std::vector<size_t> restore;
+
+    for( size_t l = 0; l < dir_vecs.num_levels(); ++l ) {
+        update.plan_level( dir_vecs.level_at(l), &calc, &restore );
+
+        run_dir_workers( &update, &update_t::restore_dir, restore, n_threads );
+        run_dir_workers( &update, &update_t::calc_dir, calc, n_threads );
+    }
+
+    m_ref_vecs.resize( m_ec.m_edges.size() );
+
+    update.plan_edges( &m_ref_vecs, &calc, &restore );
+    run_dir_workers( &update, &update_t::restore_dir, restore, n_threads );
+
+    {
+        const size_t edge_threads = calc.size() >= 2 * n_threads ? n_threads : 1;
+
+        ivy_mike::thread_group tg;
+        for( size_t r = 1; r < edge_threads; ++r ) {
+            tg.create_thread( edge_worker_t( &update, calc, r, edge_threads, &m_ref_vecs ));
+        }
+
+        edge_worker_t w0( &update, calc, 0, edge_threads, &m_ref_vecs );
+        w0();
+
+        tg.join_all();
+    }
+
+    // keep the directional vectors for write_index, in the numbering of this tree
+    std::vector<packed_ref_vec> packed_dirs( dir_vecs.size() );
+
+    {
+        ivy_mike::thread_group tg;
+        for( size_t r = 1; r < n_threads; ++r ) {
+            tg.create_thread( pack_worker_t( &update, r, n_threads, &packed_dirs ));
+        }
+
+        pack_worker_t w0( &update, 0, n_threads, &packed_dirs );
+        w0();
+
+        tg.join_all();
+    }
+
+    m_dir_state.reset( new directional_state( m_site_patterns ));
+
+    for( size_t i = 0; i < dir_vecs.size(); ++i ) {
+        lnode *n = dir_vecs.node_at(i);
+        m_dir_state->add_dir( update.subtree_of( n->next->back ), update.subtree_of( n->next->next->back ), packed_dirs[i] );
+    }
+
+    for( typename edge_collector<lnode>::container::const_iterator it = m_ec.m_edges.begin(); it != m_ec.m_edges.end(); ++it ) {
+        m_dir_state->add_edge( update.subtree_of( it->first ), update.subtree_of( it->second ));
+    }
+
+    m_dir_state->finish();
+
+    share_duplicate_vecs();
+
+    lout << "ancestral state vectors: " << m_distinct_edges.size() << " distinct of " << m_ref_vecs.size() << " edges, recalculated: " << update.num_dirs_calculated() << " of " << dir_vecs.size() << " directional vectors, " << update.num_edges_calculated() << " of " << m_ref_vecs.size() << " edges: " << t1.elapsed() << "s" << std::endl;
+}
+
+template<typename pvec_t, typename seq_tag>
+ref_vec_cache::handle references<pvec_t,seq_tag>::get_ref_vec( size_t i ) const {
+    if( lazy_ref_vecs() ) {
+        return m_ref_vec_cache->get( i );
+    }
+
+    return ref_vec_cache::handle( &m_ref_vecs.at(i), null_deleter() );
+}
+
+template<typename pvec_t, typename seq_tag>
+void references<pvec_t,seq_tag>::share_duplicate_vecs() {
+    const size_t num_edges = num_pvecs();
+
+    // the vectors built on demand are not known up front, so they are all treated as distinct
+    if( lazy_ref_vecs() ) {
+        m_canonical_edges.resize( num_edges );
+        m_distinct_edges.resize( num_edges );
+        m_duplicate_edges.assign( num_edges, std::vector<uint32_t>() );
+
+        for( size_t i = 0; i < num_edges; ++i ) {
+            m_canonical_edges[i] = uint32_t(i);
+            m_distinct_edges[i] = uint32_t(i);
+        }
+
+        return;
+    }
+
+    // hash of the packed data of each edge. Edges with equal hashes are compared byte by byte.
+    std::vector<std::pair<uint64_t,uint32_t> > hashes( num_edges );
+
+    for( size_t i = 0; i < num_edges; ++i ) {
+        const packed_ref_vec &v = m_ref_vecs[i];
+        const uint64_t state_bits = v.state_bits();
+
+        content_hash h;
+        h.update( &state_bits, sizeof(state_bits) );
+        h.update( v.state_data(), v.state_bytes() );
+        h.update( v.aux_data(), v.aux_bytes() );
+
+        hashes[i] = std::make_pair( h.value(), uint32_t(i) );
+    }
+
+    std::sort( hashes.begin(), hashes.end() );
+
+    m_canonical_edges.resize( num_edges );
+    m_duplicate_edges.assign( num_edges, std::vector<uint32_t>() );
+
+    std::vector<uint32_t> canon;
+
+    for( size_t b = 0; b < num_edges; ) {
+        size_t e = b + 1;
+        while( e < num_edges && hashes[e].first == hashes[b].first ) {
+            ++e;
+        }
+
+        // within a run, the edges are in ascending order, so the first edge of each vector is its canonical edge
+        canon.clear();
+
+        for( size_t k = b; k < e; ++k ) {
+            const uint32_t edge = hashes[k].second;
+            const packed_ref_vec &v = m_ref_vecs[edge];
+
+            size_t c = 0;
+            for( ; c < canon.size(); ++c ) {
+                const packed_ref_vec &cv = m_ref_vecs[canon[c]];
+
+                if( cv.state_bits() == v.state_bits()
+                    && std::equal( v.state_data(), v.state_data() + v.state_bytes(), cv.state_data() )
+                    && std::equal( v.aux_data(), v.aux_data() + v.aux_bytes(), cv.aux_data() ))
+                {
+                    break;
+                }
+            }
+
+            if( c == canon.size() ) {
+                canon.push_back( edge );
+            }
+
+            m_canonical_edges[edge] = canon[c];
+        }
+
+        b = e;
+    }
+
+    m_distinct_edges.clear();
+
+    for( size_t i = 0; i < num_edges; ++i ) {
+        const uint32_t c = m_canonical_edges[i];
+
+        if( c == i ) {
+            m_distinct_edges.push_back( c );
+        } else {
+            const packed_ref_vec &cv = m_ref_vecs[c];
+
+            m_duplicate_edges[c].push_back( uint32_t(i) );
+            m_ref_vecs[i].bind( cv.size(), cv.state_bits(), cv.state_data(), cv.aux_data() );
+        }
+    }
+}
+
+template<typename pvec_t, typename seq_tag>
+const std::vector<int> &references<pvec_t,seq_tag>::ng_map_at( size_t i ) {
+    std::vector<int> &ng_map = ref_ng_map_.at(i);
+    
+    if( !ng_map.empty() ) {
+        return ng_map;
+    }
+    
+    //std::vector<int> map;
+    
+    std::vector< uint8_t > &seq = m_ref_seqs.at(i);
+    assert( seq.size() < size_t(std::numeric_limits<int>::max()) );
+    for( size_t i = 0; i < seq.size(); ++i ) {
+        bool is_gap = seq_model::pstate_is_gap( seq_model::s2p(seq[i]));
+        
+        if( !is_gap ) {
+            ng_map.push_back(int(i));
+        }
+    }
+    
+    //ng_map.shrink_to_fit();
+    std::vector<int>(ng_map).swap(ng_map); // old fashioned shrink_to_fit
+    
+    return ng_map;
+}
+
+
+template<typename pvec_t, typename seq_tag>
+void references<pvec_t,seq_tag>::write_pvecs(const char* name) {
+    std::ofstream os( name );
+
+    std::vector<int> pvec;
+    std::vector<unsigned int> aux;
+
+    os << m_ref_vecs.size();
+    for( size_t i = 0; i < m_ref_vecs.size(); ++i ) {
+        m_ref_vecs[i].unpack( &pvec, &aux );
+
+        os << " " << pvec.size() << " ";
+        os.write( (char *)pvec.data(), pvec.size() * sizeof(int));
+        os.write( (char *)aux.data(), aux.size() * sizeof(unsigned int));
+    }
+}
+
+template<typename pvec_t, typename seq_tag>
+size_t references<pvec_t,seq_tag>::max_name_length() const {
+    size_t len = 0;
+    for( std::vector <std::string >::const_iterator it = m_ref_names.begin(); it != m_ref_names.end(); ++it ) {
+        len = std::max( len, it->size() );
+    }
+
+    return len;
+}
+
+
+bool scoring_results::offer(size_t qs, size_t ref, int score) {
+    ivy_mike::lock_guard<ivy_mike::mutex> lock(mtx_);
+
+    candss_.at( qs ).offer( score, ref );
+
+    return update_best( qs, ref, score, std::make_pair(-1, -1) );
+}
+
+void scoring_results::merge( const scoring_results &other ) {
+    ivy_mike::lock_guard<ivy_mike::mutex> lock(mtx_);
+
+    if( best_score_.size() != other.best_score_.size() ) {
+        throw std::runtime_error( "inconsistent sizes in scoring_results::merge" );
+    }
+
+    for( size_t i = 0; i < best_score_.size(); ++i ) {
+        const candidates &other_cands = other.candss_[i];
+
+        for( size_t j = 0; j < other_cands.size(); ++j ) {
+            candss_[i].offer( other_cands[j].score(), other_cands[j].ref() );
+        }
+
+        if( other.best_ref_[i] != size_t(-1) ) {
+            update_best( i, other.best_ref_[i], other.best_score_[i], other.best_end_[i] );
+        }
+    }
+}
+
+
+
+
+namespace papara {
+void scoring_results::candidates::offer(int score, size_t ref) {
+
+    candidate c( score,ref);
+
+    insert(std::lower_bound( begin(), end(), c), c );
+
+    if( size() > max_num_) {
+        pop_back();
+    }
+}
+
+bool scoring_results::candidate::operator<(const scoring_results::candidate& other) const {
+    if( score_ > other.score_ ) {
+        return true;
+    } else {
+        if( score_ == other.score_ ) {
+            return ref_ < other.ref_;
+        } else {
+            return false;
+        }
+    }
+}
+
+
+////////////////////////////////////////////////////////
+// driver stuff
+////////////////////////////////////////////////////////
+
+// size of the memory for the profile of one ref-block, padded so that consecutive profiles stay aligned
+static size_t profile_stride( const scoring_kernel_factory &kernels, size_t ref_len ) {
+    const size_t al = scoring_kernel_factory::profile_alignment;
+
+    return (kernels.shared_profile_bytes( ref_len ) + al - 1) / al * al;
+}
+
+// builds the shared profiles of the ref-blocks. The blocks are distributed round-robin over the threads.
+template<typename seq_tag>
+class profile_worker {
+    typedef typename block_queue<seq_tag>::block_t block_t;
+
+public:
+    profile_worker( const std::vector<block_t> &blocks, const scoring_kernel_factory &kernels, uint8_t *arena, size_t stride, size_t rank, size_t n_threads )
+      : blocks_(blocks), kernels_(kernels), arena_(arena), stride_(stride), rank_(rank), n_threads_(n_threads)
+    {}
+
+    void operator()() {
+        for( size_t i = rank_; i < blocks_.size(); i += n_threads_ ) {
+            const block_t &block = blocks_[i];
+
+            kernels_.build_profile( block.refs, block.ref_len, arena_ + i * stride_ );
+        }
+    }
+
+private:
+    const std::vector<block_t> &blocks_;
+    const scoring_kernel_factory &kernels_;
+    uint8_t *arena_;
+    const size_t stride_;
+    const size_t rank_;
+    const size_t n_threads_;
+};
 
 template<typename seq_tag>
 class worker {
 
 
 
-    const static size_t VW = vu_config<seq_tag>::width;
-    typedef typename vu_config<seq_tag>::scalar vu_scalar_t;
     typedef typename block_queue<seq_tag>::block_t block_t;
     typedef model<seq_tag> seq_model;
 
@@ -789,40 +2255,47 @@ class worker {
 
     const papara_score_parameters sp_;
 
-    static void copy_to_profile( const block_t &block, aligned_buffer<vu_scalar_t> *prof, aligned_buffer<vu_scalar_t> *aux_prof ) {
-        size_t reflen = block.ref_len;
+    const scoring_tiles tiles_;
 
+    const scoring_kernel_factory &kernels_;
 
+    // if not 0, only the (ref-block, query) pairs that contain a candidate edge are scored (and the scores of the
+    // candidates are recorded)
+    edge_candidates *cands_;
 
-        assert( reflen * VW == prof->size() );
-        assert( reflen * VW == aux_prof->size() );
+    // if not 0, the edges that have the same vector as the (canonical) edges of the blocks (see
+    // references::duplicate_edges). Their scores are offered along with those of the canonical edges.
+    const std::vector<std::vector<uint32_t> > *duplicates_;
 
-        typename aligned_buffer<vu_scalar_t>::iterator it = prof->begin();
-        typename aligned_buffer<vu_scalar_t>::iterator ait = aux_prof->begin();
-    //         std::cout << "reflen: " << reflen << " " << size_t(&(*it)) << "\n";
+    // if not 0, the vectors of the blocks are built on demand (the refs of the blocks are 0)
+    ref_vec_cache *vec_cache_;
 
-        for( size_t i = 0; i < reflen; ++i ) {
-            for( size_t j = 0; j < VW; ++j ) {
-    //                 std::cout << "ij: " << i << " " << j << " " << pvecs[j].size() <<  "\n";
+    // the edges of a block (followed by the duplicates of its edges) and the lane of the block that scores each of them
+    void expand_block( const block_t &block, std::vector<size_t> *edges, std::vector<int> *lanes ) const {
+        edges->assign( block.edges, block.edges + block.num_valid );
+        lanes->clear();
 
-
-                *it = vu_scalar_t(block.seqptrs[j][i]);
-                *ait = (block.auxptrs[j][i] == AUX_CGAP) ? vu_scalar_t(-1) : 0;
-
-                ++it;
-                ++ait;
-            }
+        for( int k = 0; k < block.num_valid; ++k ) {
+            lanes->push_back( k );
         }
 
+        if( duplicates_ == 0 ) {
+            return;
+        }
 
-        assert( it == prof->end());
-        assert( ait == aux_prof->end());
+        for( int k = 0; k < block.num_valid; ++k ) {
+            const std::vector<uint32_t> &dups = (*duplicates_)[block.edges[k]];
 
+            for( std::vector<uint32_t>::const_iterator it = dups.begin(); it != dups.end(); ++it ) {
+                edges->push_back( *it );
+                lanes->push_back( k );
+            }
+        }
     }
 
 public:
-    worker( block_queue<seq_tag> *bq, scoring_results *res, const queries<seq_tag> &qs, size_t rank, const papara_score_parameters &sp ) 
-      : block_queue_(*bq), results_(*res), qs_(qs), rank_(rank), sp_(sp) {}
+    worker( block_queue<seq_tag> *bq, scoring_results *res, const queries<seq_tag> &qs, size_t rank, const papara_score_parameters &sp, const scoring_tiles &tiles, const scoring_kernel_factory &kernels, edge_candidates *cands, const std::vector<std::vector<uint32_t> > *duplicates, ref_vec_cache *vec_cache )
+      : block_queue_(*bq), results_(*res), qs_(qs), rank_(rank), sp_(sp), tiles_(tiles), kernels_(kernels), cands_(cands), duplicates_(duplicates), vec_cache_(vec_cache) {}
     void operator()() {
 
 
@@ -830,8 +2303,6 @@ public:
         ivy_mike::timer tstatus;
         ivy_mike::timer tprint;
 
-        uint64_t cups_per_ref = -1;
-
 
         uint64_t ncup = 0;
 
@@ -843,91 +2314,156 @@ public:
         uint64_t inner_iters_short = 0;
         uint64_t ticks_all_short = 0;
 
+        // cups of the pairs that were skipped because of the prefilter
+        uint64_t ncup_skipped = 0;
 
-        aligned_buffer<vu_scalar_t> pvec_prof;
-        aligned_buffer<vu_scalar_t> aux_prof;
-        align_vec_arrays<vu_scalar_t> arrays;
-        aligned_buffer<vu_scalar_t> out_scores(VW);
-        aligned_buffer<vu_scalar_t> out_scores2(VW);
-        
-        size_t queue_size;
-        size_t init_queue_size = -1;
-        
-        while( true ) {
-            block_t block;
+        std::vector<int> out_scores(kernels_.width());
+        std::vector<std::pair<int,int> > out_ends(kernels_.width());
 
-            if( !block_queue_.get_block(&block, &queue_size)) {
-                break;
-            }
+        // scores of the blocks expanded to the duplicate edges
+        std::vector<std::vector<size_t> > tile_edges;
+        std::vector<std::vector<int> > tile_lanes;
+        std::vector<int> exp_scores;
+        std::vector<std::pair<int,int> > exp_ends;
 
-            if( init_queue_size == size_t(-1) ) {
-                init_queue_size = queue_size;
-            }
-            
-            if( cups_per_ref == uint64_t(-1) ) {
-                cups_per_ref = qs_.calc_cups_per_ref(block.ref_len );
+        // the scores are collected in thread-local results, which are merged into the shared results when the
+        // worker is finished. This way the workers do not need to synchronize for each offered score.
+        scoring_results local_results( results_.size(), results_.candidates_template() );
+
+        const size_t init_queue_size = block_queue_.num_blocks();
+
+        std::vector<block_t> tile;
+        std::vector<sptr::shared_ptr<scoring_kernel> > aligners;
+
+        // profiles of the blocks that do not have a shared one (reused for all tiles)
+        ivy_mike::aligned_buffer<uint8_t,scoring_kernel_factory::profile_alignment> local_profiles;
+
+        // the vectors built on demand for the current tile (the kernels only bind to them)
+        std::vector<ref_vec_cache::handle> tile_vecs;
+
+        while( true ) {
+            if( !block_queue_.get_blocks(&tile, tiles_.ref_blocks, rank_)) {
+                break;
             }
 
 #if 1
        //     assert( VW == 8 );
 
-            pvec_prof.resize( VW * block.ref_len );
-            aux_prof.resize( VW * block.ref_len );
+            // setup the kernels for all ref-blocks of the tile. Normally they only bind to the shared profiles.
+            const size_t stride = profile_stride( kernels_, tile.front().ref_len );
+            local_profiles.resize( stride * tile.size() );
 
-            copy_to_profile(block, &pvec_prof, &aux_prof );
+            if( vec_cache_ != 0 ) {
+                tile_vecs.clear();
 
-            pvec_aligner_vec<vu_scalar_t,VW> pav( block.seqptrs, block.auxptrs, block.ref_len, sp_.match, sp_.match_cgap, sp_.gap_open, sp_.gap_extend, seq_model::c2p, seq_model::num_cstates() );
+                for( size_t j = 0; j < tile.size(); ++j ) {
+                    block_t &block = tile[j];
 
-//            const align_pvec_score<vu_scalar_t,VW> aligner( block.seqptrs, block.auxptrs, block.ref_len, score_mismatch, score_match_cgap, score_gap_open, score_gap_extend );
-            for( unsigned int i = 0; i < qs_.size(); i++ ) {
+                    for( size_t k = 0; k < kernels_.width(); ++k ) {
+                        if( k < size_t(block.num_valid) ) {
+                            tile_vecs.push_back( vec_cache_->get( block.edges[k] ));
+                            block.refs[k] = tile_vecs.back().get();
+                        } else {
+                            block.refs[k] = block.refs[k-1];
+                        }
+                    }
+                }
+            }
 
-                //align_pvec_score_vec<vu_scalar_t, VW, false, typename seq_model::pars_state_t>( pvec_prof, aux_prof, qs_.pvec_at(i), score_match, score_match_cgap, score_gap_open, score_gap_extend, out_scores, arrays );
+            aligners.clear();
+            tile_edges.resize( tile.size() );
+            tile_lanes.resize( tile.size() );
 
+            for( size_t j = 0; j < tile.size(); ++j ) {
+                const block_t &block = tile[j];
+                const void *profile = block.profile;
 
-                std::pair<size_t,size_t> bounds = qs_.get_per_qs_bounds( i );
-//		std::cout << "bounds: " << bounds.first << " " << bounds.second << "\n";
+                expand_block( block, &tile_edges[j], &tile_lanes[j] );
+
+                if( profile == 0 ) {
+                    kernels_.build_profile( block.refs, block.ref_len, local_profiles.base() + j * stride );
+                    profile = local_profiles.base() + j * stride;
+                }
 
-                // if no bounds are available, get_per_qs_bounds will return [size_t(-1),size_t(-1)], which align is supposed to interpret as 'full range'
-                pav.align( qs_.cseq_at(i).begin(), qs_.cseq_at(i).end(), sp_.match, sp_.match_cgap, sp_.gap_open, sp_.gap_extend, out_scores.begin(), bounds.first, bounds.second );
+                aligners.push_back( sptr::shared_ptr<scoring_kernel>( kernels_.create( block.refs, block.ref_len, profile )));
+            }
 
-                //aligner.align(qs_.pvec_at(i).begin(), qs_.pvec_at(i).end());
-                //const vu_scalar_t *score_vec = aligner.get_scores();
+            // all blocks of the tile share the same query range
+            const size_t qs_begin = tile.front().qs_begin;
+            const size_t qs_end = tile.front().qs_end;
 
+//            const align_pvec_score<vu_scalar_t,VW> aligner( block.seqptrs, block.auxptrs, block.ref_len, score_mismatch, score_match_cgap, score_gap_open, score_gap_extend );
+            for( size_t qt_begin = qs_begin, qt_end; qt_begin < qs_end; qt_begin = qt_end ) {
+                qt_end = qt_begin + std::min( tiles_.qs, qs_end - qt_begin );
 
+                for( size_t j = 0; j < tile.size(); ++j ) {
+                    const block_t &block = tile[j];
+                    scoring_kernel &pav = *aligners[j];
 
-                //ncup += block.num_valid * block.ref_len * qs_.pvec_at(i).size();
-#if 0 // test against old version
-                align_pvec_score_vec<vu_scalar_t, VW>( pvec_prof.begin(), pvec_prof.end(), aux_prof.begin(), qs_.pvec_at(i).begin(), qs_.pvec_at(i).end(), score_match, score_match_cgap, score_gap_open, score_gap_extend, out_scores2.begin(), arrays );
-                bool eq = std::equal( out_scores.begin(), out_scores.end(), out_scores2.begin() );
+                    const std::vector<size_t> &edges = tile_edges[j];
+                    const std::vector<int> &lanes = tile_lanes[j];
+                    const bool expanded = edges.size() != size_t(block.num_valid);
 
+                    for( size_t i = qt_begin; i < qt_end; i++ ) {
+                        if( cands_ != 0 && !cands_->any( i, &edges.front(), &edges.front() + edges.size() )) {
+                            ncup_skipped += uint64_t(block.num_valid) * block.ref_len * qs_.cseq_size(i);
+                            continue;
+                        }
 
-                if( !eq ) {
-                    std::cout << "meeeeeeep!\n";
-                }
-                //std::cout << "eq: " << eq << "\n";
-#endif
+                        std::pair<size_t,size_t> bounds = qs_.get_per_qs_bounds( i );
+//		std::cout << "bounds: " << bounds.first << " " << bounds.second << "\n";
+
+                        // if no bounds are available, get_per_qs_bounds will return [size_t(-1),size_t(-1)], which align is supposed to interpret as 'full range'
+                        pav.align( qs_.cseq_begin(i), qs_.cseq_end(i), bounds.first, bounds.second, &out_scores.front(), &out_ends.front() );
+
+                        if( !expanded ) {
+                            local_results.offer_unsynchronized( i, block.edges, block.edges + block.num_valid, out_scores.begin(), out_ends.begin() );
+                        } else {
+                            exp_scores.resize( edges.size() );
+                            exp_ends.resize( edges.size() );
+
+                            for( size_t m = 0; m < edges.size(); ++m ) {
+                                exp_scores[m] = out_scores[lanes[m]];
+                                exp_ends[m] = out_ends[lanes[m]];
+                            }
 
-//                 std::cout << "scores: ";
-//                 std::copy( out_scores.begin(), out_scores.end(), std::ostream_iterator<int>(std::cout, "\n" ) );
-//                 std::cout << "\n";
-                results_.offer( i, block.edges, block.edges + block.num_valid, out_scores.begin() );
+                            local_results.offer_unsynchronized( i, edges.begin(), edges.end(), exp_scores.begin(), exp_ends.begin() );
+                        }
 
+                        if( cands_ != 0 && !cands_->is_all(i) ) {
+                            for( size_t m = 0; m < edges.size(); ++m ) {
+                                cands_->record( i, edges[m], out_scores[lanes[m]] );
+                            }
+                        }
+                    }
+                }
             }
 
-            ncup += block.num_valid * cups_per_ref;
-            ncup_short += block.num_valid * cups_per_ref;
+            for( size_t j = 0; j < tile.size(); ++j ) {
+                const block_t &block = tile[j];
+                scoring_kernel &pav = *aligners[j];
+
+                const uint64_t cups_per_ref = qs_.calc_cups_per_ref(block.ref_len, block.qs_begin, block.qs_end );
+
+                ncup += block.num_valid * cups_per_ref;
+                ncup_short += block.num_valid * cups_per_ref;
 
-            ticks_all += pav.ticks_all();
-            ticks_all_short += pav.ticks_all();
+                ticks_all += pav.ticks_all();
+                ticks_all_short += pav.ticks_all();
 
-            inner_iters += pav.inner_iters_all();
-            inner_iters_short += pav.inner_iters_all();
+                inner_iters += pav.inner_iters_all();
+                inner_iters_short += pav.inner_iters_all();
+            }
+
+            ncup -= ncup_skipped;
+            ncup_short -= ncup_skipped;
+            ncup_skipped = 0;
 
             if( rank_ == 0 &&  tprint.elapsed() > 10 ) {
 
                 //std::cout << "thread " << rank_ << " " << ncup << " in " << tstatus.elapsed() << " : "
                 
-                float fdone = (init_queue_size - queue_size) / float(init_queue_size);
+                float fdone = (init_queue_size - block_queue_.size()) / float(init_queue_size);
                 
                 lout << fdone * 100 << "% done. ";
                 lout << ncup / (tstatus.elapsed() * 1e9) << " gncup/s, " << ticks_all / double(inner_iters) << " tpili (short: " << ncup_short / (tprint.elapsed() * 1e9) << ", " << ticks_all_short / double(inner_iters_short) << ")" << std::endl;
@@ -989,6 +2525,8 @@ public:
 //    }
 
 #endif
+        results_.merge( local_results );
+
         {
             ivy_mike::lock_guard<ivy_mike::mutex> lock( *block_queue_.hack_mutex() );
             lout << "thread " << rank_ << ": " << ncup / (tstatus.elapsed() * 1e9) << " gncup/s" << std::endl;
@@ -998,38 +2536,322 @@ public:
 
 
 template <typename pvec_t,typename seq_tag>
-void driver<pvec_t,seq_tag>::calc_scores(size_t n_threads, const my_references& refs, const my_queries& qs, scoring_results* res, const papara_score_parameters& sp) {
+void driver<pvec_t,seq_tag>::calc_scores(size_t n_threads, const my_references& refs, const my_queries& qs, scoring_results* res, const papara_score_parameters& sp, edge_candidates *cands, const std::vector<uint32_t> *edges) {
+
+    //
+    // build the alignment blocks
+    //
+
+
+    // choose the scoring kernel (i.e., instruction set and vector width) for this cpu
+    std::vector<int> state_map;
+    for( size_t i = 0; i < model<seq_tag>::num_cstates(); ++i ) {
+        state_map.push_back( model<seq_tag>::c2p(i) );
+    }
+
+    const scoring_kernel_params kernel_params( sp.match, sp.match_cgap, sp.gap_open, sp.gap_extend, state_map );
+    const std::auto_ptr<scoring_kernel_factory> kernels( create_scoring_kernel_factory( vu_config<seq_tag>::is_aa, kernel_params ));
+
+    lout << "scoring kernel: " << kernels->name() << " (" << kernels->width() << " edges per pass)" << std::endl;
+
+    if( kernels->width() > vu_config<seq_tag>::max_width ) {
+        throw std::runtime_error( "scoring kernel is wider than vu_config::max_width" );
+    }
+
+    // only the canonical edges are scored (see references::distinct_edges). The workers offer their scores for the
+    // duplicates as well.
+    std::vector<uint32_t> canonical;
+
+    if( edges == 0 ) {
+        canonical = refs.distinct_edges();
+    } else {
+        std::vector<uint8_t> used( refs.num_pvecs(), 0 );
+
+        for( std::vector<uint32_t>::const_iterator it = edges->begin(); it != edges->end(); ++it ) {
+            const uint32_t c = refs.canonical_edge( *it );
+
+            if( !used[c] ) {
+                used[c] = 1;
+                canonical.push_back( c );
+            }
+        }
+    }
+
+    const bool has_duplicates = refs.distinct_edges().size() < refs.num_pvecs();
+    ref_vec_cache *vec_cache = refs.lazy_vec_cache();
+    const uint64_t cache_misses = vec_cache != 0 ? vec_cache->misses() : 0;
+    const std::vector<std::vector<uint32_t> > *duplicates = has_duplicates ? &refs.duplicate_edges() : 0;
+
+    block_queue<seq_tag> bq( std::max( n_threads, size_t(1) ));
+    build_block_queue(refs, qs.size(), *kernels, &bq, &canonical);
+
+    const scoring_tiles tiles = tune_tiles( refs, qs, std::max( n_threads, size_t(1) ), *kernels );
+
+    //
+    // work
+    //
+    ivy_mike::timer t1;
+    ivy_mike::thread_group tg;
+	lout << "papara_core version " << papara::get_version_string() << std::endl;
+    lout << "start scoring, using " << n_threads <<  " threads" << std::endl;
+
+    typedef worker<seq_tag> worker_t;
+
+    for( size_t i = 1; i < n_threads; ++i ) {
+        tg.create_thread(worker_t(&bq, res, qs, i, sp, tiles, *kernels, cands, duplicates, vec_cache));
+    }
+
+    worker_t w0(&bq, res, qs, 0, sp, tiles, *kernels, cands, duplicates, vec_cache );
+
+    w0();
+
+    tg.join_all();
+
+    lout << "scoring finished: " << t1.elapsed() << std::endl;
+
+    if( vec_cache != 0 ) {
+        lout << "ancestral state vectors built on demand: " << vec_cache->misses() - cache_misses << " (cache hits so far: " << vec_cache->hits() << ")" << std::endl;
+    }
+
+}
+
+template <typename pvec_t,typename seq_tag>
+std::auto_ptr<kmer_prefilter> driver<pvec_t,seq_tag>::build_prefilter(const my_references& refs, size_t keep, size_t n_threads) {
+    ivy_mike::timer t1;
+
+    if( refs.lazy_ref_vecs() ) {
+        throw std::runtime_error( "the k-mer prefilter needs the ancestral state vectors of all edges (it can not be used with a memory limit)" );
+    }
+
+    std::vector<const packed_ref_vec *> edges;
+    for( size_t i = 0; i < refs.num_pvecs(); ++i ) {
+        edges.push_back( &refs.ref_vec_at(i) );
+    }
+
+    std::auto_ptr<kmer_prefilter> pf( new kmer_prefilter( edges, vu_config<seq_tag>::is_aa, keep, n_threads ));
+
+    lout << "prefilter: " << pf->k() << "-mer index of " << pf->num_edges() << " edges: " << pf->bytes() / (1024 * 1024) << "mb in " << t1.elapsed() << "s" << std::endl;
+
+    return pf;
+}
+
+template <typename pvec_t,typename seq_tag>
+std::auto_ptr<clade_hierarchy> driver<pvec_t,seq_tag>::build_clades(const my_references& refs) {
+    ivy_mike::timer t1;
+
+    if( refs.edge_nodes().size() != refs.num_pvecs() ) {
+        throw std::runtime_error( "the tree-guided search needs the topology of the reference tree" );
+    }
+
+    std::auto_ptr<clade_hierarchy> clades( new clade_hierarchy( refs.edge_nodes() ));
+
+    lout << "tree search: " << clades->num_clades() - clades->num_edges() << " clades in " << clades->depth() << " levels (" << clades->children_at( clades->root() ).size() << " top-level clades) in " << t1.elapsed() << "s" << std::endl;
+
+    return clades;
+}
+
+template <typename pvec_t,typename seq_tag>
+void driver<pvec_t,seq_tag>::score_queries(size_t n_threads, const my_references& refs, const my_queries& qs, scoring_results* res, const papara_score_parameters& sp, const edge_search *search) {
+    if( search != 0 && search->prefilter != 0 && search->clades != 0 ) {
+        throw std::runtime_error( "the k-mer prefilter and the tree-guided search can not be used together" );
+    }
+
+    if( search != 0 && search->prefilter != 0 && search->prefilter->keep() < refs.num_pvecs() ) {
+        score_prefiltered( n_threads, refs, qs, res, sp, *search->prefilter );
+    } else if( search != 0 && search->clades != 0 ) {
+        score_clades( n_threads, refs, qs, res, sp, *search->clades, search->clade_margin );
+    } else {
+        calc_scores( n_threads, refs, qs, res, sp );
+    }
+}
+
+template <typename pvec_t,typename seq_tag>
+void driver<pvec_t,seq_tag>::score_prefiltered(size_t n_threads, const my_references& refs, const my_queries& qs, scoring_results* res, const papara_score_parameters& sp, const kmer_prefilter &prefilter) {
+    //
+    // select the candidate edges
+    //
+    ivy_mike::timer t1;
+
+    std::vector<std::pair<const uint8_t *, const uint8_t *> > qs_ranges;
+    for( size_t i = 0; i < qs.size(); ++i ) {
+        qs_ranges.push_back( std::make_pair( qs.cseq_begin(i), qs.cseq_end(i) ));
+    }
+
+    std::vector<int> state_map;
+    for( size_t i = 0; i < model<seq_tag>::num_cstates(); ++i ) {
+        state_map.push_back( model<seq_tag>::c2p(i) );
+    }
+
+    edge_candidates cands( qs.size() );
+    prefilter.select( qs_ranges, state_map, n_threads, &cands );
+
+    size_t num_all = 0;
+    for( size_t i = 0; i < cands.size(); ++i ) {
+        num_all += cands.is_all(i) ? 1 : 0;
+    }
+
+    lout << "prefilter: kept " << prefilter.keep() << " of " << refs.num_pvecs() << " edges per query in " << t1.elapsed() << "s (" << num_all << " queries without shared k-mers are scored against all edges)" << std::endl;
+
+    calc_scores( n_threads, refs, qs, res, sp, &cands );
+
+    //
+    // recall report: a sample of the queries is scored against all edges, and the best placements are compared
+    //
+    const size_t max_sample = 32;
+    const size_t stride = std::max( size_t(1), qs.size() / max_sample );
+
+    edge_candidates sample_cands( qs.size() );
+    std::vector<size_t> sample;
+
+    for( size_t i = 0; i < qs.size(); ++i ) {
+        if( i % stride == 0 && sample.size() < max_sample && !cands.is_all(i) ) {
+            sample.push_back( i );
+        } else {
+            sample_cands.set( i, 0, 0 );
+        }
+    }
+
+    if( sample.empty() ) {
+        return;
+    }
+
+    scoring_results sample_res( qs.size(), scoring_results::candidates(0) );
+    calc_scores( n_threads, refs, qs, &sample_res, sp, &sample_cands );
+
+    size_t same_edge = 0;
+    size_t same_score = 0;
+
+    for( std::vector<size_t>::const_iterator it = sample.begin(); it != sample.end(); ++it ) {
+        same_edge += cands.contains( *it, sample_res.bestedge_at(*it) ) ? 1 : 0;
+        same_score += res->bestscore_at(*it) == sample_res.bestscore_at(*it) ? 1 : 0;
+    }
+
+    lout << "prefilter recall (" << sample.size() << " sampled queries): best edge among the candidates: " << same_edge * 100.0 / sample.size() << "%, best score found: " << same_score * 100.0 / sample.size() << "%" << std::endl;
+}
+
+template <typename pvec_t,typename seq_tag>
+void driver<pvec_t,seq_tag>::score_clades(size_t n_threads, const my_references& refs, const my_queries& qs, scoring_results* res, const papara_score_parameters& sp, const clade_hierarchy &clades, int margin) {
+    // Each round scores the representatives of the pending clades of each query. Then the clades whose representative
+    // scores at least (best score of the query so far - margin) are refined, i.e., their sub-clades are pending in the
+    // next round. The sub-clade that contains the representative of its parent inherits the score. The search ends
+    // when no query has pending clades left, i.e., it takes about depth() rounds.
+    ivy_mike::timer t1;
+
+    const int no_score = std::numeric_limits<int>::min();
+
+    // (clade, score of its representative or no_score if it still needs to be scored)
+    typedef std::vector<std::pair<uint32_t,int> > pending_t;
+    std::vector<pending_t> pending( qs.size() );
+
+    const std::vector<uint32_t> &top = clades.children_at( clades.root() );
+    for( size_t i = 0; i < qs.size(); ++i ) {
+        for( std::vector<uint32_t>::const_iterator it = top.begin(); it != top.end(); ++it ) {
+            pending[i].push_back( std::make_pair( *it, no_score ));
+        }
+    }
+
+    std::vector<int> best( qs.size(), no_score );
+    std::vector<uint8_t> used( clades.num_edges(), 0 );
+    std::vector<uint32_t> qs_edges;
+
+    size_t num_rounds = 0;
+    uint64_t num_pairs = 0;
+
+    while( true ) {
+        //
+        // collect the edges to be scored in this round
+        //
+        edge_candidates cands( qs.size() );
+        std::vector<uint32_t> edges;
+
+        for( size_t i = 0; i < qs.size(); ++i ) {
+            qs_edges.clear();
+
+            for( pending_t::const_iterator it = pending[i].begin(); it != pending[i].end(); ++it ) {
+                if( it->second == no_score ) {
+                    qs_edges.push_back( clades.rep_at( it->first ));
+                }
+            }
+
+            std::sort( qs_edges.begin(), qs_edges.end() );
+            qs_edges.erase( std::unique( qs_edges.begin(), qs_edges.end() ), qs_edges.end() );
+
+            if( qs_edges.empty() ) {
+                cands.set( i, 0, 0 );
+                continue;
+            }
+
+            cands.set( i, &qs_edges.front(), &qs_edges.front() + qs_edges.size() );
+            num_pairs += qs_edges.size();
+
+            for( std::vector<uint32_t>::const_iterator it = qs_edges.begin(); it != qs_edges.end(); ++it ) {
+                if( !used[*it] ) {
+                    used[*it] = 1;
+                    edges.push_back( *it );
+                }
+            }
+        }
+
+        if( edges.empty() ) {
+            break;
+        }
+
+        ++num_rounds;
+
+        // edges of the same clade end up in the same ref-blocks
+        std::vector<std::pair<uint32_t,uint32_t> > ordered;
+        for( std::vector<uint32_t>::const_iterator it = edges.begin(); it != edges.end(); ++it ) {
+            ordered.push_back( std::make_pair( clades.order_at( *it ), *it ));
+            used[*it] = 0;
+        }
+
+        std::sort( ordered.begin(), ordered.end() );
+
+        for( size_t j = 0; j < ordered.size(); ++j ) {
+            edges[j] = ordered[j].second;
+        }
+
+        lout << "tree search: round " << num_rounds << ": " << edges.size() << " edges" << std::endl;
+
+        calc_scores( n_threads, refs, qs, res, sp, &cands, &edges );
 
-    //
-    // build the alignment blocks
-    //
+        //
+        // refine the clades within the margin
+        //
+        for( size_t i = 0; i < qs.size(); ++i ) {
+            pending_t &p = pending[i];
 
+            for( pending_t::iterator it = p.begin(); it != p.end(); ++it ) {
+                if( it->second == no_score ) {
+                    it->second = cands.score_of( i, clades.rep_at( it->first ));
+                }
 
-    block_queue<seq_tag> bq;
-    build_block_queue(refs, &bq);
+                best[i] = std::max( best[i], it->second );
+            }
 
-    //
-    // work
-    //
-    ivy_mike::timer t1;
-    ivy_mike::thread_group tg;
-	lout << "papara_core version " << papara::get_version_string() << std::endl;
-    lout << "start scoring, using " << n_threads <<  " threads" << std::endl;
+            pending_t next;
 
-    typedef worker<seq_tag> worker_t;
+            for( pending_t::const_iterator it = p.begin(); it != p.end(); ++it ) {
+                if( it->second == no_score || it->second < best[i] - margin ) {
+                    continue;
+                }
 
-    for( size_t i = 1; i < n_threads; ++i ) {
-        tg.create_thread(worker_t(&bq, res, qs, i, sp));
-    }
+                const std::vector<uint32_t> &children = clades.children_at( it->first );
 
-    worker_t w0(&bq, res, qs, 0, sp );
+                for( std::vector<uint32_t>::const_iterator cit = children.begin(); cit != children.end(); ++cit ) {
+                    const bool same_rep = clades.rep_at( *cit ) == clades.rep_at( it->first );
 
-    w0();
+                    next.push_back( std::make_pair( *cit, same_rep ? it->second : no_score ));
+                }
+            }
 
-    tg.join_all();
+            p.swap( next );
+        }
+    }
 
-    lout << "scoring finished: " << t1.elapsed() << std::endl;
+    const double all_pairs = double(qs.size()) * clades.num_edges();
 
+    lout << "tree search: scored " << num_pairs << " (query, edge) pairs in " << num_rounds << " rounds (" << (all_pairs > 0 ? num_pairs * 100.0 / all_pairs : 0.0) << "% of exhaustive): " << t1.elapsed() << "s" << std::endl;
 }
 
 template <typename pvec_t,typename seq_tag>
@@ -1099,21 +2921,39 @@ void driver<pvec_t,seq_tag>::do_newview(pvec_t& root_pvec, lnode* n1, lnode* n2,
 
 
 template <typename pvec_t,typename seq_tag>
-void driver<pvec_t,seq_tag>::build_block_queue(const my_references& refs, my_block_queue* bq) {
+void driver<pvec_t,seq_tag>::build_block_queue(const my_references& refs, size_t num_qs, const scoring_kernel_factory &kernels, my_block_queue* bq, const std::vector<uint32_t> *edges) {
     // creates the list of ref-block to be consumed by the worker threads.  A ref-block onsists of N ancestral state sequences, where N='width of the vector unit'.
     // The vectorized alignment implementation will align a QS against a whole ref-block at a time, rather than a single ancestral state sequence as in the
     // sequencial algorithm.
 
-    const static size_t VW = vu_config<seq_tag>::width;
+    const size_t VW = kernels.width();
 
     typedef typename block_queue<seq_tag>::block_t block_t;
 
 
-    size_t n_groups = (refs.num_pvecs() / VW);
-    if( (refs.num_pvecs() % VW) != 0 ) {
+    const size_t num_edges = edges != 0 ? edges->size() : refs.num_pvecs();
+
+    size_t n_groups = (num_edges / VW);
+    if( (num_edges % VW) != 0 ) {
         n_groups++;
     }
 
+    // For small reference trees there may be less ref-blocks than threads (or too few to balance the load by stealing). In this
+    // case each ref-block is additionally split up into ranges of queries. This costs one profile setup per (ref-block, query range),
+    // so the query ranges are not made smaller than min_qs_per_block.
+    const size_t blocks_per_thread = 4;
+    const size_t min_qs_per_block = 32;
+
+    const size_t target_blocks = bq->num_threads() * blocks_per_thread;
+    size_t n_qs_ranges = 1;
+
+    if( n_groups < target_blocks ) {
+        n_qs_ranges = (target_blocks + n_groups - 1) / n_groups;
+        n_qs_ranges = std::max( size_t(1), std::min( n_qs_ranges, num_qs / min_qs_per_block ));
+    }
+
+    const size_t qs_range_size = (num_qs + n_qs_ranges - 1) / std::max( n_qs_ranges, size_t(1) );
+
 
     //         std::vector<int> seqlist[VW];
     //         const int *seqptrs[VW];
@@ -1122,6 +2962,9 @@ void driver<pvec_t,seq_tag>::build_block_queue(const my_references& refs, my_blo
 
 
 
+    std::vector<block_t> blocks;
+    blocks.reserve( n_groups );
+
     for ( size_t j = 0; j < n_groups; j++ ) {
         int num_valid = 0;
 
@@ -1131,19 +2974,15 @@ void driver<pvec_t,seq_tag>::build_block_queue(const my_references& refs, my_blo
 
         for( unsigned int i = 0; i < VW; i++ ) {
 
-            size_t edge = j * VW + i;
-            if( edge < refs.num_pvecs()) {
+            const size_t k = j * VW + i;
+            if( k < num_edges ) {
+                const size_t edge = edges != 0 ? size_t((*edges)[k]) : k;
+
                 block.edges[i] = edge;
                 block.num_valid++;
 
-                block.seqptrs[i] = refs.pvec_at(edge).data();
-                block.auxptrs[i] = refs.aux_at(edge).data();
-
-                //                if( !m_ref_gapp[edge].empty() ) {
-                //                    block.gapp_ptrs[i] = m_ref_gapp[edge].data();
-                //                } else {
-                block.gapp_ptrs[i] = 0;
-                //                }
+                // (the vectors built on demand are only fetched by the workers)
+                block.refs[i] = refs.lazy_ref_vecs() ? 0 : &refs.ref_vec_at(edge);
 
                 block.ref_len = refs.pvec_size();
                 //                     do_newview( root_pvec, m_ec.m_edges[edge].first, m_ec.m_edges[edge].second, true );
@@ -1156,20 +2995,111 @@ void driver<pvec_t,seq_tag>::build_block_queue(const my_references& refs, my_blo
                 num_valid++;
             } else {
                 if( i < 1 ) {
-                    std::cout << "edge: " << edge << " " << refs.num_pvecs() << std::endl;
+                    std::cout << "edge: " << k << " " << num_edges << std::endl;
 
                     throw std::runtime_error( "bad integer mathematics" );
                 }
                 block.edges[i] = block.edges[i-1];
 
-                block.seqptrs[i] = block.seqptrs[i-1];
-                block.auxptrs[i] = block.auxptrs[i-1];
-                block.gapp_ptrs[i] = block.gapp_ptrs[i-1];
+                block.refs[i] = block.refs[i-1];
             }
 
         }
-        bq->push_back(block);
+
+        blocks.push_back(block);
+    }
+
+    // if the ref-blocks are split into query ranges, build their profiles once into one arena, which is shared read-only
+    // by all workers (otherwise the profile of a block would be rebuilt for each of its query ranges). Otherwise, or if
+    // the arena would get too large, the workers build the profiles on the fly, as each block is only visited once anyway.
+    const size_t max_profile_arena = size_t(1) << 30;
+    const size_t stride = profile_stride( kernels, refs.pvec_size() );
+
+    if( n_qs_ranges > 1 && stride > 0 && stride * blocks.size() <= max_profile_arena && !refs.lazy_ref_vecs() ) {
+        ivy_mike::timer t1;
+
+        uint8_t *arena = bq->alloc_profiles( stride * blocks.size() );
+
+        for( size_t j = 0; j < blocks.size(); ++j ) {
+            blocks[j].profile = arena + j * stride;
+        }
+
+        const size_t n_threads = bq->num_threads();
+        ivy_mike::thread_group tg;
+
+        for( size_t i = 1; i < n_threads; ++i ) {
+            tg.create_thread( profile_worker<seq_tag>( blocks, kernels, arena, stride, i, n_threads ));
+        }
+
+        profile_worker<seq_tag>( blocks, kernels, arena, stride, 0, n_threads )();
+
+        tg.join_all();
+
+        lout << "ref-block profiles: " << (stride * blocks.size()) / (1024 * 1024) << "mb in " << t1.elapsed() << "s" << std::endl;
+    }
+
+    // push the blocks query range major, so that consecutive blocks (which are grabbed together as a tile by the workers)
+    // share the same query range.
+    for( size_t qs_begin = 0; qs_begin < num_qs; qs_begin += qs_range_size ) {
+        for( typename std::vector<block_t>::iterator it = blocks.begin(); it != blocks.end(); ++it ) {
+            it->qs_begin = qs_begin;
+            it->qs_end = std::min( qs_begin + qs_range_size, num_qs );
+
+            bq->push_back(*it);
+        }
+    }
+
+    if( n_qs_ranges > 1 ) {
+        lout << "split query set into " << n_qs_ranges << " ranges per ref-block" << std::endl;
+    }
+}
+
+static size_t get_cache_size( int level, size_t fallback ) {
+    long size = -1;
+#if defined(_SC_LEVEL2_CACHE_SIZE) && defined(_SC_LEVEL3_CACHE_SIZE)
+    size = sysconf( level == 2 ? _SC_LEVEL2_CACHE_SIZE : _SC_LEVEL3_CACHE_SIZE );
+#endif
+    if( size <= 0 ) {
+        return fallback;
+    }
+
+    return size_t(size);
+}
+
+template <typename pvec_t,typename seq_tag>
+scoring_tiles driver<pvec_t,seq_tag>::tune_tiles(const my_references& refs, const my_queries& qs, size_t n_threads, const scoring_kernel_factory &kernels) {
+    // Chooses the tile sizes of the scoring loop from the cache sizes and the problem dimensions: the query tile shall occupy
+    // about half of the (private) L2 cache, while the profiles of all ref-blocks of a tile shall fit into this thread's share
+    // of the last level cache. If the whole query set already fits into L2, this degenerates into the untiled loop.
+
+    const size_t l2_size = get_cache_size( 2, 256 * 1024 );
+    const size_t l3_size = get_cache_size( 3, l2_size * 4 * n_threads );
+
+    if( qs.size() == 0 ) {
+        return scoring_tiles();
     }
+
+    size_t qs_bytes = 0;
+    for( size_t i = 0; i < qs.size(); ++i ) {
+        qs_bytes += qs.cseq_size(i);
+    }
+    const size_t mean_qs_bytes = std::max( size_t(1), qs_bytes / qs.size() );
+
+    const size_t profile_bytes = std::max( size_t(1), kernels.profile_bytes( refs.pvec_size() ));
+
+    scoring_tiles tiles;
+    tiles.qs = std::max( size_t(1), (l2_size / 2) / mean_qs_bytes );
+
+    if( tiles.qs < qs.size() ) {
+        const size_t max_ref_blocks = 16;
+        tiles.ref_blocks = std::max( size_t(1), std::min( max_ref_blocks, (l3_size / n_threads) / profile_bytes ));
+    } else {
+        tiles.qs = qs.size();
+    }
+
+    lout << "scoring tiles: " << tiles.ref_blocks << " ref-blocks x " << tiles.qs << " queries (L2: " << l2_size / 1024 << "k, L3: " << l3_size / 1024 << "k)" << std::endl;
+
+    return tiles;
 }
 
 template <typename pvec_t,typename seq_tag>
@@ -1192,82 +3122,82 @@ void driver<pvec_t,seq_tag>::print_best_scores(std::ostream& os, const my_querie
     }
 }
 
-template <typename pvec_t,typename seq_tag>
-std::vector< std::vector< uint8_t > > driver<pvec_t,seq_tag>::generate_traces(std::ostream& os_quality, std::ostream& os_cands, const my_queries& qs, const my_references& refs, const scoring_results& res, const papara_score_parameters& sp) {
-
-
+// computes the alignment traces of the queries [begin,end) against their best scoring edge (and optionally the candidate edges).
+// Used by generate_traces: the queries are distributed round-robin over the threads, all results are written into
+// per-query slots, so that the output order does not depend on the threads.
+template<typename pvec_t, typename seq_tag>
+class trace_worker {
     typedef typename queries<seq_tag>::pars_state_t pars_state_t;
     typedef model<seq_tag> seq_model;
 
+public:
+    trace_worker( const queries<seq_tag> &qs, const references<pvec_t,seq_tag> &refs, const scoring_results &res, const papara_score_parameters &sp, size_t begin, size_t end, size_t rank, size_t n_threads,
+                  align_arrays_traceback<int> *arrays, std::vector<std::vector<uint8_t> > *qs_traces, std::vector<int> *scores, std::vector<std::string> *cands_out )
+      : qs_(qs), refs_(refs), res_(res), sp_(sp), begin_(begin), end_(end), rank_(rank), n_threads_(n_threads),
+        arrays_(*arrays), qs_traces_(*qs_traces), scores_(*scores), cands_out_(cands_out)
+    {}
 
-    lout << "generating best scoring alignments\n";
-    ivy_mike::timer t1;
-
-
-
-    std::vector<pars_state_t> out_qs_ps;
-    align_arrays_traceback<int> arrays;
-
-    std::vector<std::vector<uint8_t> > qs_traces( qs.size() );
-
-    std::vector<uint8_t> cand_trace;
-
-    std::deque<size_t> bounded_bad_scores;
-    
-    for( size_t i = 0; i < qs.size(); i++ ) {
-        size_t best_edge = res.bestedge_at(i);
+    void operator()() {
+        std::vector<pars_state_t> out_qs_ps;
+        std::vector<uint8_t> cand_trace;
 
-        assert( size_t(best_edge) < refs.num_pvecs() );
+        // unpacked ancestral state vector and aux flags of the current edge
+        std::vector<int> ref_pvec;
+        std::vector<unsigned int> ref_aux;
 
-        int score = -1;
+        // materialized p-state vector of the current query
+        std::vector<pars_state_t> qp;
 
+        for( size_t i = begin_ + rank_; i < end_; i += n_threads_ ) {
+            const size_t best_edge = res_.bestedge_at(i);
 
+            assert( best_edge < refs_.num_pvecs() );
 
-        const std::vector<pars_state_t> &qp = qs.pvec_at(i);
+            refs_.get_ref_vec(best_edge)->unpack( &ref_pvec, &ref_aux );
 
-        score = align_freeshift_pvec<int>(
-                    refs.pvec_at(best_edge).begin(), refs.pvec_at(best_edge).end(),
-                    refs.aux_at(best_edge).begin(),
-                    qp.begin(), qp.end(),
-                    sp.match, sp.match_cgap, sp.gap_open, sp.gap_extend, qs_traces.at(i), arrays
-                );
+            qs_.pvec_at( i, &qp );
 
+            const std::pair<int,int> end = res_.bestend_at(i);
 
-//         std::cout << "scores: " << score << " " << res.bestscore_at(i) << "\n";
-        
-        std::pair<size_t,size_t> bounds = qs.get_per_qs_bounds( i );
-        
-        
-        if( bounds.first == size_t(-1) ) {
-            if( score != res.bestscore_at(i) ) {
-                std::cout << "meeeeeeep! score: " << res.bestscore_at(i) << " " << score << "\n";
-                throw std::runtime_error( "alignment scores differ between the vectorized and sequential alignment kernels.");
-            }
-        } else {
-            if( score != res.bestscore_at(i) ) {
-                bounded_bad_scores.push_back(i);
+            // the end of the best alignment is known from the score pass (unless the query has bounds, in which case the
+            // scores are not comparable), so only a band of the dp matrix needs to be filled.
+            if( end.first != -1 && qs_.get_per_qs_bounds(i).first == size_t(-1) ) {
+                scores_[i] = align_freeshift_pvec_banded<int>(
+                            ref_pvec.begin(), ref_pvec.end(),
+                            ref_aux.begin(),
+                            qp.begin(), qp.end(),
+                            sp_.match, sp_.match_cgap, sp_.gap_open, sp_.gap_extend, res_.bestscore_at(i), end.first, end.second, qs_traces_.at(i), arrays_
+                        );
+            } else {
+                scores_[i] = align_freeshift_pvec<int>(
+                            ref_pvec.begin(), ref_pvec.end(),
+                            ref_aux.begin(),
+                            qp.begin(), qp.end(),
+                            sp_.match, sp_.match_cgap, sp_.gap_open, sp_.gap_extend, qs_traces_.at(i), arrays_
+                        );
             }
-        }
-
-
-
 
+            if( cands_out_ == 0 ) {
+                continue;
+            }
 
-        if( os_cands.good() ) {
-            const scoring_results::candidates &cands = res.candidates_at(i);
+            const scoring_results::candidates &cands = res_.candidates_at(i);
 
             std::vector<std::vector<uint8_t> > unique_traces;
+            std::stringstream os_cands;
 
             for( size_t j = 0; j < cands.size(); ++j ) {
                 const scoring_results::candidate &cand = cands[j];
 
                 cand_trace.clear();
 
-                score = align_freeshift_pvec<int>(
-                            refs.pvec_at(cand.ref()).begin(), refs.pvec_at(cand.ref()).end(),
-                            refs.aux_at(cand.ref()).begin(),
+                refs_.get_ref_vec(cand.ref())->unpack( &ref_pvec, &ref_aux );
+
+                align_freeshift_pvec<int>(
+                            ref_pvec.begin(), ref_pvec.end(),
+                            ref_aux.begin(),
                             qp.begin(), qp.end(),
-                            sp.match, sp.match_cgap, sp.gap_open, sp.gap_extend, cand_trace, arrays
+                            sp_.match, sp_.match_cgap, sp_.gap_open, sp_.gap_extend, cand_trace, arrays_
                         );
                 out_qs_ps.clear();
 
@@ -1292,10 +3222,94 @@ std::vector< std::vector< uint8_t > > driver<pvec_t,seq_tag>::generate_traces(st
                 }
 
             }
+
+            (*cands_out_)[i - begin_] = os_cands.str();
+        }
+    }
+
+private:
+    const queries<seq_tag> &qs_;
+    const references<pvec_t,seq_tag> &refs_;
+    const scoring_results &res_;
+    const papara_score_parameters &sp_;
+
+    const size_t begin_;
+    const size_t end_;
+    const size_t rank_;
+    const size_t n_threads_;
+
+    align_arrays_traceback<int> &arrays_;
+    std::vector<std::vector<uint8_t> > &qs_traces_;
+    std::vector<int> &scores_;
+    std::vector<std::string> *cands_out_;
+};
+
+template <typename pvec_t,typename seq_tag>
+std::vector< std::vector< uint8_t > > driver<pvec_t,seq_tag>::generate_traces(std::ostream& os_quality, std::ostream& os_cands, const my_queries& qs, const my_references& refs, const scoring_results& res, const papara_score_parameters& sp, size_t n_threads) {
+
+    lout << "generating best scoring alignments\n";
+    ivy_mike::timer t1;
+
+    n_threads = std::max( n_threads, size_t(1) );
+
+    std::vector<std::vector<uint8_t> > qs_traces( qs.size() );
+    std::vector<int> scores( qs.size() );
+
+    // one set of traceback arrays per thread, which are reused for all chunks
+    std::vector<align_arrays_traceback<int> > arrays( n_threads );
+
+    std::deque<size_t> bounded_bad_scores;
+
+    // the queries are processed in chunks, so that the candidate output (which has to be written in query order)
+    // only needs to be buffered for one chunk at a time.
+    const size_t chunk_size = 1024 * n_threads;
+    const bool write_cands = os_cands.good();
+
+    typedef trace_worker<pvec_t,seq_tag> trace_worker_t;
+
+    for( size_t chunk_begin = 0; chunk_begin < qs.size(); chunk_begin += chunk_size ) {
+        const size_t chunk_end = std::min( chunk_begin + chunk_size, qs.size() );
+
+        std::vector<std::string> cands_out;
+        if( write_cands ) {
+            cands_out.resize( chunk_end - chunk_begin );
+        }
+
+        ivy_mike::thread_group tg;
+        for( size_t r = 1; r < n_threads; ++r ) {
+            tg.create_thread( trace_worker_t( qs, refs, res, sp, chunk_begin, chunk_end, r, n_threads, &arrays[r], &qs_traces, &scores, write_cands ? &cands_out : 0 ));
         }
 
+        trace_worker_t w0( qs, refs, res, sp, chunk_begin, chunk_end, 0, n_threads, &arrays[0], &qs_traces, &scores, write_cands ? &cands_out : 0 );
+        w0();
+
+        tg.join_all();
+
+        for( size_t i = chunk_begin; i < chunk_end; ++i ) {
+            const int score = scores[i];
+
+//         std::cout << "scores: " << score << " " << res.bestscore_at(i) << "\n";
+
+            std::pair<size_t,size_t> bounds = qs.get_per_qs_bounds( i );
+
+
+            if( bounds.first == size_t(-1) ) {
+                if( score != res.bestscore_at(i) ) {
+                    std::cout << "meeeeeeep! score: " << res.bestscore_at(i) << " " << score << "\n";
+                    throw std::runtime_error( "alignment scores differ between the vectorized and sequential alignment kernels.");
+                }
+            } else {
+                if( score != res.bestscore_at(i) ) {
+                    bounded_bad_scores.push_back(i);
+                }
+            }
+
+            if( write_cands ) {
+                os_cands << cands_out[i - chunk_begin];
+            }
+        }
     }
-    
+
     if( !bounded_bad_scores.empty() ) {
         std::cout << "There were internal problems handling per-gene QS. This is most likely due to overhangs into another partition. The overhangs will be chopped off, but the alignment may be wrong.\n";
     
@@ -1320,16 +3334,17 @@ std::vector< std::vector< uint8_t > > driver<pvec_t,seq_tag>::generate_traces(st
 }
 
 template <typename pvec_t,typename seq_tag>
-void driver<pvec_t,seq_tag>::align_best_scores2(std::ostream& os, std::ostream& os_quality, std::ostream& os_cands, const my_queries& qs, const my_references& refs, const scoring_results& res, size_t pad, const bool ref_gaps, const papara_score_parameters& sp) {
+void driver<pvec_t,seq_tag>::align_best_scores2(std::ostream& os, std::ostream& os_quality, std::ostream& os_cands, const my_queries& qs, const my_references& refs, const scoring_results& res, size_t pad, const bool ref_gaps, const papara_score_parameters& sp, size_t n_threads) {
 
     typedef typename queries<seq_tag>::pars_state_t pars_state_t;
     typedef model<seq_tag> seq_model;
 
 
-    std::vector<std::vector<uint8_t> > qs_traces = generate_traces(os_quality, os_cands, qs, refs, res, sp );
+    std::vector<std::vector<uint8_t> > qs_traces = generate_traces(os_quality, os_cands, qs, refs, res, sp, n_threads );
     std::vector<pars_state_t> out_qs_ps;
+    std::vector<pars_state_t> qp;
     for( size_t i = 0; i < qs.size(); ++i ) {
-        const std::vector<pars_state_t> &qp = qs.pvec_at(i);
+        qs.pvec_at( i, &qp );
 
         out_qs_ps.clear();
 
@@ -1344,7 +3359,7 @@ void driver<pvec_t,seq_tag>::align_best_scores2(std::ostream& os, std::ostream&
 }
 
 template <typename pvec_t,typename seq_tag>
-void driver<pvec_t,seq_tag>::align_best_scores(std::ostream& os, std::ostream& os_quality, std::ostream& os_cands, const my_queries& qs, const my_references& refs, const scoring_results& res, size_t pad, const bool ref_gaps, const papara_score_parameters& sp) {
+void driver<pvec_t,seq_tag>::align_best_scores(std::ostream& os, std::ostream& os_quality, std::ostream& os_cands, const my_queries& qs, const my_references& refs, const scoring_results& res, size_t pad, const bool ref_gaps, const papara_score_parameters& sp, size_t n_threads) {
     // create the actual alignments for the best scoring insertion position (=do the traceback)
 
     typedef typename queries<seq_tag>::pars_state_t pars_state_t;
@@ -1366,7 +3381,7 @@ void driver<pvec_t,seq_tag>::align_best_scores(std::ostream& os, std::ostream& o
     // create the best alignment traces per qs
 
 
-    std::vector<std::vector<uint8_t> > qs_traces = generate_traces(os_quality, os_cands, qs, refs, res, sp );
+    std::vector<std::vector<uint8_t> > qs_traces = generate_traces(os_quality, os_cands, qs, refs, res, sp, n_threads );
 
 
     // collect ref gaps introduiced by qs
@@ -1379,9 +3394,9 @@ void driver<pvec_t,seq_tag>::align_best_scores(std::ostream& os, std::ostream& o
 
 
     if( ref_gaps ) {
-        os << refs.num_seqs() + qs.size() << " " << rgc.transformed_ref_len() << "\n";
+        os << refs.num_seqs() + qs.num_output() << " " << rgc.transformed_ref_len() << "\n";
     } else {
-        os << refs.num_seqs() + qs.size() << " " << refs.pvec_size() << "\n";
+        os << refs.num_seqs() + qs.num_output() << " " << refs.pvec_size() << "\n";
     }
     // write refs (and apply the ref gaps)
 
@@ -1400,9 +3415,11 @@ void driver<pvec_t,seq_tag>::align_best_scores(std::ostream& os, std::ostream& o
 
 
 
-    for( size_t i = 0; i < qs.size(); i++ ) {
+    std::vector<pars_state_t> qp;
+    for( size_t j = 0; j < qs.num_output(); j++ ) {
+        const size_t i = qs.output_query(j);
 
-        const std::vector<pars_state_t> &qp = qs.pvec_at(i);
+        qs.pvec_at( i, &qp );
 
         out_qs_ps.clear();
 
@@ -1412,7 +3429,7 @@ void driver<pvec_t,seq_tag>::align_best_scores(std::ostream& os, std::ostream& o
             gapstream_to_alignment_no_ref_gaps(qs_traces.at(i), qp, &out_qs_ps, seq_model::gap_pstate() );
         }
 
-        os << std::setw(pad) << std::left << qs.name_at(i);
+        os << std::setw(pad) << std::left << qs.output_name(j);
         std::transform( out_qs_ps.begin(), out_qs_ps.end(), std::ostream_iterator<char>(os), seq_model::p2s );
         os << std::endl;
 
@@ -1441,7 +3458,7 @@ void driver<pvec_t,seq_tag>::align_best_scores(std::ostream& os, std::ostream& o
             double score = num_equal / double(map_ref.size());
             //double score = alignment_quality( out_qs, m_qs_seqs[i], debug );
 
-            os_quality << qs.name_at(i) << " " << score << "\n";
+            os_quality << qs.output_name(j) << " " << score << "\n";
 
             mean_quality += score;
             n_quality += 1;
@@ -1455,7 +3472,7 @@ void driver<pvec_t,seq_tag>::align_best_scores(std::ostream& os, std::ostream& o
 }
 
 template <typename pvec_t,typename seq_tag>
-void driver<pvec_t,seq_tag>::align_best_scores_oa( output_alignment *oa, const my_queries &qs, const my_references &refs, const scoring_results &res, size_t pad, const bool ref_gaps, const papara_score_parameters &sp ) {
+void driver<pvec_t,seq_tag>::align_best_scores_oa( output_alignment *oa, const my_queries &qs, const my_references &refs, const scoring_results &res, size_t pad, const bool ref_gaps, const papara_score_parameters &sp , size_t n_threads) {
     typedef typename queries<seq_tag>::pars_state_t pars_state_t;
     typedef model<seq_tag> seq_model;
 
@@ -1480,7 +3497,7 @@ void driver<pvec_t,seq_tag>::align_best_scores_oa( output_alignment *oa, const m
     
     
     // create the best alignment traces per qs
-    std::vector<std::vector<uint8_t> > qs_traces = generate_traces(os_quality, os_cands, qs, refs, res, sp );
+    std::vector<std::vector<uint8_t> > qs_traces = generate_traces(os_quality, os_cands, qs, refs, res, sp, n_threads );
 
 
     // collect ref gaps introduiced by qs
@@ -1493,9 +3510,9 @@ void driver<pvec_t,seq_tag>::align_best_scores_oa( output_alignment *oa, const m
 
 
     if( ref_gaps ) {
-        oa->set_size(refs.num_seqs() + qs.size(), rgc.transformed_ref_len());
+        oa->set_size(refs.num_seqs() + qs.num_output(), rgc.transformed_ref_len());
     } else {
-        oa->set_size(refs.num_seqs() + qs.size(), refs.pvec_size());
+        oa->set_size(refs.num_seqs() + qs.num_output(), refs.pvec_size());
     }
     oa->set_max_name_length( pad );
     
@@ -1520,9 +3537,13 @@ void driver<pvec_t,seq_tag>::align_best_scores_oa( output_alignment *oa, const m
 
     std::deque<size_t> overhang_qs;
 
-    for( size_t i = 0; i < qs.size(); i++ ) {
+    // the collapsed duplicate queries (see queries::collapse_duplicates) get the alignment of their unique query
+    std::vector<pars_state_t> qp;
+    for( size_t j = 0; j < qs.num_output(); j++ ) {
+        const size_t i = qs.output_query(j);
+
         tmp.clear();
-        const std::vector<pars_state_t> &qp = qs.pvec_at(i);
+        qs.pvec_at( i, &qp );
 
         out_qs_ps.clear();
 
@@ -1561,7 +3582,7 @@ void driver<pvec_t,seq_tag>::align_best_scores_oa( output_alignment *oa, const m
                 }
                 
                 if( pre_overhang || post_overhang ) {
-                    overhang_qs.push_back(i);
+                    overhang_qs.push_back(j);
                 }
                 
             }
@@ -1579,14 +3600,14 @@ void driver<pvec_t,seq_tag>::align_best_scores_oa( output_alignment *oa, const m
             
             size_t m = std::min( overhang_qs.size(), size_t(20) );
             for( size_t i = 0; i < m; ++i ) {
-                std::cout << qs.name_at( overhang_qs[i] ) << "\n";
+                std::cout << qs.output_name( overhang_qs[i] ) << "\n";
             }
         }
         
         //os << std::setw(pad) << std::left << qs.name_at(i);
         std::transform( out_qs_ps.begin(), out_qs_ps.end(), std::back_inserter(tmp), seq_model::p2s );
         
-        oa->push_back( qs.name_at(i), tmp, output_alignment::type_qs );
+        oa->push_back( qs.output_name(j), tmp, output_alignment::type_qs );
 
 
 
@@ -1613,7 +3634,7 @@ void driver<pvec_t,seq_tag>::align_best_scores_oa( output_alignment *oa, const m
             double score = num_equal / double(map_ref.size());
             //double score = alignment_quality( out_qs, m_qs_seqs[i], debug );
 
-            os_quality << qs.name_at(i) << " " << score << "\n";
+            os_quality << qs.output_name(j) << " " << score << "\n";
 
             mean_quality += score;
             n_quality += 1;
@@ -1622,6 +3643,202 @@ void driver<pvec_t,seq_tag>::align_best_scores_oa( output_alignment *oa, const m
 
     }
 }
+namespace {
+class ostream_row_sink : public row_sink {
+public:
+    ostream_row_sink( std::ostream &os ) : os_(os) {}
+
+    void push_back( const std::string &name, const std::string &row, int /*score*/ ) {
+        os_ << name << " " << row << "\n";
+    }
+
+private:
+    std::ostream &os_;
+};
+}
+
+template <typename pvec_t, typename seq_tag>
+void driver<pvec_t,seq_tag>::align_rows( std::ostream &os, const my_queries &qs, const my_references &refs, const papara_score_parameters &sp, size_t n_threads, const edge_search *search ) {
+    ostream_row_sink sink( os );
+    align_rows( &sink, qs, refs, sp, n_threads, search );
+}
+
+template <typename pvec_t, typename seq_tag>
+void driver<pvec_t,seq_tag>::align_rows( row_sink *sink, const my_queries &qs, const my_references &refs, const papara_score_parameters &sp, size_t n_threads, const edge_search *search ) {
+    typedef typename queries<seq_tag>::pars_state_t pars_state_t;
+    typedef model<seq_tag> seq_model;
+
+    scoring_results res( qs.size(), scoring_results::candidates(0) );
+    score_queries( n_threads, refs, qs, &res, sp, search );
+
+    std::ofstream os_quality;
+    std::ofstream os_cands;
+
+    const std::vector<std::vector<uint8_t> > qs_traces = generate_traces( os_quality, os_cands, qs, refs, res, sp, n_threads );
+
+    std::vector<pars_state_t> qp;
+    std::vector<pars_state_t> out_qs_ps;
+    std::string row;
+
+    for( size_t j = 0; j < qs.num_output(); ++j ) {
+        const size_t i = qs.output_query(j);
+
+        qs.pvec_at( i, &qp );
+
+        out_qs_ps.clear();
+        gapstream_to_alignment_no_ref_gaps( qs_traces.at(i), qp, &out_qs_ps, seq_model::gap_pstate() );
+
+        row.resize( out_qs_ps.size() );
+        std::transform( out_qs_ps.begin(), out_qs_ps.end(), row.begin(), seq_model::p2s );
+
+        sink->push_back( qs.output_name(j), row, res.bestscore_at(i) );
+    }
+}
+
+template <typename pvec_t, typename seq_tag>
+void driver<pvec_t,seq_tag>::align_streaming( output_alignment *oa, fasta_batch_reader *qs_reader, my_queries *align_qs, const my_references &refs, size_t batch_size, const std::string &tmp_name, const bool ref_gaps, const papara_score_parameters &sp, size_t n_threads, const edge_search *search ) {
+    typedef typename queries<seq_tag>::pars_state_t pars_state_t;
+    typedef model<seq_tag> seq_model;
+
+    if( batch_size == 0 ) {
+        throw std::runtime_error( "batch size of the streaming mode must be > 0" );
+    }
+
+    //
+    // pass 1: score and trace the queries batch by batch. The ref gaps are collected, the traces go into the spill file.
+    //
+    ref_gap_collector rgc( refs.pvec_size() );
+    size_t num_qs = 0;
+    size_t num_collapsed = 0;
+    size_t max_qs_name_len = 0;
+
+    std::ofstream os_quality;
+    std::ofstream os_cands;
+
+    {
+        index_writer spill( tmp_name.c_str() );
+
+        std::vector<std::string> names;
+        std::vector<std::vector<uint8_t> > seqs;
+
+        // the queries from the reference alignment come last (as in the non-streaming mode)
+        bool align_qs_done = false;
+
+        while( true ) {
+            std::auto_ptr<my_queries> batch;
+            my_queries *qs;
+
+            if( qs_reader != 0 && qs_reader->read( batch_size, &names, &seqs ) ) {
+                batch.reset( new my_queries( &names, &seqs ));
+                qs = batch.get();
+            } else if( !align_qs_done && align_qs->size() > 0 ) {
+                qs = align_qs;
+                align_qs_done = true;
+            } else {
+                break;
+            }
+
+            lout << "streaming: batch of " << qs->size() << " queries (" << num_qs << " done)" << std::endl;
+
+            qs->preprocess();
+            num_collapsed += qs->collapse_duplicates();
+
+            scoring_results res( qs->size(), scoring_results::candidates(0) );
+            score_queries( n_threads, refs, *qs, &res, sp, search );
+
+            const std::vector<std::vector<uint8_t> > traces = generate_traces( os_quality, os_cands, *qs, refs, res, sp, n_threads );
+
+            for( size_t i = 0; i < qs->size(); ++i ) {
+                rgc.add_trace( traces[i] );
+            }
+
+            std::vector<pars_state_t> qp;
+            for( size_t j = 0; j < qs->num_output(); ++j ) {
+                const size_t i = qs->output_query(j);
+
+                qs->pvec_at( i, &qp );
+
+                spill.put_string( qs->output_name(j) );
+                spill.put<uint64_t>( qp.size() );
+                spill.put_bytes( qp.empty() ? 0 : &qp.front(), qp.size() * sizeof(pars_state_t) );
+                spill.put_vector( traces[i] );
+            }
+
+            num_qs += qs->num_output();
+            max_qs_name_len = std::max( max_qs_name_len, qs->max_name_length() );
+        }
+
+        spill.close();
+    }
+
+    if( num_qs == 0 ) {
+        std::remove( tmp_name.c_str() );
+        throw std::runtime_error( "no query sequences" );
+    }
+
+    if( num_collapsed > 0 ) {
+        lout << "collapsed " << num_collapsed << " duplicate queries (within the batches)" << std::endl;
+    }
+
+    //
+    // pass 2: write the output alignment. Now the ref gaps of all queries are known.
+    //
+    if( ref_gaps ) {
+        oa->set_size(refs.num_seqs() + num_qs, rgc.transformed_ref_len());
+    } else {
+        oa->set_size(refs.num_seqs() + num_qs, refs.pvec_size());
+    }
+    oa->set_max_name_length( 1 + std::max( max_qs_name_len, refs.max_name_length() ));
+
+    std::vector<char> tmp;
+    for( size_t i = 0; i < refs.num_seqs(); i++ ) {
+        tmp.clear();
+
+        if( ref_gaps ) {
+            rgc.transform( refs.seq_at(i).begin(), refs.seq_at(i).end(), std::back_inserter(tmp), '-' );
+        } else {
+            std::transform( refs.seq_at(i).begin(), refs.seq_at(i).end(), std::back_inserter(tmp), seq_model::normalize);
+        }
+
+        oa->push_back( refs.name_at(i), tmp, output_alignment::type_ref );
+    }
+
+    {
+        mapped_file spill_file( tmp_name.c_str() );
+        index_reader spill( spill_file.data(), spill_file.size() );
+
+        std::vector<pars_state_t> qp;
+        std::vector<uint8_t> trace;
+        std::vector<pars_state_t> out_qs_ps;
+
+        for( size_t i = 0; i < num_qs; ++i ) {
+            const std::string name = spill.get_string();
+
+            qp.resize( size_t(spill.get<uint64_t>()) );
+            const uint8_t *qp_data = spill.get_bytes( qp.size() * sizeof(pars_state_t) );
+            if( !qp.empty() ) {
+                std::memcpy( &qp.front(), qp_data, qp.size() * sizeof(pars_state_t) );
+            }
+
+            spill.get_vector( &trace );
+
+            out_qs_ps.clear();
+            if( ref_gaps ) {
+                gapstream_to_alignment(trace, qp, &out_qs_ps, seq_model::gap_pstate(), rgc);
+            } else {
+                gapstream_to_alignment_no_ref_gaps(trace, qp, &out_qs_ps, seq_model::gap_pstate() );
+            }
+
+            tmp.clear();
+            std::transform( out_qs_ps.begin(), out_qs_ps.end(), std::back_inserter(tmp), seq_model::p2s );
+
+            oa->push_back( name, tmp, output_alignment::type_qs );
+        }
+    }
+
+    std::remove( tmp_name.c_str() );
+}
+
 void output_alignment_phylip::write_seq_phylip(const std::string& name, const out_seq& seq) {
     size_t pad = std::max( max_name_len_, name.size() + 1 );
 
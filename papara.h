@@ -46,6 +46,14 @@
 #include "pvec.h"
 // #include "align_utils.h"
 #include "blast_partassign.h"
+#include "scoring_kernel.h"
+#include "ref_index.h"
+#include "seq_reader.h"
+#include "papara_api.h"
+#include "prefilter.h"
+#include "tree_search.h"
+#include "ref_vec_cache.h"
+#include "ref_update.h"
 
 
 
@@ -58,6 +66,7 @@
 #include "ivymike/algorithm.h"
 #include "ivymike/smart_ptr.h"
 #include "ivymike/multiple_alignment.h"
+#include "ivymike/aligned_buffer.h"
 
 
 namespace papara {
@@ -75,7 +84,8 @@ using sequence_model::model;
 
 class log_sink {
 public:
-    virtual void post( char overflow, char *start, char *end ) = 0;
+    // called with the log mutex held (i.e., the sink must not write to lout)
+    virtual void post( char overflow, const char *start, const char *end ) = 0;
 };
 
 // RAII guard for adding/removing a 'tee stream' to the papara log
@@ -102,20 +112,20 @@ class vu_config {
 };
 
 
+// max_width is the maximum number of edges per block_queue::block_t. The actual number of edges that are scored in
+// one pass depends on the scoring kernel chosen at runtime (see scoring_kernel.h).
 template<>
 class vu_config<tag_dna> {
 public:
-    const static size_t width = 8;
-    typedef short scalar;
-    const static scalar full_mask = scalar(-1);
+    const static size_t max_width = 64;
+    const static bool is_aa = false;
 };
 
 template<>
 class vu_config<tag_aa> {
 public:
-    const static size_t width = 4;
-    typedef int scalar;
-    const static scalar full_mask = scalar(-1);
+    const static size_t max_width = 4;
+    const static bool is_aa = true;
 };
 
 struct papara_score_parameters {
@@ -244,10 +254,6 @@ public:
 
 
 
-extern bool g_dump_aux;
-
-
-
 template<class pvec_t,typename seq_tag>
 class my_adata_gen : public ivy_mike::tree_parser_ms::adata {
 //     static int ct;
@@ -273,10 +279,12 @@ public:
     virtual void visit() {
 //         std::cout << "tr: " << m_ct << "\n";
     }
-    void init_pvec(const std::vector< uint8_t >& seq) {
+    // pm: the gap model of the tree (only used by pvec_pgap)
+    void init_pvec(const std::vector< uint8_t >& seq, const probgap_model *pm = 0) {
 
 
         m_pvec.init2( seq, model<seq_tag>() );
+        m_pvec.set_gap_model( pm );
 //         std::cout << "init_pvec: " << m_pvec.size() << "\n";
 //                 m_pvec.reserve(seq.size());
 //         for( std::vector< uint8_t >::const_iterator it = seq.begin(); it != seq.end(); ++it ) {
@@ -332,6 +340,23 @@ void pairwise_seq_distance( std::vector< std::vector<uint8_t> > &seq );
 // template<typename pvec_t, typename seq_tag>
 // class references;
 
+// reads a fasta file in batches of records (used by the streaming mode, see driver::align_streaming). Each batch is
+// parsed by read_fasta, so the result is the same as if the whole file was read at once.
+class fasta_batch_reader {
+public:
+    explicit fasta_batch_reader( const std::string &name );
+
+    // reads up to max_records records into names and seqs (which are cleared first). Returns false if there are no
+    // more records.
+    bool read( size_t max_records, std::vector<std::string> *names, std::vector<std::vector<uint8_t> > *seqs );
+
+private:
+    std::ifstream is_;
+
+    // header line of the next record, which was already read by the previous batch
+    std::string next_header_;
+};
+
 template<typename seq_tag>
 class queries {
     typedef model<seq_tag> seq_model;
@@ -343,7 +368,14 @@ public:
 
     typedef typename seq_model::pars_state_t pars_state_t;
 
-    queries( const std::string &opt_qs_name );
+    // reads the queries with n_threads parser threads (see seq_reader.h)
+    queries( const std::string &opt_qs_name, size_t n_threads = 1 );
+
+    // reads the queries from fasta records in memory
+    queries( const uint8_t *fasta, size_t fasta_size, size_t n_threads = 1 );
+
+    // takes the sequences of names and seqs (e.g., one batch of a fasta_batch_reader). names is 'moved-from', seqs is cleared.
+    queries( std::vector<std::string> *names, std::vector<std::vector<uint8_t> > *seqs );
 
 
 
@@ -351,32 +383,67 @@ public:
 
     void preprocess() ;
 
+    // collapses queries with identical (preprocessed) sequences and per-qs bounds, so that they are only scored and
+    // traced once. Afterwards size() and the *_at methods refer to the unique queries, while the output iterates over
+    // all original queries via num_output/output_query/output_name. Must be called after preprocess and
+    // set_per_qs_bounds. Returns the number of collapsed queries.
+    size_t collapse_duplicates() ;
+
     //void init_partition_assignments( partassign::part_assignment &part_assign, references<pvec_t,seq_tag> &refs );
     
 
     size_t size() const {
-        return m_qs_seqs.size();
+        return m_qs_names.size();
     }
 
     const std::string &name_at( size_t i ) const {
         return m_qs_names.at(i);
     }
 
-    const std::vector<pars_state_t> &pvec_at( size_t i ) const {
-        assert( m_qs_pvecs.size() == m_qs_seqs.size() );
+    // the p-state representation is not stored, but materialized from the c-state representation on demand
+    // (i.e., only by the traceback and the output).
+    void pvec_at( size_t i, std::vector<pars_state_t> *pvec ) const {
+        assert( m_qs_cseqs.size() == m_qs_seqs.size() );
+
+        pvec->resize( m_qs_cseqs.length(i) );
+        std::transform( m_qs_cseqs.begin(i), m_qs_cseqs.end(i), pvec->begin(), seq_model::c2p );
+    }
+
+    std::vector<uint8_t> seq_at( size_t i ) const {
+        return std::vector<uint8_t>( m_qs_seqs.begin(i), m_qs_seqs.end(i) );
+    }
+
+    // c-state representation of the (preprocessed) query i. The c-states of all queries are stored back to back in
+    // query order, so the scoring loop streams through them sequentially.
+    const uint8_t *cseq_begin( size_t i ) const {
+        return m_qs_cseqs.begin(i);
+    }
 
-        return m_qs_pvecs.at(i);
+    const uint8_t *cseq_end( size_t i ) const {
+        return m_qs_cseqs.end(i);
     }
 
-    const std::vector<uint8_t> &seq_at( size_t i ) const {
-        return m_qs_seqs.at(i);
+    size_t cseq_size( size_t i ) const {
+        return m_qs_cseqs.length(i);
     }
 
-    const std::vector<uint8_t> &cseq_at( size_t i ) const {
-        return m_qs_cseqs.at(i);
+    // number of queries in the output (i.e., including the collapsed duplicates)
+    size_t num_output() const {
+        return m_out_query.empty() ? size() : m_out_query.size();
+    }
+
+    // index of the (unique) query whose alignment is written as output query j
+    size_t output_query( size_t j ) const {
+        return m_out_query.empty() ? j : m_out_query.at(j);
+    }
+
+    const std::string &output_name( size_t j ) const {
+        return m_out_names.empty() ? m_qs_names.at(j) : m_out_names.at(j);
     }
 
     void set_per_qs_bounds( const std::vector<std::pair<size_t,size_t> > &bounds ) {
+        assert( m_out_query.empty() );
+
         if( bounds.size() != m_qs_names.size() ) {
 //             std::cerr << m_qs_names.size() << " " << bounds.size() << "\n";
             throw std::runtime_error( "per_qs_bounds_.size() != m_qs_names.size()" );
@@ -404,7 +471,7 @@ public:
 
 
 
-    size_t calc_cups_per_ref( size_t ref_len ) const ;
+    size_t calc_cups_per_ref( size_t ref_len, size_t qs_begin = 0, size_t qs_end = -1 ) const ;
     
     // TEST: trying to make interconnection between queries and references more explicit.
     template<typename pvec_t_, typename seq_tag_>
@@ -415,13 +482,16 @@ private:
     void add( const std::string &name, std::vector<uint8_t> &qs ) ;
     
     std::vector <std::string> m_qs_names;
-    std::vector <std::vector<uint8_t> > m_qs_seqs;
+    seq_arena m_qs_seqs;
 
-    std::vector <std::vector<uint8_t> > m_qs_cseqs;
-
-    std::vector<std::vector <pars_state_t> > m_qs_pvecs;
+    seq_arena m_qs_cseqs;
 
     std::vector<std::pair<size_t,size_t> > per_qs_bounds_;
+
+    // set by collapse_duplicates (otherwise empty): names of all queries in input order, and the index of the unique
+    // query that represents each of them.
+    std::vector <std::string> m_out_names;
+    std::vector<size_t> m_out_query;
 };
 
 
@@ -434,14 +504,56 @@ public:
 
 
 
-    references( const char* opt_tree_name, const char *opt_alignment_name, queries<seq_tag> *qs )
+    references( const char* opt_tree_name, const char *opt_alignment_name, queries<seq_tag> *qs, size_t n_threads = 1 )
       ;
 
+    // same as above, with the reference alignment (phylip) in memory
+    references( const char* opt_tree_name, const uint8_t *alignment, size_t alignment_size, queries<seq_tag> *qs, size_t n_threads = 1 ) ;
+
+    // loads the references (including the ancestral state vectors) from a reference index created by write_index.
+    // The index must stay mapped as long as the references exist. If key is not 0, it must match the key of the index.
+    references( sptr::shared_ptr<mapped_file> index, uint64_t key, queries<seq_tag> *qs ) ;
+
+    // writes the reference index (see ref_index.h). Must be called after build_ref_vecs (or build_index_vecs), and before
+    // qs.preprocess().
+    void write_index( const char *name, uint64_t key, const queries<seq_tag> &qs ) const ;
+
+    // true if the ancestral state vectors are available (i.e., after build_ref_vecs or if loaded from an index)
+    bool has_ref_vecs() const {
+        return !m_ref_vecs.empty() || lazy_ref_vecs();
+    }
+
+    // true if the vectors are built on demand (see build_ref_vecs)
+    bool lazy_ref_vecs() const {
+        return m_ref_vec_cache.get() != 0;
+    }
+
+    // the cache of the vectors built on demand (0 if all vectors are built)
+    ref_vec_cache *lazy_vec_cache() const {
+        return m_ref_vec_cache.get();
+    }
+
     void remove_full_gaps() {
         
     }
     
-    void build_ref_vecs() ;
+    // n_threads: number of threads used to calculate the ancestral state vectors
+    // mem_limit: if not 0 and the vectors of all edges need more than mem_limit bytes, only the directional vectors
+    // (at site pattern resolution, packed with the 'hard' gap model) are kept, and the vectors of the edges are built on
+    // demand and cached in the rest of the limit (see ref_vec_cache.h). Throws if the directional vectors alone do not
+    // fit.
+    void build_ref_vecs( size_t n_threads = 1, size_t mem_limit = 0 ) ;
+
+    // same as build_ref_vecs (without memory limit) for write_index. With the 'hard' gap model (-c), the directional
+    // vectors are kept as well, so that the index can be updated incrementally (see ref_update.h). If previous is not
+    // 0, the directional vectors and the vectors of the edges that do not change are taken from it instead of being
+    // recalculated. previous are the references of the old tree (usually loaded from an index).
+    void build_index_vecs( size_t n_threads, const references *previous ) ;
+
+    // the directional vectors stored by build_index_vecs or loaded from an index (0 if not available)
+    const directional_state *dir_state() const {
+        return m_dir_state.get();
+    }
 
     const size_t find_name( const std::string &name ) const {
         // FIXME: linear search
@@ -466,23 +578,44 @@ public:
         return m_ref_seqs.size();
     }
 
-    const std::vector<int> &pvec_at( size_t i ) const {
-        return m_ref_pvecs.at(i);
+    // the ancestral state vector and aux flags of edge i (use packed_ref_vec::unpack to get the plain vectors). Only
+    // available if the vectors of all edges are built (i.e., !lazy_ref_vecs()).
+    const packed_ref_vec &ref_vec_at( size_t i ) const {
+        assert( !lazy_ref_vecs() );
+        return m_ref_vecs.at(i);
     }
 
-    const std::vector<unsigned int> &aux_at( size_t i ) const {
-        return m_ref_aux.at(i);
-    }
+    // same as above, but also works if the vectors are built on demand. The handle keeps the vector alive.
+    ref_vec_cache::handle get_ref_vec( size_t i ) const ;
 
     const std::vector<int> &ng_map_at( size_t i );
     
     size_t num_pvecs() const {
-        return m_ref_pvecs.size();
+        return lazy_ref_vecs() ? m_edge_nodes.size() : m_ref_vecs.size();
+    }
+
+    // Edges with identical ancestral state vectors (e.g., short branches) share the packed data of the lowest of these
+    // edges (the canonical edge), and only the canonical edges are scored (see driver::calc_scores).
+    const std::vector<uint32_t> &distinct_edges() const {
+        return m_distinct_edges;
+    }
+
+    uint32_t canonical_edge( size_t i ) const {
+        return m_canonical_edges.at(i);
+    }
+
+    // the other edges with the same vector as canonical edge i (empty for all other edges)
+    const std::vector<std::vector<uint32_t> > &duplicate_edges() const {
+        return m_duplicate_edges;
     }
 
     size_t pvec_size() const {
-        assert( !m_ref_pvecs.empty());
-        return m_ref_pvecs.front().size();
+        if( lazy_ref_vecs() ) {
+            return m_site_patterns.size();
+        }
+
+        assert( !m_ref_vecs.empty());
+        return m_ref_vecs.front().size();
     }
 
     void write_pvecs( const char * name ) ;
@@ -503,27 +636,66 @@ public:
     sptr::shared_ptr<im_tree_parser::lnode> tree() const {
         return tree_;
     }
+
+    // the two nodes of each edge (as node ids that are only meaningful within this instance), i.e., the topology of
+    // the reference tree. Also available if the references were loaded from an index.
+    const std::vector<std::pair<uint32_t,uint32_t> > &edge_nodes() const {
+        return m_edge_nodes;
+    }
 private:
     std::vector <std::string > m_ref_names;
     std::vector <std::vector<uint8_t> > m_ref_seqs;
     std::auto_ptr<ivy_mike::tree_parser_ms::ln_pool> m_ln_pool;
     edge_collector<im_tree_parser::lnode> m_ec;
     sptr::shared_ptr<im_tree_parser::lnode> tree_;
+    std::vector<std::pair<uint32_t,uint32_t> > m_edge_nodes;
     
     
-    std::vector<std::vector <int> > m_ref_pvecs;
-    std::vector<std::vector <unsigned int> > m_ref_aux;
-    std::vector<std::vector <double> > m_ref_gapp;
+    std::vector<packed_ref_vec> m_ref_vecs;
+
+    // site pattern of each column of the (cleaned) reference alignment. The vectors of the tips (and the directional
+    // vectors in build_ref_vecs) only have one column per pattern; m_ref_vecs are expanded to all columns.
+    std::vector<uint32_t> m_site_patterns;
+
+    // see distinct_edges
+    std::vector<uint32_t> m_distinct_edges;
+    std::vector<uint32_t> m_canonical_edges;
+    std::vector<std::vector<uint32_t> > m_duplicate_edges;
+
+    // finds the edges with identical vectors, and binds them to the data of their canonical edge
+    void share_duplicate_vecs() ;
+
+    // see dir_state
+    sptr::shared_ptr<directional_state> m_dir_state;
+
+    // builds the vectors of the edges on demand (see build_ref_vecs)
+    sptr::shared_ptr<ref_vec_cache::builder> m_lazy_builder;
+    sptr::shared_ptr<ref_vec_cache> m_ref_vec_cache;
+
+    // the queries [align_qs_begin_,align_qs_end_) were taken from the reference alignment (i.e., are not in the tree)
+    size_t align_qs_begin_;
+    size_t align_qs_end_;
+
+    // the reference index the ref vecs are bound to (if loaded from an index, or if build_index_vecs copied vectors
+    // from references loaded from an index)
+    sptr::shared_ptr<mapped_file> index_;
+
+    static uint32_t index_flags() ;
+
+    // common part of the constructors: parses the tree and distributes the reference alignment to the tips (or qs)
+    void init( const char* opt_tree_name, std::vector<std::string> *ref_ma_names, const seq_arena &ref_ma_seqs, queries<seq_tag> *qs ) ;
+
     std::vector<std::vector <int> > ref_ng_map_;
+    // the gap model of the tree. It is bound to the tip vectors (instead of the global pvec_pgap::pgap_model), so
+    // independent references can be used concurrently.
     probgap_model pm_;
-    stupid_ptr_guard<probgap_model> spg_;
 
 };
 
 
 template<typename seq_tag>
 class block_queue {
-    const static size_t VW = vu_config<seq_tag>::width;
+    const static size_t VW = vu_config<seq_tag>::max_width;
 
 public:
     struct block_t {
@@ -531,56 +703,176 @@ public:
             memset( this, 0, sizeof( block_t )); // FIXME: hmm, this is still legal?
         }
 
-        // WARNING: these are pointers into m_ref_pvecs and m_ref_aux
+        // WARNING: these are pointers into m_ref_vecs
         // make sure they stay valid!
-        const int *seqptrs[VW];
-        const unsigned int *auxptrs[VW];
-        const double *gapp_ptrs[VW];
+        const packed_ref_vec *refs[VW];
         size_t ref_len;
         size_t edges[VW];
         int num_valid;
+
+        // range of queries [qs_begin,qs_end) that shall be aligned against the edges of this block. If there are only few
+        // blocks (i.e., small reference trees) the query set is split up so that there is enough work for all threads.
+        size_t qs_begin;
+        size_t qs_end;
+
+        // read-only profile of the edges (see scoring_kernel_factory::build_profile) that is shared by all threads. It
+        // points into the profile arena of the block_queue. If it is 0, the worker builds the profile itself.
+        const void *profile;
     };
 
+    // work-stealing scheduler: each thread owns a deque of blocks and pops from its front. When a thread runs out
+    // of work, it steals half of the blocks from the back of another thread's deque. The deques are guarded by
+    // separate mutexes, so that the threads only contend when stealing.
+    block_queue( size_t num_threads = 1 ) : next_push_(0), num_blocks_(0) {
+        if( num_threads == 0 ) {
+            throw std::runtime_error( "block_queue: num_threads == 0" );
+        }
 
-//    bool empty() {
-//        ivy_mike::lock_guard<ivy_mike::mutex> lock(m_qmtx);
-//
-//        return m_blockqueue.empty();
-//
-//    }
+        for( size_t i = 0; i < num_threads; ++i ) {
+            deques_.push_back( sptr::shared_ptr<thread_deque>( new thread_deque ));
+        }
+    }
 
-    bool get_block( block_t *block, size_t *queue_size = 0 ) {
-        ivy_mike::lock_guard<ivy_mike::mutex> lock( m_qmtx );
+    bool get_block( block_t *block, size_t rank ) {
+        assert( rank < deques_.size() );
 
-        if( m_blockqueue.empty() ) {
-            return false;
+        thread_deque &own = *deques_[rank];
+
+        while( true ) {
+            {
+                ivy_mike::lock_guard<ivy_mike::mutex> lock( own.mtx );
+
+                if( !own.blocks.empty() ) {
+                    *block = own.blocks.front();
+                    own.blocks.pop_front();
+
+                    return true;
+                }
+            }
+
+            // REMARK: there is a benign race here: while a thief moves the stolen blocks into its own deque, they are
+            // invisible to other threads. In the worst case another thread gives up a bit too early, but no block is lost.
+            if( !steal( rank ) ) {
+                return false;
+            }
         }
+    }
 
-        *block = m_blockqueue.front();
-        m_blockqueue.pop_front();
+    // number of blocks that are not yet taken by a thread. Only approximate while the worker threads are running.
+    size_t size() {
+        size_t n = 0;
 
-        if( queue_size != 0 ) {
-            *queue_size = m_blockqueue.size();
+        for( typename std::vector<sptr::shared_ptr<thread_deque> >::iterator it = deques_.begin(); it != deques_.end(); ++it ) {
+            ivy_mike::lock_guard<ivy_mike::mutex> lock( (*it)->mtx );
+            n += (*it)->blocks.size();
         }
-        
-        return true;
 
+        return n;
     }
 
+    size_t num_blocks() const {
+        return num_blocks_;
+    }
+
+    size_t num_threads() const {
+        return deques_.size();
+    }
 
     // WARNING: this method is not synchronized, and shall only be called before the worker threads are running
     void push_back( const block_t &b ) {
-        m_blockqueue.push_back(b);
+        deques_[next_push_]->blocks.push_back(b);
+        next_push_ = (next_push_ + 1) % deques_.size();
+        ++num_blocks_;
+    }
+
+    // get up to max_blocks blocks that share the same query range (used for the tiled scoring loop). As the blocks are
+    // pushed query range major, consecutive blocks in a thread's deque normally belong to the same query range.
+    bool get_blocks( std::vector<block_t> *blocks, size_t max_blocks, size_t rank ) {
+        assert( max_blocks > 0 );
+
+        blocks->clear();
+
+        block_t first;
+        if( !get_block( &first, rank ) ) {
+            return false;
+        }
+        blocks->push_back( first );
+
+        thread_deque &own = *deques_[rank];
+        ivy_mike::lock_guard<ivy_mike::mutex> lock( own.mtx );
+
+        while( blocks->size() < max_blocks && !own.blocks.empty() ) {
+            const block_t &next = own.blocks.front();
+
+            if( next.qs_begin != first.qs_begin || next.qs_end != first.qs_end ) {
+                break;
+            }
+
+            blocks->push_back( next );
+            own.blocks.pop_front();
+        }
+
+        return true;
+    }
+
+    // allocates the (aligned) memory for the shared profiles of all blocks, which is owned by the queue.
+    // WARNING: this method is not synchronized, and shall only be called before the worker threads are running
+    uint8_t *alloc_profiles( size_t size ) {
+        profiles_.resize( size );
+        return profiles_.base();
     }
 
     ivy_mike::mutex *hack_mutex() {
         return &m_qmtx;
     }
 private:
-    ivy_mike::mutex m_qmtx; // mutex for the block queue and the qs best score/edge arrays
-    std::deque<block_t> m_blockqueue;
-    std::vector <int> m_qs_bestscore;
-    std::vector <int> m_qs_bestedge;
+    struct thread_deque {
+        ivy_mike::mutex mtx;
+        std::deque<block_t> blocks;
+    };
+
+    bool steal( size_t rank ) {
+        std::vector<block_t> stolen;
+
+        // try the other threads round-robin, starting at the right neighbor
+        for( size_t i = 1; i < deques_.size() && stolen.empty(); ++i ) {
+            thread_deque &victim = *deques_[(rank + i) % deques_.size()];
+
+            ivy_mike::lock_guard<ivy_mike::mutex> lock( victim.mtx );
+
+            const size_t num_steal = (victim.blocks.size() + 1) / 2;
+
+            stolen.assign( victim.blocks.end() - num_steal, victim.blocks.end() );
+            victim.blocks.erase( victim.blocks.end() - num_steal, victim.blocks.end() );
+        }
+
+        if( stolen.empty() ) {
+            return false;
+        }
+
+        thread_deque &own = *deques_[rank];
+        ivy_mike::lock_guard<ivy_mike::mutex> lock( own.mtx );
+        own.blocks.insert( own.blocks.end(), stolen.begin(), stolen.end() );
+
+        return true;
+    }
+
+    ivy_mike::mutex m_qmtx; // only used to serialize the log output of the worker threads
+    std::vector<sptr::shared_ptr<thread_deque> > deques_;
+    size_t next_push_;
+    size_t num_blocks_;
+
+    ivy_mike::aligned_buffer<uint8_t,scoring_kernel_factory::profile_alignment> profiles_;
+};
+
+
+// tile sizes of the scoring loop: each worker aligns a tile of 'qs' queries against 'ref_blocks' ref-blocks at a time,
+// so that the query tile stays in L2 and the profiles of the ref-blocks stay in the (shared) last level cache.
+struct scoring_tiles {
+    scoring_tiles( size_t ref_blocks_ = 1, size_t qs_ = size_t(-1) ) : ref_blocks(ref_blocks_), qs(qs_) {}
+
+    size_t ref_blocks;
+    size_t qs;
 };
 
 
@@ -616,6 +908,10 @@ public:
 
         void offer( int score, size_t ref ) ;
 
+        size_t max_num() const {
+            return max_num_;
+        }
+
         using std::vector<candidate>::at;
         using std::vector<candidate>::operator[];
         using std::vector<candidate>::size;
@@ -630,7 +926,9 @@ public:
     scoring_results( size_t num_qs, const candidates &cands_template )
     : best_score_(num_qs, std::numeric_limits<int>::min() ),
       best_ref_(num_qs, size_t(-1)),
-      candss_(num_qs, cands_template )
+      best_end_(num_qs, std::make_pair(-1, -1)),
+      candss_(num_qs, cands_template ),
+      cands_template_(cands_template)
     {}
 
 
@@ -638,27 +936,47 @@ public:
     bool offer( size_t qs, size_t ref, int score ) ;
 
 
-    template<typename idx_iter, typename score_iter>
-    void offer( size_t qs, idx_iter ref_start, idx_iter ref_end, score_iter score_start ) {
+    // end_start points to the positions (ref, query) of the best cells, as reported by the scoring kernels
+    template<typename idx_iter, typename score_iter, typename end_iter>
+    void offer( size_t qs, idx_iter ref_start, idx_iter ref_end, score_iter score_start, end_iter end_start ) {
         ivy_mike::lock_guard<ivy_mike::mutex> lock(mtx_);
 
+        offer_unsynchronized( qs, ref_start, ref_end, score_start, end_start );
+    }
 
-        while( ref_start != ref_end ) {
-            candss_.at( qs ).offer( *score_start, *ref_start );
-
+    // same as offer, but without locking. Only use this on instances that are private to a single thread
+    // (i.e., the per-thread results of the scoring workers, which are merged into the shared results later on).
+    template<typename idx_iter, typename score_iter, typename end_iter>
+    void offer_unsynchronized( size_t qs, idx_iter ref_start, idx_iter ref_end, score_iter score_start, end_iter end_start ) {
+        candidates &cands = candss_.at( qs );
 
-            if( best_score_.at(qs) < *score_start || (best_score_.at(qs) == *score_start && *ref_start < best_ref_.at(qs))) {
-                best_score_[qs] = *score_start;
-                best_ref_.at(qs) = *ref_start;
+        while( ref_start != ref_end ) {
+            if( cands.max_num() != 0 ) {
+                cands.offer( *score_start, *ref_start );
             }
 
+            update_best( qs, *ref_start, *score_start, *end_start );
 
             ++ref_start;
             ++score_start;
+            ++end_start;
         }
 
     }
 
+    // merge the results of another instance (usually the per-thread results of a worker) into this one.
+    // The outcome does not depend on the order in which the results are merged, because ties are always
+    // broken towards the lowest ref index (same as in offer).
+    void merge( const scoring_results &other ) ;
+
+    size_t size() const {
+        return best_score_.size();
+    }
+
+    const candidates &candidates_template() const {
+        return cands_template_;
+    }
+
 
     int bestscore_at(size_t i ) const {
         return best_score_.at(i);
@@ -668,15 +986,33 @@ public:
         return best_ref_.at(i);
     }
 
+    // position (ref, query) of the last cell of the best alignment, or (-1,-1) if unknown.
+    std::pair<int,int> bestend_at(size_t i ) const {
+        return best_end_.at(i);
+    }
+
     const candidates &candidates_at( size_t i ) const {
         return candss_.at( i );
     }
 
 private:
+    bool update_best( size_t qs, size_t ref, int score, const std::pair<int,int> &end ) {
+        if( best_score_.at(qs) < score || (best_score_.at(qs) == score && ref < best_ref_.at(qs))) {
+            best_score_[qs] = score;
+            best_ref_[qs] = ref;
+            best_end_[qs] = end;
+            return true;
+        }
+
+        return false;
+    }
+
     std::vector<int> best_score_;
     std::vector<size_t> best_ref_;
+    std::vector<std::pair<int,int> > best_end_;
 
     std::vector<candidates> candss_;
+    const candidates cands_template_;
 
     ivy_mike::mutex mtx_;
 
@@ -847,6 +1183,20 @@ private:
 };
 
 
+// optional heuristics that restrict the edges each query is scored against (see driver::score_queries). If none is
+// set, all edges are scored.
+struct edge_search {
+    edge_search() : prefilter(0), clades(0), clade_margin(0) {}
+
+    // k-mer prefilter (papara -P)
+    const kmer_prefilter *prefilter;
+
+    // tree-guided search (papara -T): only the clades whose representative edge scores at least (best score of the
+    // query - clade_margin) are refined
+    const clade_hierarchy *clades;
+    int clade_margin;
+};
+
 template<typename pvec_t, typename seq_tag>
 class driver {
 public:
@@ -854,24 +1204,57 @@ public:
     typedef references<pvec_t,seq_tag> my_references;
     typedef block_queue<seq_tag> my_block_queue;
     
-    static void calc_scores( size_t n_threads, const my_references &refs, const my_queries &qs, scoring_results *res, const papara_score_parameters &sp );
+    // cands: if not 0, only the ref-blocks that contain a candidate edge of a query are scored for it, and the scores
+    // of the candidate edges are recorded in cands. edges: if not 0, only these edges are scored (they are grouped into
+    // ref-blocks in the given order).
+    static void calc_scores( size_t n_threads, const my_references &refs, const my_queries &qs, scoring_results *res, const papara_score_parameters &sp, edge_candidates *cands = 0, const std::vector<uint32_t> *edges = 0 );
+
+    // the k-mer index for score_queries, which keeps keep candidate edges per query
+    static std::auto_ptr<kmer_prefilter> build_prefilter( const my_references &refs, size_t keep, size_t n_threads = 1 );
+
+    // the clade hierarchy of the reference tree for score_queries
+    static std::auto_ptr<clade_hierarchy> build_clades( const my_references &refs );
+
+    // same as calc_scores, using the heuristics of search (if not 0). With the prefilter, the queries are only scored
+    // against (the ref-blocks of) their candidate edges, and the recall of the candidates is reported for a sample of
+    // the queries. With the clade hierarchy, the queries are scored in rounds, descending into the promising clades.
+    static void score_queries( size_t n_threads, const my_references &refs, const my_queries &qs, scoring_results *res, const papara_score_parameters &sp, const edge_search *search );
     
     static void do_newview( pvec_t &root_pvec, im_tree_parser::lnode *n1, im_tree_parser::lnode *n2, bool incremental ) ;
     
-    static void build_block_queue( const my_references &refs, my_block_queue *bq ) ;
+    static void build_block_queue( const my_references &refs, size_t num_qs, const scoring_kernel_factory &kernels, my_block_queue *bq, const std::vector<uint32_t> *edges = 0 ) ;
+
+    static scoring_tiles tune_tiles( const my_references &refs, const my_queries &qs, size_t n_threads, const scoring_kernel_factory &kernels ) ;
     
     static void seq_to_position_map(const std::vector< uint8_t >& seq, std::vector< int > &map) ;
     
     static void print_best_scores( std::ostream &os, const my_queries &qs, const scoring_results &res ) ;
     
-    static std::vector<std::vector<uint8_t> > generate_traces( std::ostream &os_quality, std::ostream &os_cands, const my_queries &qs, const my_references &refs, const scoring_results &res, const papara_score_parameters &sp ) ;
+    static std::vector<std::vector<uint8_t> > generate_traces( std::ostream &os_quality, std::ostream &os_cands, const my_queries &qs, const my_references &refs, const scoring_results &res, const papara_score_parameters &sp, size_t n_threads = 1 ) ;
     
-    static void align_best_scores2( std::ostream &os, std::ostream &os_quality, std::ostream &os_cands, const my_queries &qs, const my_references &refs, const scoring_results &res, size_t pad, const bool ref_gaps, const papara_score_parameters &sp ) ;
+    static void align_best_scores2( std::ostream &os, std::ostream &os_quality, std::ostream &os_cands, const my_queries &qs, const my_references &refs, const scoring_results &res, size_t pad, const bool ref_gaps, const papara_score_parameters &sp, size_t n_threads = 1 ) ;
     
-    static void align_best_scores( std::ostream &os, std::ostream &os_quality, std::ostream &os_cands, const my_queries &qs, const my_references &refs, const scoring_results &res, size_t pad, const bool ref_gaps, const papara_score_parameters &sp ) ;
+    static void align_best_scores( std::ostream &os, std::ostream &os_quality, std::ostream &os_cands, const my_queries &qs, const my_references &refs, const scoring_results &res, size_t pad, const bool ref_gaps, const papara_score_parameters &sp, size_t n_threads = 1 ) ;
     
-    static void align_best_scores_oa( output_alignment *os, const my_queries &qs, const my_references &refs, const scoring_results &res, size_t pad, const bool ref_gaps, const papara_score_parameters &sp );
-            
+    static void align_best_scores_oa( output_alignment *os, const my_queries &qs, const my_references &refs, const scoring_results &res, size_t pad, const bool ref_gaps, const papara_score_parameters &sp, size_t n_threads = 1 );
+
+    // scores and traces the (preprocessed) queries and writes one '<name> <aligned query>' line per output query to os. The
+    // queries are aligned against the reference columns, i.e., without reference-side gaps (used by the daemon mode).
+    static void align_rows( std::ostream &os, const my_queries &qs, const my_references &refs, const papara_score_parameters &sp, size_t n_threads = 1, const edge_search *search = 0 );
+
+    // same as above, the rows (in the order of the output queries) are passed to sink. Only reads refs, i.e., the same
+    // references can be used by several threads concurrently.
+    static void align_rows( row_sink *sink, const my_queries &qs, const my_references &refs, const papara_score_parameters &sp, size_t n_threads = 1, const edge_search *search = 0 );
+
+    // streaming mode: the queries of qs_reader (followed by the queries taken from the reference alignment in align_qs) are
+    // scored and traced in batches of batch_size. The traces of each batch are written to the spill file tmp_name, which is
+    // read back to write the output alignment after the reference gaps of all batches are known. The memory therefore does not
+    // depend on the number of queries. Per-query bounds (-l/-x/-k) are not supported. search: see score_queries.
+    static void align_streaming( output_alignment *oa, fasta_batch_reader *qs_reader, my_queries *align_qs, const my_references &refs, size_t batch_size, const std::string &tmp_name, const bool ref_gaps, const papara_score_parameters &sp, size_t n_threads = 1, const edge_search *search = 0 );
+
+private:
+    static void score_prefiltered( size_t n_threads, const my_references &refs, const my_queries &qs, scoring_results *res, const papara_score_parameters &sp, const kmer_prefilter &prefilter );
+    static void score_clades( size_t n_threads, const my_references &refs, const my_queries &qs, scoring_results *res, const papara_score_parameters &sp, const clade_hierarchy &clades, int margin );
 };
 
 
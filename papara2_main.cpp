@@ -19,9 +19,11 @@
 
 #include "blast_partassign.h"
 
+#include "ivymike/fasta.h"
 #include "ivymike/getopt.h"
 #include "ivymike/time.h"
 
+#include "batch_server.h"
 #include "papara.h"
 
 using namespace papara;
@@ -110,6 +112,30 @@ void print_help( std::ostream &os ) {
 
     options.push_back( "-p" );
     text.push_back( "User defined scoring scheme: <open>:<extend>:<match>:<match cg>@The default scores correspond to '-p -3:-1:2:-3'" );
+
+    options.push_back( "-B <index file>" );
+    text.push_back( "Build a reference index from -t and -s and exit.@Later runs can use it with -i (with the same -a/-c options)" );
+
+    options.push_back( "-U <index file>" );
+    text.push_back( "Update (with -B): build the new index from -t and -s,@taking the vectors of all parts of the tree that did not@change from the given older index (requires -c).@It can be the same file as -B (updated in place)" );
+
+    options.push_back( "-i <index file>" );
+    text.push_back( "Use a reference index (see -B) instead of -t and -s.@If -t and -s are given as well, the index is checked against them" );
+
+    options.push_back( "-D <socket>" );
+    text.push_back( "Daemon mode: load the references once, then align query@batches received on the unix socket (or on stdin/stdout@if <socket> is '-'). See batch_server.h for the protocol" );
+
+    options.push_back( "-S <batch size>" );
+    text.push_back( "Streaming mode: process the query sequences in batches@of the given size, to bound the memory usage (can not be@used with -l/-x/-k)" );
+
+    options.push_back( "-P <keep>" );
+    text.push_back( "Prefilter (heuristic): score each query only against the@<keep> edges that share the most k-mers with it.@The recall is reported for a sample of the queries" );
+
+    options.push_back( "-T <margin>" );
+    text.push_back( "Tree-guided search (heuristic): score representative@edges of clades of the tree first, and only descend into@the clades that score within <margin> of the best score@of the query (can not be used with -P)" );
+
+    options.push_back( "-M <megabytes>" );
+    text.push_back( "Memory limit for the ancestral state vectors of the edges.@If they do not fit, they are built on demand during the@scoring from the directional vectors (which count against@the limit) and cached in the rest of it (not used with -i,@can not be used with -B/-P)" );
     
     print_help( os, options, text );
 
@@ -118,19 +144,104 @@ void print_help( std::ostream &os ) {
 
 
 
+// content hash of the reference tree and alignment, used as key of the reference index (0 if they are not known)
+uint64_t reference_key( const std::string &tree_name, const std::string &alignment_name ) {
+    if( tree_name.empty() || alignment_name.empty() ) {
+        return 0;
+    }
+
+    content_hash h;
+    h.update_file( tree_name.c_str() );
+    h.update_file( alignment_name.c_str() );
+
+    return h.value();
+}
+
+// options of the search heuristics (-P/-T)
+struct search_options {
+    search_options() : prefilter_keep(0), tree_search(false), clade_margin(0) {}
+
+    size_t prefilter_keep;
+    bool tree_search;
+    int clade_margin;
+};
+
+// the search heuristics for driver::score_queries, built from the ancestral state vectors (or the tree) of refs
+class search_setup {
+public:
+    template<typename pvec_t, typename seq_tag>
+    search_setup( const references<pvec_t,seq_tag> &refs, const search_options &opts, size_t num_threads ) {
+        if( opts.prefilter_keep > 0 ) {
+            prefilter_ = driver<pvec_t,seq_tag>::build_prefilter( refs, opts.prefilter_keep, num_threads );
+            search_.prefilter = prefilter_.get();
+        }
+
+        if( opts.tree_search ) {
+            clades_ = driver<pvec_t,seq_tag>::build_clades( refs );
+            search_.clades = clades_.get();
+            search_.clade_margin = opts.clade_margin;
+        }
+    }
+
+    const edge_search *get() const {
+        return &search_;
+    }
+
+private:
+    std::auto_ptr<kmer_prefilter> prefilter_;
+    std::auto_ptr<clade_hierarchy> clades_;
+    edge_search search_;
+};
+
+template<typename pvec_t, typename seq_tag>
+void build_index( const std::string &alignment_name, const std::string &tree_name, size_t num_threads, const std::string &index_name, const std::string &previous_index_name ) {
+    ivy_mike::timer t1;
+
+    // the sequences of the reference alignment that are not in the tree are stored in the index (as queries)
+    queries<seq_tag> qs("");
+    references<pvec_t,seq_tag> refs( tree_name.c_str(), alignment_name.c_str(), &qs, num_threads );
+
+    refs.remove_full_gaps();
+
+    if( previous_index_name.empty() ) {
+        refs.build_index_vecs( num_threads, 0 );
+    } else {
+        // only the references of the older index are used. The vectors taken from it still point into its mapping
+        // (which refs shares), also while write_index runs. This is fine even if it is the same file as index_name:
+        // index_writer writes to a temporary file and renames it, so the mapping keeps the old file.
+        queries<seq_tag> previous_qs("");
+        sptr::shared_ptr<mapped_file> previous_index( new mapped_file( previous_index_name.c_str() ));
+        references<pvec_t,seq_tag> previous( previous_index, 0, &previous_qs );
+
+        refs.build_index_vecs( num_threads, &previous );
+    }
+
+    refs.write_index( index_name.c_str(), reference_key( tree_name, alignment_name ), qs );
+
+    lout << "reference index written to " << index_name << ": " << t1.elapsed() << "s" << std::endl;
+}
+
 template<typename pvec_t, typename seq_tag>
-void run_papara( const std::string &qs_name, const std::string &alignment_name, const std::string &tree_name, size_t num_threads, const std::string &run_name, bool ref_gaps, const papara_score_parameters &sp, bool write_fasta, partassign::part_assignment *part_assign, const std::pair<size_t,size_t> &fixed_qs_bounds ) {
+void run_papara( const std::string &qs_name, const std::string &alignment_name, const std::string &tree_name, const std::string &index_name, size_t num_threads, const std::string &run_name, bool ref_gaps, const papara_score_parameters &sp, bool write_fasta, partassign::part_assignment *part_assign, const std::pair<size_t,size_t> &fixed_qs_bounds, const search_options &search_opts, size_t mem_limit ) {
 
     ivy_mike::perf_timer t1;
 
-    queries<seq_tag> qs(qs_name.c_str());
+    queries<seq_tag> qs(qs_name.c_str(), num_threads);
 
     
     
     
     t1.add_int();
-    references<pvec_t,seq_tag> refs( tree_name.c_str(), alignment_name.c_str(), &qs );
+    std::auto_ptr<references<pvec_t,seq_tag> > refs_ptr;
 
+    if( index_name.empty() ) {
+        refs_ptr.reset( new references<pvec_t,seq_tag>( tree_name.c_str(), alignment_name.c_str(), &qs, num_threads ));
+    } else {
+        sptr::shared_ptr<mapped_file> index( new mapped_file( index_name.c_str() ));
+        refs_ptr.reset( new references<pvec_t,seq_tag>( index, reference_key( tree_name, alignment_name ), &qs ));
+    }
+
+    references<pvec_t,seq_tag> &refs = *refs_ptr;
     
     
     t1.add_int();
@@ -139,8 +250,11 @@ void run_papara( const std::string &qs_name, const std::string &alignment_name,
    
     t1.add_int();
 
-    refs.remove_full_gaps();
-    refs.build_ref_vecs();
+    // the ancestral state vectors are already available if the references were loaded from an index
+    if( !refs.has_ref_vecs() ) {
+        refs.remove_full_gaps();
+        refs.build_ref_vecs( num_threads, mem_limit );
+    }
 
     if( part_assign != 0 ) {
         if( ref_gaps ) {
@@ -166,6 +280,12 @@ void run_papara( const std::string &qs_name, const std::string &alignment_name,
     
     
     
+    // identical queries are only scored and traced once
+    const size_t num_collapsed = qs.collapse_duplicates();
+    if( num_collapsed > 0 ) {
+        lout << "collapsed " << num_collapsed << " duplicate queries (" << qs.size() << " unique queries)" << std::endl;
+    }
+
     t1.add_int();
 
 //     t1.print();
@@ -177,7 +297,9 @@ void run_papara( const std::string &qs_name, const std::string &alignment_name,
 
     lout << "scoring scheme: " << sp.gap_open << " " << sp.gap_extend << " " << sp.match << " " << sp.match_cgap << "\n";
 
-    driver<pvec_t,seq_tag>::calc_scores(num_threads, refs, qs, &res, sp );
+    const search_setup search( refs, search_opts, num_threads );
+
+    driver<pvec_t,seq_tag>::score_queries(num_threads, refs, qs, &res, sp, search.get() );
 
     std::string score_file(filename(run_name, "alignment"));
     std::string quality_file(filename(run_name, "quality"));
@@ -210,10 +332,146 @@ void run_papara( const std::string &qs_name, const std::string &alignment_name,
     
     //refs.write_seqs(os, pad);
     //     driver<pvec_t,seq_tag>::align_best_scores( os, os_qual, os_cands, qs, refs, res, pad, ref_gaps, sp );
-    driver<pvec_t,seq_tag>::align_best_scores_oa( oa.get(), qs, refs, res, pad, ref_gaps, sp );
+    driver<pvec_t,seq_tag>::align_best_scores_oa( oa.get(), qs, refs, res, pad, ref_gaps, sp, num_threads );
     
 }
 
+// streaming mode (-S): the queries are read, scored and traced in batches of batch_size sequences, so that only one
+// batch is in memory at a time (see driver::align_streaming)
+template<typename pvec_t, typename seq_tag>
+void run_papara_streaming( const std::string &qs_name, const std::string &alignment_name, const std::string &tree_name, const std::string &index_name, size_t num_threads, const std::string &run_name, bool ref_gaps, const papara_score_parameters &sp, bool write_fasta, size_t batch_size, const search_options &search_opts, size_t mem_limit ) {
+
+    // only receives the sequences from the reference alignment that are not in the tree
+    queries<seq_tag> align_qs( "" );
+
+    std::auto_ptr<references<pvec_t,seq_tag> > refs_ptr;
+
+    if( index_name.empty() ) {
+        refs_ptr.reset( new references<pvec_t,seq_tag>( tree_name.c_str(), alignment_name.c_str(), &align_qs, num_threads ));
+    } else {
+        sptr::shared_ptr<mapped_file> index( new mapped_file( index_name.c_str() ));
+        refs_ptr.reset( new references<pvec_t,seq_tag>( index, reference_key( tree_name, alignment_name ), &align_qs ));
+    }
+
+    references<pvec_t,seq_tag> &refs = *refs_ptr;
+
+    if( !refs.has_ref_vecs() ) {
+        refs.remove_full_gaps();
+        refs.build_ref_vecs( num_threads, mem_limit );
+    }
+
+    const search_setup search( refs, search_opts, num_threads );
+
+    std::auto_ptr<fasta_batch_reader> qs_reader;
+    if( !qs_name.empty() ) {
+        qs_reader.reset( new fasta_batch_reader( qs_name ));
+    }
+
+    lout << "scoring scheme: " << sp.gap_open << " " << sp.gap_extend << " " << sp.match << " " << sp.match_cgap << "\n";
+    lout << "streaming mode: batch size " << batch_size << std::endl;
+
+    std::string score_file(filename(run_name, "alignment"));
+    std::string quality_file(filename(run_name, "quality"));
+
+    std::ofstream os_qual( quality_file.c_str() );
+    assert( os_qual.good() );
+
+    std::auto_ptr<papara::output_alignment> oa;
+    if( write_fasta ) {
+        oa.reset( new papara::output_alignment_fasta( score_file.c_str() ));
+    } else {
+        oa.reset( new papara::output_alignment_phylip( score_file.c_str() ));
+    }
+
+    driver<pvec_t,seq_tag>::align_streaming( oa.get(), qs_reader.get(), &align_qs, refs, batch_size, filename(run_name, "stream_tmp"), ref_gaps, sp, num_threads, search.get() );
+}
+
+// daemon mode (-D): answers query batches with the aligned query rows (see batch_server.h)
+template<typename pvec_t, typename seq_tag>
+class daemon_handler : public batch_handler {
+public:
+    daemon_handler( const references<pvec_t,seq_tag> &refs, const papara_score_parameters &sp, size_t num_threads, const edge_search *search ) : refs_(refs), sp_(sp), num_threads_(num_threads), search_(search) {}
+
+    void handle( std::istream &in, std::ostream &out ) {
+        ivy_mike::timer t1;
+
+        std::vector<std::string> names;
+        std::vector<std::vector<uint8_t> > seqs;
+        read_fasta( in, names, seqs );
+
+        queries<seq_tag> qs( &names, &seqs );
+        qs.preprocess();
+
+        // a query without any valid character can not be aligned (and would stall the scoring)
+        for( size_t i = 0; i < qs.size(); ++i ) {
+            if( qs.cseq_size(i) == 0 ) {
+                throw std::runtime_error( "query " + qs.name_at(i) + " is empty (after removing gaps and unsupported characters)" );
+            }
+        }
+
+        qs.collapse_duplicates();
+
+        driver<pvec_t,seq_tag>::align_rows( out, qs, refs_, sp_, num_threads_, search_ );
+
+        lout << "daemon: batch of " << qs.num_output() << " queries: " << t1.elapsed() << "s" << std::endl;
+    }
+
+private:
+    const references<pvec_t,seq_tag> &refs_;
+    const papara_score_parameters sp_;
+    const size_t num_threads_;
+    const edge_search *search_;
+};
+
+template<typename pvec_t, typename seq_tag>
+void run_papara_daemon( const std::string &alignment_name, const std::string &tree_name, const std::string &index_name, size_t num_threads, const papara_score_parameters &sp, const std::string &socket_name, std::ostream &os_stream, const search_options &search_opts, size_t mem_limit ) {
+    // the sequences from the reference alignment that are not in the tree are not aligned in daemon mode
+    queries<seq_tag> align_qs( "" );
+
+    std::auto_ptr<references<pvec_t,seq_tag> > refs_ptr;
+
+    if( index_name.empty() ) {
+        refs_ptr.reset( new references<pvec_t,seq_tag>( tree_name.c_str(), alignment_name.c_str(), &align_qs, num_threads ));
+    } else {
+        sptr::shared_ptr<mapped_file> index( new mapped_file( index_name.c_str() ));
+        refs_ptr.reset( new references<pvec_t,seq_tag>( index, reference_key( tree_name, alignment_name ), &align_qs ));
+    }
+
+    references<pvec_t,seq_tag> &refs = *refs_ptr;
+
+    if( !refs.has_ref_vecs() ) {
+        refs.remove_full_gaps();
+        refs.build_ref_vecs( num_threads, mem_limit );
+    }
+
+    // the k-mer index and the clades are built once, like the ancestral state vectors
+    const search_setup search( refs, search_opts, num_threads );
+
+    daemon_handler<pvec_t,seq_tag> handler( refs, sp, num_threads, search.get() );
+
+    if( socket_name == "-" ) {
+        lout << "daemon: reading query batches from stdin" << std::endl;
+        serve_stream( std::cin, os_stream, &handler );
+    } else {
+        lout << "daemon: listening on " << socket_name << std::endl;
+        serve_unix_socket( socket_name, &handler );
+    }
+}
+
+
+// RAII: lets 'from' write into the buffer of 'to'
+class stream_redirect {
+public:
+    stream_redirect( std::ostream &from, std::ostream &to ) : from_(from), old_buf_( from.rdbuf( to.rdbuf() )) {}
+
+    ~stream_redirect() {
+        from_.rdbuf( old_buf_ );
+    }
+
+private:
+    std::ostream &from_;
+    std::streambuf *old_buf_;
+};
 
 void print_commandline( std::ostream &os, char **argv, int argc ) {
 
@@ -248,6 +506,14 @@ int main( int argc, char *argv[] ) {
     bool opt_no_ref_gaps;
     bool opt_print_help;
     bool opt_write_fasta;
+    std::string opt_build_index;
+    std::string opt_index;
+    std::string opt_previous_index;
+    int opt_batch_size;
+    std::string opt_daemon_socket;
+    int opt_prefilter_keep;
+    int opt_clade_margin;
+    int opt_mem_limit;
     
     igp.add_opt( 't', igo::value<std::string>(opt_tree_name) );
     igp.add_opt( 's', igo::value<std::string>(opt_alignment_name) );
@@ -265,6 +531,14 @@ int main( int argc, char *argv[] ) {
     igp.add_opt( 'l', igo::value<std::string>(opt_blast_hits) );
     igp.add_opt( 'x', igo::value<std::string>(opt_partitions) );
     igp.add_opt( 'k', igo::value<std::string>(opt_partition_name) );
+    igp.add_opt( 'B', igo::value<std::string>(opt_build_index) );
+    igp.add_opt( 'i', igo::value<std::string>(opt_index) );
+    igp.add_opt( 'U', igo::value<std::string>(opt_previous_index) );
+    igp.add_opt( 'S', igo::value<int>(opt_batch_size).set_default(0) );
+    igp.add_opt( 'D', igo::value<std::string>(opt_daemon_socket) );
+    igp.add_opt( 'P', igo::value<int>(opt_prefilter_keep).set_default(0) );
+    igp.add_opt( 'T', igo::value<int>(opt_clade_margin).set_default(0) );
+    igp.add_opt( 'M', igo::value<int>(opt_mem_limit).set_default(0) );
     
     igp.parse(argc,argv);
 
@@ -277,7 +551,16 @@ int main( int argc, char *argv[] ) {
     }
          
     
-    if( igp.opt_count('t') != 1 || igp.opt_count('s') != 1 ) {
+    if( igp.opt_count('i') == 1 && igp.opt_count('B') == 1 ) {
+        print_banner(std::cerr);
+
+        std::cerr << "options -i and -B can not be used together\n";
+
+        print_help( std::cerr );
+        return 0;
+    }
+
+    if( igp.opt_count('i') != 1 && (igp.opt_count('t') != 1 || igp.opt_count('s') != 1) ) {
         print_banner(std::cerr);
 
         std::cerr << "missing options -t and/or -s (-q is optional)\n";
@@ -286,6 +569,77 @@ int main( int argc, char *argv[] ) {
         return 0;
     }
     
+    if( igp.opt_count('U') == 1 && igp.opt_count('B') != 1 ) {
+        std::cerr << "option -U can only be used together with -B\n";
+        print_help( std::cerr );
+        return 0;
+    }
+
+    if( igp.opt_count('U') == 1 && !opt_use_cgap ) {
+        std::cerr << "option -U can only be used together with -c\n";
+        print_help( std::cerr );
+        return 0;
+    }
+
+    if( igp.opt_count('D') == 1 ) {
+        if( igp.opt_count('B') != 0 || igp.opt_count('S') != 0 || igp.opt_count('q') != 0 || igp.opt_count('l') != 0 || igp.opt_count('x') != 0 || igp.opt_count('k') != 0 ) {
+            std::cerr << "option -D can not be used together with -B/-S/-q/-l/-x/-k\n";
+            print_help( std::cerr );
+            return 0;
+        }
+    }
+
+    if( igp.opt_count('P') == 1 && opt_prefilter_keep <= 0 ) {
+        std::cerr << "number of candidate edges of option -P must be > 0\n";
+        return 0;
+    }
+
+    if( igp.opt_count('T') == 1 ) {
+        if( opt_clade_margin < 0 ) {
+            std::cerr << "score margin of option -T must be >= 0\n";
+            return 0;
+        }
+
+        if( igp.opt_count('P') != 0 ) {
+            std::cerr << "options -P and -T can not be used together\n";
+            print_help( std::cerr );
+            return 0;
+        }
+    }
+
+    if( igp.opt_count('M') == 1 ) {
+        if( opt_mem_limit <= 0 ) {
+            std::cerr << "memory limit of option -M must be > 0\n";
+            return 0;
+        }
+
+        if( igp.opt_count('B') != 0 || igp.opt_count('P') != 0 ) {
+            std::cerr << "option -M can not be used together with -B/-P\n";
+            print_help( std::cerr );
+            return 0;
+        }
+    }
+
+    const size_t mem_limit = size_t(std::max( 0, opt_mem_limit )) * 1024 * 1024;
+
+    search_options search_opts;
+    search_opts.prefilter_keep = size_t(std::max( 0, opt_prefilter_keep ));
+    search_opts.tree_search = igp.opt_count('T') == 1;
+    search_opts.clade_margin = opt_clade_margin;
+
+    if( igp.opt_count('S') == 1 ) {
+        if( opt_batch_size <= 0 ) {
+            std::cerr << "batch size of option -S must be > 0\n";
+            return 0;
+        }
+
+        if( igp.opt_count('l') != 0 || igp.opt_count('x') != 0 || igp.opt_count('k') != 0 ) {
+            std::cerr << "option -S can not be used together with -l/-x/-k\n";
+            print_help( std::cerr );
+            return 0;
+        }
+    }
+
     // optional accelration by blast hits/partition file
     std::auto_ptr<partassign::part_assignment> part_assignment;
     
@@ -348,6 +702,15 @@ int main( int argc, char *argv[] ) {
     }
     
     
+    // in daemon mode on stdin/stdout, stdout carries the answers: everything else that goes to std::cout (log, warnings)
+    // is redirected to stderr.
+    std::ostream daemon_out( std::cout.rdbuf() );
+    std::auto_ptr<stream_redirect> cout_to_cerr;
+
+    if( opt_daemon_socket == "-" ) {
+        cout_to_cerr.reset( new stream_redirect( std::cout, std::cerr ));
+    }
+
     papara::add_log_tee papara_log_cout( std::cout );
     
     std::ofstream logs( log_filename.c_str());
@@ -373,18 +736,60 @@ int main( int argc, char *argv[] ) {
     }
     
     
-    if( opt_use_cgap ) {
+    if( !opt_build_index.empty() ) {
+        if( opt_use_cgap ) {
+            if( opt_aa ) {
+                build_index<pvec_cgap, tag_aa>( opt_alignment_name, opt_tree_name, opt_num_threads, opt_build_index, opt_previous_index );
+            } else {
+                build_index<pvec_cgap, tag_dna>( opt_alignment_name, opt_tree_name, opt_num_threads, opt_build_index, opt_previous_index );
+            }
+        } else {
+            if( opt_aa ) {
+                build_index<pvec_pgap, tag_aa>( opt_alignment_name, opt_tree_name, opt_num_threads, opt_build_index, opt_previous_index );
+            } else {
+                build_index<pvec_pgap, tag_dna>( opt_alignment_name, opt_tree_name, opt_num_threads, opt_build_index, opt_previous_index );
+            }
+        }
+    } else if( !opt_daemon_socket.empty() ) {
+        if( opt_use_cgap ) {
+            if( opt_aa ) {
+                run_papara_daemon<pvec_cgap, tag_aa>( opt_alignment_name, opt_tree_name, opt_index, opt_num_threads, sp, opt_daemon_socket, daemon_out, search_opts, mem_limit );
+            } else {
+                run_papara_daemon<pvec_cgap, tag_dna>( opt_alignment_name, opt_tree_name, opt_index, opt_num_threads, sp, opt_daemon_socket, daemon_out, search_opts, mem_limit );
+            }
+        } else {
+            if( opt_aa ) {
+                run_papara_daemon<pvec_pgap, tag_aa>( opt_alignment_name, opt_tree_name, opt_index, opt_num_threads, sp, opt_daemon_socket, daemon_out, search_opts, mem_limit );
+            } else {
+                run_papara_daemon<pvec_pgap, tag_dna>( opt_alignment_name, opt_tree_name, opt_index, opt_num_threads, sp, opt_daemon_socket, daemon_out, search_opts, mem_limit );
+            }
+        }
+    } else if( opt_batch_size > 0 ) {
+        if( opt_use_cgap ) {
+            if( opt_aa ) {
+                run_papara_streaming<pvec_cgap, tag_aa>( opt_qs_name, opt_alignment_name, opt_tree_name, opt_index, opt_num_threads, opt_run_name, ref_gaps, sp, opt_write_fasta, opt_batch_size, search_opts, mem_limit );
+            } else {
+                run_papara_streaming<pvec_cgap, tag_dna>( opt_qs_name, opt_alignment_name, opt_tree_name, opt_index, opt_num_threads, opt_run_name, ref_gaps, sp, opt_write_fasta, opt_batch_size, search_opts, mem_limit );
+            }
+        } else {
+            if( opt_aa ) {
+                run_papara_streaming<pvec_pgap, tag_aa>( opt_qs_name, opt_alignment_name, opt_tree_name, opt_index, opt_num_threads, opt_run_name, ref_gaps, sp, opt_write_fasta, opt_batch_size, search_opts, mem_limit );
+            } else {
+                run_papara_streaming<pvec_pgap, tag_dna>( opt_qs_name, opt_alignment_name, opt_tree_name, opt_index, opt_num_threads, opt_run_name, ref_gaps, sp, opt_write_fasta, opt_batch_size, search_opts, mem_limit );
+            }
+        }
+    } else if( opt_use_cgap ) {
 
         if( opt_aa ) {
-            run_papara<pvec_cgap, tag_aa>( opt_qs_name, opt_alignment_name, opt_tree_name, opt_num_threads, opt_run_name, ref_gaps, sp, opt_write_fasta, part_assignment.get(), fixed_qs_bounds );
+            run_papara<pvec_cgap, tag_aa>( opt_qs_name, opt_alignment_name, opt_tree_name, opt_index, opt_num_threads, opt_run_name, ref_gaps, sp, opt_write_fasta, part_assignment.get(), fixed_qs_bounds, search_opts, mem_limit );
         } else {
-            run_papara<pvec_cgap, tag_dna>( opt_qs_name, opt_alignment_name, opt_tree_name, opt_num_threads, opt_run_name, ref_gaps, sp, opt_write_fasta, part_assignment.get(), fixed_qs_bounds );
+            run_papara<pvec_cgap, tag_dna>( opt_qs_name, opt_alignment_name, opt_tree_name, opt_index, opt_num_threads, opt_run_name, ref_gaps, sp, opt_write_fasta, part_assignment.get(), fixed_qs_bounds, search_opts, mem_limit );
         }
     } else {
         if( opt_aa ) {
-            run_papara<pvec_pgap, tag_aa>( opt_qs_name, opt_alignment_name, opt_tree_name, opt_num_threads, opt_run_name, ref_gaps, sp, opt_write_fasta, part_assignment.get(), fixed_qs_bounds );
+            run_papara<pvec_pgap, tag_aa>( opt_qs_name, opt_alignment_name, opt_tree_name, opt_index, opt_num_threads, opt_run_name, ref_gaps, sp, opt_write_fasta, part_assignment.get(), fixed_qs_bounds, search_opts, mem_limit );
         } else {
-            run_papara<pvec_pgap, tag_dna>( opt_qs_name, opt_alignment_name, opt_tree_name, opt_num_threads, opt_run_name, ref_gaps, sp, opt_write_fasta, part_assignment.get(), fixed_qs_bounds );
+            run_papara<pvec_pgap, tag_dna>( opt_qs_name, opt_alignment_name, opt_tree_name, opt_index, opt_num_threads, opt_run_name, ref_gaps, sp, opt_write_fasta, part_assignment.get(), fixed_qs_bounds, search_opts, mem_limit );
         }
     }
 
@@ -0,0 +1,196 @@
+/*
+ * Copyright (C) 2009-2012 Simon A. Berger
+ *
+ * This file is part of papara.
+ *
+ *  papara is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  papara is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with papara.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <sstream>
+#include <stdexcept>
+
+#ifndef WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "papara.h"
+#include "papara_api.h"
+
+using namespace papara;
+
+namespace {
+
+// anonymous file in memory, for the tree parser (which can only read from files). Where memfd_create is not available,
+// an (already unlinked) temporary file is used.
+class memory_file {
+public:
+    memory_file( const char *data, size_t size ) : fd_(-1), file_(0) {
+#ifndef WIN32
+#ifdef MFD_CLOEXEC
+        fd_ = memfd_create( "papara", MFD_CLOEXEC );
+#endif
+        if( fd_ == -1 ) {
+            file_ = std::tmpfile();
+
+            if( file_ == 0 ) {
+                throw std::runtime_error( "cannot create temporary file" );
+            }
+
+            fd_ = fileno( file_ );
+        }
+
+        size_t pos = 0;
+        while( pos < size ) {
+            const ssize_t n = write( fd_, data + pos, size - pos );
+
+            if( n < 0 ) {
+                if( errno == EINTR ) {
+                    continue;
+                }
+
+                close_fd();
+                throw std::runtime_error( "cannot write temporary file" );
+            }
+
+            pos += size_t(n);
+        }
+
+        lseek( fd_, 0, SEEK_SET );
+
+        std::ostringstream ss;
+        ss << "/dev/fd/" << fd_;
+        name_ = ss.str();
+#else
+        throw std::runtime_error( "reference trees in memory are not supported on this platform" );
+#endif
+    }
+
+    ~memory_file() {
+        close_fd();
+    }
+
+    const char *name() const {
+        return name_.c_str();
+    }
+
+private:
+    memory_file( const memory_file & );
+    memory_file &operator=( const memory_file & );
+
+    void close_fd() {
+#ifndef WIN32
+        if( file_ != 0 ) {
+            std::fclose( file_ );
+        } else if( fd_ != -1 ) {
+            close( fd_ );
+        }
+#endif
+        file_ = 0;
+        fd_ = -1;
+    }
+
+    int fd_;
+    std::FILE *file_;
+    std::string name_;
+};
+
+template<typename pvec_t, typename seq_tag>
+class reference_set_impl : public reference_set {
+public:
+    reference_set_impl( const char *tree_name, const char *alignment, size_t alignment_size, const papara_score_parameters &sp, size_t n_threads, const reference_set_options &opts )
+      : align_qs_( "" ),
+        refs_( tree_name, reinterpret_cast<const uint8_t *>(alignment), alignment_size, &align_qs_, n_threads ),
+        sp_(sp),
+        n_threads_(n_threads)
+    {
+        refs_.remove_full_gaps();
+        refs_.build_ref_vecs( n_threads_, opts.mem_limit );
+
+        if( opts.prefilter_keep > 0 ) {
+            prefilter_ = driver<pvec_t,seq_tag>::build_prefilter( refs_, opts.prefilter_keep, n_threads_ );
+            search_.prefilter = prefilter_.get();
+        }
+
+        if( opts.tree_search ) {
+            clades_ = driver<pvec_t,seq_tag>::build_clades( refs_ );
+            search_.clades = clades_.get();
+            search_.clade_margin = opts.clade_margin;
+        }
+    }
+
+    void align( const char *fasta, size_t fasta_size, row_sink *sink ) const {
+        queries<seq_tag> qs( reinterpret_cast<const uint8_t *>(fasta), fasta_size, n_threads_ );
+        qs.preprocess();
+        qs.collapse_duplicates();
+
+        driver<pvec_t,seq_tag>::align_rows( sink, qs, refs_, sp_, n_threads_, &search_ );
+    }
+
+    size_t num_references() const {
+        return refs_.num_seqs();
+    }
+
+    size_t num_columns() const {
+        return refs_.pvec_size();
+    }
+
+private:
+    // the sequences of the alignment that are not in the tree (not used)
+    queries<seq_tag> align_qs_;
+
+    references<pvec_t,seq_tag> refs_;
+
+    const papara_score_parameters sp_;
+    const size_t n_threads_;
+
+    std::auto_ptr<kmer_prefilter> prefilter_;
+    std::auto_ptr<clade_hierarchy> clades_;
+    edge_search search_;
+};
+
+}
+
+std::auto_ptr<reference_set> papara::reference_set::create( const char *tree, size_t tree_size, const char *alignment, size_t alignment_size, const reference_set_options &opts ) {
+    papara_score_parameters sp = papara_score_parameters::default_scores();
+    if( !opts.scores.empty() ) {
+        sp = papara_score_parameters::parse_scores( opts.scores.c_str() );
+    }
+
+    const size_t n_threads = std::max( size_t(1), opts.n_threads );
+
+    // the tree file is only needed by the constructor of the references
+    memory_file tree_file( tree, tree_size );
+
+    std::auto_ptr<reference_set> rs;
+
+    if( opts.cgap ) {
+        if( opts.aa ) {
+            rs.reset( new reference_set_impl<pvec_cgap,tag_aa>( tree_file.name(), alignment, alignment_size, sp, n_threads, opts ));
+        } else {
+            rs.reset( new reference_set_impl<pvec_cgap,tag_dna>( tree_file.name(), alignment, alignment_size, sp, n_threads, opts ));
+        }
+    } else {
+        if( opts.aa ) {
+            rs.reset( new reference_set_impl<pvec_pgap,tag_aa>( tree_file.name(), alignment, alignment_size, sp, n_threads, opts ));
+        } else {
+            rs.reset( new reference_set_impl<pvec_pgap,tag_dna>( tree_file.name(), alignment, alignment_size, sp, n_threads, opts ));
+        }
+    }
+
+    return rs;
+}
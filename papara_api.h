@@ -0,0 +1,91 @@
+/*
+ * Copyright (C) 2009-2012 Simon A. Berger
+ *
+ * This file is part of papara.
+ *
+ *  papara is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  papara is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with papara.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __papara_api_h
+#define __papara_api_h
+
+#include <cstddef>
+#include <memory>
+#include <string>
+
+// Interface for embedding papara_core in other programs (see papara_c.h for the C version): a reference set (reference
+// tree and alignment, including the ancestral state vectors) is created from inputs in memory, and can then align any
+// number of query batches. Reference sets do not share any state, and align does not modify the reference set. So
+// several reference sets, and several align calls on the same reference set, can be used concurrently.
+//
+// The log output goes to papara::lout, which is thread-safe (use add_log_sink to receive it).
+
+namespace papara {
+
+// receives the aligned queries (see driver::align_rows)
+class row_sink {
+public:
+    virtual ~row_sink() {}
+
+    // row: the aligned query (without reference-side gaps), score: the score of the best placement
+    virtual void push_back( const std::string &name, const std::string &row, int score ) = 0;
+};
+
+struct reference_set_options {
+    reference_set_options() : aa(false), cgap(false), n_threads(1), prefilter_keep(0), tree_search(false), clade_margin(0), mem_limit(0) {}
+
+    // protein data (papara -a)
+    bool aa;
+
+    // parsimony gap model of papara 1.0 (papara -c)
+    bool cgap;
+
+    // threads used to build the ancestral state vectors, and by each align call
+    size_t n_threads;
+
+    // scoring parameters '<open>:<extend>:<match>:<match cg>' (papara -p). Empty: default parameters.
+    std::string scores;
+
+    // if > 0, each query is only scored against its prefilter_keep best candidate edges (papara -P, see prefilter.h)
+    size_t prefilter_keep;
+
+    // tree-guided search with the given score margin (papara -T, see tree_search.h). Not together with prefilter_keep.
+    bool tree_search;
+    int clade_margin;
+
+    // if not 0, memory limit in bytes for the ancestral state vectors (papara -M, see ref_vec_cache.h). Not together
+    // with prefilter_keep.
+    size_t mem_limit;
+};
+
+class reference_set {
+public:
+    virtual ~reference_set() {}
+
+    // aligns the fasta records in [fasta,fasta+fasta_size). The rows are passed to sink in the order of the records.
+    virtual void align( const char *fasta, size_t fasta_size, row_sink *sink ) const = 0;
+
+    virtual size_t num_references() const = 0;
+
+    // length of the rows (i.e., the number of columns of the reference alignment that are not all-gap)
+    virtual size_t num_columns() const = 0;
+
+    // tree: newick, alignment: phylip. The sequences of the alignment that are not in the tree are ignored. Throws
+    // std::runtime_error on bad input.
+    static std::auto_ptr<reference_set> create( const char *tree, size_t tree_size, const char *alignment, size_t alignment_size, const reference_set_options &opts );
+};
+
+}
+
+#endif
@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2009-2012 Simon A. Berger
+ *
+ * This file is part of papara.
+ *
+ *  papara is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  papara is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with papara.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstring>
+#include <stdexcept>
+
+#include "papara_api.h"
+#include "papara_c.h"
+
+struct papara_refs {
+    std::auto_ptr<papara::reference_set> rs;
+};
+
+namespace {
+
+void set_error( char *err, size_t err_size, const char *msg ) {
+    if( err == 0 || err_size == 0 ) {
+        return;
+    }
+
+    std::strncpy( err, msg, err_size - 1 );
+    err[err_size - 1] = 0;
+}
+
+class callback_row_sink : public papara::row_sink {
+public:
+    callback_row_sink( papara_row_fn fn, void *user ) : fn_(fn), user_(user) {}
+
+    void push_back( const std::string &name, const std::string &row, int score ) {
+        fn_( user_, name.c_str(), row.data(), row.size(), score );
+    }
+
+private:
+    papara_row_fn fn_;
+    void *user_;
+};
+
+}
+
+papara_refs *papara_refs_create( const char *tree, size_t tree_size, const char *alignment, size_t alignment_size, int flags, const char *scores, size_t n_threads, char *err, size_t err_size ) {
+    try {
+        papara::reference_set_options opts;
+        opts.aa = (flags & PAPARA_AA) != 0;
+        opts.cgap = (flags & PAPARA_CGAP) != 0;
+        opts.n_threads = n_threads;
+
+        if( scores != 0 ) {
+            opts.scores = scores;
+        }
+
+        std::auto_ptr<papara_refs> refs( new papara_refs );
+        refs->rs = papara::reference_set::create( tree, tree_size, alignment, alignment_size, opts );
+
+        return refs.release();
+    } catch( std::exception &x ) {
+        set_error( err, err_size, x.what() );
+    } catch( ... ) {
+        set_error( err, err_size, "unknown error" );
+    }
+
+    return 0;
+}
+
+int papara_align( const papara_refs *refs, const char *fasta, size_t fasta_size, papara_row_fn fn, void *user, char *err, size_t err_size ) {
+    try {
+        callback_row_sink sink( fn, user );
+        refs->rs->align( fasta, fasta_size, &sink );
+
+        return 0;
+    } catch( std::exception &x ) {
+        set_error( err, err_size, x.what() );
+    } catch( ... ) {
+        set_error( err, err_size, "unknown error" );
+    }
+
+    return -1;
+}
+
+void papara_refs_free( papara_refs *refs ) {
+    delete refs;
+}
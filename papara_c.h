@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2009-2012 Simon A. Berger
+ *
+ * This file is part of papara.
+ *
+ *  papara is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  papara is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with papara.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __papara_c_h
+#define __papara_c_h
+
+#include <stddef.h>
+
+/* C interface of papara_api.h. All functions are thread-safe, also on the same reference set. Errors are reported
+   through the return value, the message is copied to err (truncated to err_size bytes, err may be NULL). */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct papara_refs papara_refs;
+
+/* flags of papara_refs_create */
+#define PAPARA_AA   1   /* protein data (papara -a) */
+#define PAPARA_CGAP 2   /* parsimony gap model of papara 1.0 (papara -c) */
+
+/* called once per aligned query. row (row_size characters, not 0-terminated) is the aligned query without
+   reference-side gaps, score the score of the best placement. */
+typedef void (*papara_row_fn)( void *user, const char *name, const char *row, size_t row_size, int score );
+
+/* creates a reference set from a newick tree and a phylip alignment. scores: '<open>:<extend>:<match>:<match cg>', or
+   NULL for the default scoring parameters. Returns NULL on error. */
+papara_refs *papara_refs_create( const char *tree, size_t tree_size, const char *alignment, size_t alignment_size, int flags, const char *scores, size_t n_threads, char *err, size_t err_size );
+
+/* aligns the fasta records in fasta (in the order of the records). Returns 0 on success. */
+int papara_align( const papara_refs *refs, const char *fasta, size_t fasta_size, papara_row_fn fn, void *user, char *err, size_t err_size );
+
+void papara_refs_free( papara_refs *refs );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,293 @@
+/*
+ * Copyright (C) 2009-2012 Simon A. Berger
+ *
+ * This file is part of papara.
+ *
+ *  papara is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  papara is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with papara.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cassert>
+#include <limits>
+#include <stdexcept>
+
+#include "ivymike/thread.h"
+
+#include "parsimony.h"
+#include "prefilter.h"
+#include "scoring_kernel.h"
+
+namespace {
+
+// extracts the distinct k-mers of the ungapped consensus of each edge
+class edge_kmer_worker {
+public:
+    edge_kmer_worker( const std::vector<const papara::packed_ref_vec *> &edges, const papara::kmer_prefilter &pf, std::vector<std::vector<uint32_t> > *kmers, size_t rank, size_t n_threads )
+      : edges_(edges), pf_(pf), kmers_(*kmers), rank_(rank), n_threads_(n_threads)
+    {}
+
+    void operator()() {
+        std::vector<int> states;
+        std::vector<unsigned int> aux;
+        std::vector<unsigned int> ungapped;
+
+        for( size_t i = rank_; i < edges_.size(); i += n_threads_ ) {
+            edges_[i]->unpack( &states, &aux );
+
+            ungapped.clear();
+            for( size_t j = 0; j < states.size(); ++j ) {
+                if( (aux[j] & AUX_CGAP) == 0 ) {
+                    ungapped.push_back( unsigned(states[j]) );
+                }
+            }
+
+            if( !ungapped.empty() ) {
+                pf_.kmers_of( &ungapped.front(), &ungapped.front() + ungapped.size(), &kmers_[i] );
+            }
+        }
+    }
+
+private:
+    const std::vector<const papara::packed_ref_vec *> &edges_;
+    const papara::kmer_prefilter &pf_;
+    std::vector<std::vector<uint32_t> > &kmers_;
+    const size_t rank_;
+    const size_t n_threads_;
+};
+
+// orders the edges by number of shared k-mers (descending), then by index
+class more_shared {
+public:
+    more_shared( const std::vector<uint32_t> &shared ) : shared_(shared) {}
+
+    bool operator()( uint32_t a, uint32_t b ) const {
+        return shared_[a] > shared_[b] || (shared_[a] == shared_[b] && a < b);
+    }
+
+private:
+    const std::vector<uint32_t> &shared_;
+};
+
+class query_select_worker {
+public:
+    query_select_worker( const papara::kmer_prefilter &pf, const std::vector<std::pair<const uint8_t *, const uint8_t *> > &qs, const std::vector<int> &state_map, size_t keep, papara::edge_candidates *cands, size_t rank, size_t n_threads )
+      : pf_(pf), qs_(qs), state_map_(state_map), keep_(keep), cands_(*cands), rank_(rank), n_threads_(n_threads)
+    {}
+
+    void operator()() {
+        std::vector<unsigned int> states;
+        std::vector<uint32_t> kmers;
+
+        // number of shared k-mers per edge, and the edges with a non-zero count
+        std::vector<uint32_t> shared( pf_.num_edges(), 0 );
+        std::vector<uint32_t> touched;
+
+        for( size_t i = rank_; i < qs_.size(); i += n_threads_ ) {
+            states.clear();
+            for( const uint8_t *it = qs_[i].first; it != qs_[i].second; ++it ) {
+                states.push_back( *it < state_map_.size() ? unsigned(state_map_[*it]) : 0 );
+            }
+
+            kmers.clear();
+            if( !states.empty() ) {
+                pf_.kmers_of( &states.front(), &states.front() + states.size(), &kmers );
+            }
+
+            touched.clear();
+            for( std::vector<uint32_t>::const_iterator it = kmers.begin(); it != kmers.end(); ++it ) {
+                for( const uint32_t *e = pf_.postings_begin( *it ), *end = pf_.postings_end( *it ); e != end; ++e ) {
+                    if( shared[*e]++ == 0 ) {
+                        touched.push_back( *e );
+                    }
+                }
+            }
+
+            if( touched.empty() ) {
+                // no hint at all: score the query against all edges
+                cands_.set_all( i );
+                continue;
+            }
+
+            if( touched.size() > keep_ ) {
+                std::nth_element( touched.begin(), touched.begin() + keep_, touched.end(), more_shared( shared ));
+            }
+
+            for( std::vector<uint32_t>::const_iterator it = touched.begin(); it != touched.end(); ++it ) {
+                shared[*it] = 0;
+            }
+
+            touched.resize( std::min( touched.size(), keep_ ));
+            std::sort( touched.begin(), touched.end() );
+
+            cands_.set( i, &touched.front(), &touched.front() + touched.size() );
+        }
+    }
+
+private:
+    const papara::kmer_prefilter &pf_;
+    const std::vector<std::pair<const uint8_t *, const uint8_t *> > &qs_;
+    const std::vector<int> &state_map_;
+    const size_t keep_;
+    papara::edge_candidates &cands_;
+    const size_t rank_;
+    const size_t n_threads_;
+};
+
+}
+
+void papara::edge_candidates::set( size_t i, const uint32_t *first, const uint32_t *last ) {
+    all_.at(i) = 0;
+    edges_.at(i).assign( first, last );
+    scores_.at(i).assign( edges_[i].size(), std::numeric_limits<int>::min() );
+}
+
+bool papara::edge_candidates::contains( size_t i, size_t edge ) const {
+    if( all_[i] != 0 ) {
+        return true;
+    }
+
+    const std::vector<uint32_t> &edges = edges_[i];
+    return std::binary_search( edges.begin(), edges.end(), uint32_t(edge) );
+}
+
+void papara::edge_candidates::record( size_t i, size_t edge, int score ) {
+    const std::vector<uint32_t> &edges = edges_[i];
+    std::vector<uint32_t>::const_iterator it = std::lower_bound( edges.begin(), edges.end(), uint32_t(edge) );
+
+    if( it != edges.end() && *it == edge ) {
+        scores_[i][it - edges.begin()] = score;
+    }
+}
+
+int papara::edge_candidates::score_of( size_t i, size_t edge ) const {
+    const std::vector<uint32_t> &edges = edges_[i];
+    std::vector<uint32_t>::const_iterator it = std::lower_bound( edges.begin(), edges.end(), uint32_t(edge) );
+
+    if( it != edges.end() && *it == edge ) {
+        return scores_[i][it - edges.begin()];
+    }
+
+    return std::numeric_limits<int>::min();
+}
+
+papara::kmer_prefilter::kmer_prefilter( const std::vector<const packed_ref_vec *> &edges, bool aa, size_t keep, size_t n_threads )
+  : num_edges_(edges.size()),
+    keep_(keep),
+    k_( aa ? 4 : 8 ),
+    symbol_bits_( aa ? 5 : 2 )
+{
+    if( keep_ == 0 ) {
+        throw std::runtime_error( "the number of candidate edges per query must be > 0" );
+    }
+
+    n_threads = std::max( size_t(1), n_threads );
+
+    std::vector<std::vector<uint32_t> > kmers( edges.size() );
+
+    {
+        ivy_mike::thread_group tg;
+
+        for( size_t i = 1; i < n_threads; ++i ) {
+            tg.create_thread( edge_kmer_worker( edges, *this, &kmers, i, n_threads ));
+        }
+
+        edge_kmer_worker( edges, *this, &kmers, 0, n_threads )();
+
+        tg.join_all();
+    }
+
+    // postings lists by counting sort. They are sorted by edge, as the edges are processed in order.
+    offsets_.assign( (size_t(1) << (k_ * symbol_bits_)) + 1, 0 );
+
+    for( size_t i = 0; i < kmers.size(); ++i ) {
+        for( std::vector<uint32_t>::const_iterator it = kmers[i].begin(); it != kmers[i].end(); ++it ) {
+            ++offsets_[*it + 1];
+        }
+    }
+
+    for( size_t x = 1; x < offsets_.size(); ++x ) {
+        offsets_[x] += offsets_[x - 1];
+    }
+
+    postings_.resize( offsets_.back() );
+    std::vector<size_t> pos( offsets_.begin(), offsets_.end() - 1 );
+
+    for( size_t i = 0; i < kmers.size(); ++i ) {
+        for( std::vector<uint32_t>::const_iterator it = kmers[i].begin(); it != kmers[i].end(); ++it ) {
+            postings_[pos[*it]++] = uint32_t(i);
+        }
+
+        std::vector<uint32_t>().swap( kmers[i] );
+    }
+}
+
+void papara::kmer_prefilter::kmers_of( const unsigned int *first, const unsigned int *last, std::vector<uint32_t> *kmers ) const {
+    // ambiguous states are expanded, as long as the number of variants of the current window stays small
+    const size_t max_variants = 16;
+    const uint32_t mask = (uint32_t(1) << (k_ * symbol_bits_)) - 1;
+    const uint32_t num_symbols = uint32_t(1) << symbol_bits_;
+
+    kmers->clear();
+
+    // the variants of the current window, all of them cover the last 'run' states
+    std::vector<uint32_t> codes( 1, 0 );
+    std::vector<uint32_t> next;
+    size_t run = 0;
+
+    for( ; first != last; ++first ) {
+        next.clear();
+
+        for( std::vector<uint32_t>::const_iterator it = codes.begin(); it != codes.end() && next.size() <= max_variants; ++it ) {
+            for( uint32_t sym = 0; sym < num_symbols; ++sym ) {
+                if( (*first & (1u << sym)) != 0 ) {
+                    next.push_back( ((*it << symbol_bits_) | sym) & mask );
+                }
+            }
+        }
+
+        // gaps, states that do not fit (e.g., unusual protein states) and too many variants end the current k-mer
+        if( next.empty() || next.size() > max_variants || (num_symbols < 32 && (*first >> num_symbols) != 0) ) {
+            codes.assign( 1, 0 );
+            run = 0;
+            continue;
+        }
+
+        // variants that differ only in states that have left the window collapse into one
+        std::sort( next.begin(), next.end() );
+        next.erase( std::unique( next.begin(), next.end() ), next.end() );
+        codes.swap( next );
+
+        if( ++run >= k_ ) {
+            kmers->insert( kmers->end(), codes.begin(), codes.end() );
+        }
+    }
+
+    std::sort( kmers->begin(), kmers->end() );
+    kmers->erase( std::unique( kmers->begin(), kmers->end() ), kmers->end() );
+}
+
+void papara::kmer_prefilter::select( const std::vector<std::pair<const uint8_t *, const uint8_t *> > &qs, const std::vector<int> &state_map, size_t n_threads, edge_candidates *cands ) const {
+    assert( cands->size() == qs.size() );
+
+    n_threads = std::max( size_t(1), n_threads );
+    ivy_mike::thread_group tg;
+
+    for( size_t i = 1; i < n_threads; ++i ) {
+        tg.create_thread( query_select_worker( *this, qs, state_map, keep_, cands, i, n_threads ));
+    }
+
+    query_select_worker( *this, qs, state_map, keep_, cands, 0, n_threads )();
+
+    tg.join_all();
+}
@@ -0,0 +1,146 @@
+/*
+ * Copyright (C) 2009-2012 Simon A. Berger
+ *
+ * This file is part of papara.
+ *
+ *  papara is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  papara is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with papara.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __prefilter_h
+#define __prefilter_h
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+#include <stdint.h>
+
+// Optional heuristic stage before the scoring (papara -P <keep>): the ungapped consensus of the ancestral state vector
+// of each edge is indexed by its k-mers. For each query, the edges that share the most distinct k-mers with it are
+// selected, and only the ref-blocks that contain at least one of them are scored (see driver::score_queries). Gap
+// columns of the consensus are skipped, ambiguous states are expanded into all variants of the k-mer (as long as there
+// are only a few of them in one window).
+
+namespace papara {
+
+class packed_ref_vec;
+
+// the edges that shall be scored for each query
+class edge_candidates {
+public:
+    explicit edge_candidates( size_t num_qs ) : all_(num_qs, 1), edges_(num_qs), scores_(num_qs) {}
+
+    size_t size() const {
+        return all_.size();
+    }
+
+    // all edges for query i
+    void set_all( size_t i ) {
+        all_.at(i) = 1;
+        edges_.at(i).clear();
+        scores_.at(i).clear();
+    }
+
+    // only the edges in [first,last) for query i (an empty range means 'none')
+    void set( size_t i, const uint32_t *first, const uint32_t *last );
+
+    bool is_all( size_t i ) const {
+        return all_[i] != 0;
+    }
+
+    bool contains( size_t i, size_t edge ) const ;
+
+    // stores the score of query i against edge, if it is one of its candidates (used by the scoring workers). Each
+    // (query, edge) pair is scored by only one worker, so this does not need to be synchronized.
+    void record( size_t i, size_t edge, int score ) ;
+
+    // the recorded score of query i against edge (INT_MIN if it was not scored or is not a candidate)
+    int score_of( size_t i, size_t edge ) const ;
+
+    // true if at least one of the edges [first,last) shall be scored for query i
+    bool any( size_t i, const size_t *first, const size_t *last ) const {
+        if( all_[i] != 0 ) {
+            return true;
+        }
+
+        for( ; first != last; ++first ) {
+            if( contains( i, *first )) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+private:
+    // (not vector<bool>, as different queries are set by different threads)
+    std::vector<uint8_t> all_;
+
+    // sorted edge lists, and the scores of the edges
+    std::vector<std::vector<uint32_t> > edges_;
+    std::vector<std::vector<int> > scores_;
+};
+
+class kmer_prefilter {
+public:
+    // edges: the ancestral state vectors of all edges. aa: protein data (4-mers instead of 8-mers of nucleotides).
+    // keep: number of candidate edges per query.
+    kmer_prefilter( const std::vector<const packed_ref_vec *> &edges, bool aa, size_t keep, size_t n_threads = 1 );
+
+    // selects the (at most) keep edges with the most shared k-mers for each query. The queries are given as ranges of
+    // character states, which are mapped to parsimony states by state_map (i.e., model<seq_tag>::c2p). Queries that
+    // do not share any k-mer with the references are scored against all edges.
+    void select( const std::vector<std::pair<const uint8_t *, const uint8_t *> > &qs, const std::vector<int> &state_map, size_t n_threads, edge_candidates *cands ) const ;
+
+    size_t num_edges() const {
+        return num_edges_;
+    }
+
+    size_t k() const {
+        return k_;
+    }
+
+    size_t keep() const {
+        return keep_;
+    }
+
+    size_t bytes() const {
+        return offsets_.size() * sizeof(size_t) + postings_.size() * sizeof(uint32_t);
+    }
+
+    // the distinct k-mers of a sequence of parsimony states
+    void kmers_of( const unsigned int *first, const unsigned int *last, std::vector<uint32_t> *kmers ) const ;
+
+    // the edges that contain k-mer x
+    const uint32_t *postings_begin( uint32_t x ) const {
+        return postings_.empty() ? 0 : &postings_.front() + offsets_[x];
+    }
+
+    const uint32_t *postings_end( uint32_t x ) const {
+        return postings_.empty() ? 0 : &postings_.front() + offsets_[x + 1];
+    }
+
+private:
+    size_t num_edges_;
+    size_t keep_;
+    size_t k_;
+    size_t symbol_bits_;
+
+    // postings_[offsets_[x],offsets_[x+1]) are the edges that contain k-mer x
+    std::vector<size_t> offsets_;
+    std::vector<uint32_t> postings_;
+};
+
+}
+
+#endif
@@ -50,6 +50,8 @@ using ivy_mike::TIP_INNER;
 using ivy_mike::INNER_INNER;
 }
 
+class probgap_model;
+
 class pvec_cgap {
     //     aligned_buffer<parsimony_state> v;
     std::vector<parsimony_state> v;
@@ -92,6 +94,15 @@ public:
         std::cerr << ">>>>>>>>>>>>>>>> WARNING: untested strange code!!!\n";
     }
 
+    // the 'hard' gap model has no parameters (see pvec_pgap::set_gap_model)
+    void set_gap_model( const probgap_model * ) {}
+
+    // sets the vector to previously calculated states and aux flags (see to_int_vec/to_aux_vec)
+    void assign( const std::vector<int> &states, const std::vector<unsigned int> &aux ) {
+        v.assign( states.begin(), states.end() );
+        auxv.assign( aux.begin(), aux.end() );
+    }
+
     inline const std::vector<parsimony_state> &get_v() {
         return v;
     }
@@ -309,7 +320,7 @@ public:
 		m_valid = true;
     }
 
-    boost::numeric::ublas::matrix<double> setup_pmatrix( double t ) {
+    boost::numeric::ublas::matrix<double> setup_pmatrix( double t ) const {
     	namespace ublas = boost::numeric::ublas;
 
     	ublas::diagonal_matrix<double> evals_diag(2);
@@ -334,7 +345,7 @@ public:
     }
 
 
-    inline double gap_freq() { return m_gap_freq; }
+    inline double gap_freq() const { return m_gap_freq; }
 
 };
 
@@ -343,12 +354,31 @@ class pvec_pgap {
     std::vector<parsimony_state> v;
     boost::numeric::ublas::matrix<double> gap_prob;
 
-    
+    // the probgap_model of the tree this vector belongs to. If not set, the global pgap_model is used.
+    const probgap_model *gap_model_;
+
+    const probgap_model &gap_model() const {
+        if( gap_model_ != 0 ) {
+            return *gap_model_;
+        }
+
+        assert( pgap_model.is_valid_ptr() );
+        return *pgap_model;
+    }
     
 public:
     // WARNING WARNING WARNING: this is the stupid_pointer, used to inject a global probgap_model into class pvec_pgap
+    // (only used by vectors without their own model, see set_gap_model)
     static ivy_mike::stupid_ptr<probgap_model> pgap_model;
 
+    pvec_pgap() : gap_model_(0) {}
+
+    // binds the vector to a probgap_model, which is inherited by the vectors calculated from it in newview. This allows
+    // several trees with different models to be used concurrently.
+    void set_gap_model( const probgap_model *pm ) {
+        gap_model_ = pm;
+    }
+
     inline const std::vector<parsimony_state> &get_v() const {
         return v;
     }
@@ -432,10 +462,13 @@ public:
         p.v.resize(c1.v.size());
         //p.gap_prob.resize(2, c1.v.size());
 
-        assert( pgap_model.is_valid_ptr() );
+        assert( c1.gap_model_ == c2.gap_model_ );
+        p.gap_model_ = c1.gap_model_;
+
+        const probgap_model &pm = c1.gap_model();
 
-        ublas::matrix<double> p1 = pgap_model->setup_pmatrix(z1);
-        ublas::matrix<double> p2 = pgap_model->setup_pmatrix(z2);
+        ublas::matrix<double> p1 = pm.setup_pmatrix(z1);
+        ublas::matrix<double> p2 = pm.setup_pmatrix(z2);
 
 
 
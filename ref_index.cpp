@@ -0,0 +1,263 @@
+/*
+ * Copyright (C) 2009-2012 Simon A. Berger
+ *
+ * This file is part of papara.
+ *
+ *  papara is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  papara is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with papara.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cassert>
+#include <cerrno>
+#include <cstdio>
+#include <sstream>
+#include <stdexcept>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "ref_index.h"
+
+namespace {
+
+// "PAPARAIX" followed by a byte order mark
+const char index_magic[8] = { 'P', 'A', 'P', 'A', 'R', 'A', 'I', 'X' };
+const uint32_t index_bom = 0x01020304;
+
+const size_t index_padding = 8;
+
+// the temporary file is in the same directory as the index, so that it can be renamed atomically
+std::string index_temp_name( const std::string &name ) {
+    std::ostringstream ss;
+    ss << name << ".tmp";
+#ifndef WIN32
+    ss << "." << getpid();
+#endif
+    return ss.str();
+}
+
+}
+
+papara::mapped_file::mapped_file( const char *name ) : data_(0), size_(0), mapped_(false) {
+#ifndef WIN32
+    const int fd = open( name, O_RDONLY );
+    if( fd == -1 ) {
+        throw std::runtime_error( std::string( "cannot open file: " ) + name );
+    }
+
+    struct stat st;
+    if( fstat( fd, &st ) != 0 ) {
+        close( fd );
+        throw std::runtime_error( std::string( "cannot stat file: " ) + name );
+    }
+
+    size_ = size_t(st.st_size);
+
+    if( size_ > 0 ) {
+        void *p = mmap( 0, size_, PROT_READ, MAP_PRIVATE, fd, 0 );
+
+        if( p != MAP_FAILED ) {
+            data_ = static_cast<const uint8_t *>(p);
+            mapped_ = true;
+        }
+    }
+
+    close( fd );
+
+    if( mapped_ || size_ == 0 ) {
+        return;
+    }
+#endif
+
+    // fallback: read the whole file
+    std::ifstream is( name, std::ios::binary );
+    if( !is.good() ) {
+        throw std::runtime_error( std::string( "cannot open file: " ) + name );
+    }
+
+    is.seekg( 0, std::ios::end );
+    buf_.resize( size_t(is.tellg()) );
+    is.seekg( 0, std::ios::beg );
+
+    if( !buf_.empty() ) {
+        is.read( reinterpret_cast<char *>(&buf_.front()), buf_.size() );
+    }
+
+    if( !is.good() ) {
+        throw std::runtime_error( std::string( "error while reading file: " ) + name );
+    }
+
+    data_ = buf_.empty() ? 0 : &buf_.front();
+    size_ = buf_.size();
+}
+
+papara::mapped_file::~mapped_file() {
+#ifndef WIN32
+    if( mapped_ ) {
+        munmap( const_cast<uint8_t *>(data_), size_ );
+    }
+#endif
+}
+
+
+papara::content_hash::content_hash() : h_( (uint64_t(0xcbf29ce4) << 32) | 0x84222325 ) {}
+
+void papara::content_hash::update( const void *data, size_t size ) {
+    const uint64_t prime = (uint64_t(0x100) << 32) | 0x1b3;
+    const uint8_t *p = static_cast<const uint8_t *>(data);
+
+    for( size_t i = 0; i < size; ++i ) {
+        h_ ^= p[i];
+        h_ *= prime;
+    }
+}
+
+void papara::content_hash::update_file( const char *name ) {
+    std::ifstream is( name, std::ios::binary );
+    if( !is.good() ) {
+        throw std::runtime_error( std::string( "cannot open file: " ) + name );
+    }
+
+    std::vector<char> buf( 1024 * 1024 );
+
+    while( is.good() ) {
+        is.read( &buf.front(), buf.size() );
+        update( &buf.front(), size_t(is.gcount()) );
+    }
+}
+
+
+papara::index_writer::index_writer( const char *name ) : name_(name), tmp_name_(index_temp_name(name_)), os_( tmp_name_.c_str(), std::ios::binary ), pos_(0), closed_(false) {
+    if( !os_.good() ) {
+        throw std::runtime_error( std::string( "cannot open index file for writing: " ) + tmp_name_ );
+    }
+}
+
+papara::index_writer::~index_writer() {
+    if( !closed_ ) {
+        os_.close();
+        std::remove( tmp_name_.c_str() );
+    }
+}
+
+void papara::index_writer::write( const void *data, size_t size ) {
+    os_.write( static_cast<const char *>(data), size );
+    pos_ += size;
+}
+
+void papara::index_writer::put_bytes( const void *data, size_t size ) {
+    write( data, size );
+
+    const char zeros[index_padding] = { 0 };
+    write( zeros, (index_padding - pos_ % index_padding) % index_padding );
+}
+
+void papara::index_writer::put_string( const std::string &s ) {
+    put<uint64_t>( s.size() );
+    put_bytes( s.data(), s.size() );
+}
+
+void papara::index_writer::put_vector( const std::vector<uint8_t> &v ) {
+    put<uint64_t>( v.size() );
+    put_bytes( v.empty() ? 0 : &v.front(), v.size() );
+}
+
+void papara::index_writer::close() {
+    closed_ = true;
+    os_.close();
+
+    if( os_.fail() ) {
+        std::remove( tmp_name_.c_str() );
+        throw std::runtime_error( std::string( "error while writing index file: " ) + tmp_name_ );
+    }
+
+#ifdef WIN32
+    // rename does not replace existing files on windows
+    std::remove( name_.c_str() );
+#endif
+
+    if( std::rename( tmp_name_.c_str(), name_.c_str() ) != 0 ) {
+        const int err = errno;
+        std::remove( tmp_name_.c_str() );
+        throw std::runtime_error( std::string( "cannot replace index file " ) + name_ + ": " + std::strerror( err ));
+    }
+}
+
+
+const uint8_t *papara::index_reader::take( size_t size ) {
+    if( size > size_ - pos_ ) {
+        throw std::runtime_error( "reference index is truncated" );
+    }
+
+    const uint8_t *p = data_ + pos_;
+    pos_ += size;
+    return p;
+}
+
+const uint8_t *papara::index_reader::get_bytes( size_t size ) {
+    const uint8_t *p = take( size );
+    take( (index_padding - pos_ % index_padding) % index_padding );
+
+    return p;
+}
+
+std::string papara::index_reader::get_string() {
+    const size_t size = size_t(get<uint64_t>());
+    const uint8_t *p = get_bytes( size );
+
+    return std::string( reinterpret_cast<const char *>(p), size );
+}
+
+void papara::index_reader::get_vector( std::vector<uint8_t> *v ) {
+    const size_t size = size_t(get<uint64_t>());
+    const uint8_t *p = get_bytes( size );
+
+    v->assign( p, p + size );
+}
+
+
+void papara::ref_index_header::write( index_writer *w ) const {
+    w->put_bytes( index_magic, sizeof(index_magic) );
+    w->put( index_bom );
+    w->put( version );
+    w->put( flags );
+    w->put( uint32_t(0) ); // padding
+    w->put( key );
+}
+
+papara::ref_index_header papara::ref_index_header::read( index_reader *r ) {
+    if( std::memcmp( r->get_bytes( sizeof(index_magic) ), index_magic, sizeof(index_magic) ) != 0 ) {
+        throw std::runtime_error( "not a papara reference index" );
+    }
+
+    if( r->get<uint32_t>() != index_bom ) {
+        throw std::runtime_error( "reference index was created on a machine with different byte order" );
+    }
+
+    ref_index_header h;
+    h.version = r->get<uint32_t>();
+
+    if( h.version != current_version ) {
+        throw std::runtime_error( "unsupported version of the reference index (rebuild it with papara -B)" );
+    }
+
+    h.flags = r->get<uint32_t>();
+    r->get<uint32_t>();
+    h.key = r->get<uint64_t>();
+
+    return h;
+}
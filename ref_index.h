@@ -0,0 +1,164 @@
+/*
+ * Copyright (C) 2009-2012 Simon A. Berger
+ *
+ * This file is part of papara.
+ *
+ *  papara is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  papara is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with papara.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __ref_index_h
+#define __ref_index_h
+
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+// Persistent reference index (papara -B, used with -i): contains everything the placement needs from the reference
+// tree and alignment (i.e., the reference sequences, the sequences of the alignment that are not in the tree, the
+// packed ancestral state vectors of all edges and the topology of the tree), so that later runs against the same
+// references skip parsing and references::build_ref_vecs. The file is memory mapped and the ancestral state vectors
+// are used directly from it. Indices built with -c also contain the directional vectors of the tree, which are used to
+// update the index incrementally (see ref_update.h).
+//
+// Layout: header (see ref_index_header), followed by the data written by references::write_index. All values are in
+// native byte order, all byte arrays are padded to 8 bytes, so an index is only valid on the machine type that
+// created it (this is checked via the magic number).
+
+namespace papara {
+
+// read-only view of a whole file. It is memory mapped where possible (otherwise it is read into memory).
+class mapped_file {
+public:
+    explicit mapped_file( const char *name );
+    ~mapped_file();
+
+    const uint8_t *data() const {
+        return data_;
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+private:
+    mapped_file( const mapped_file & );
+    mapped_file &operator=( const mapped_file & );
+
+    const uint8_t *data_;
+    size_t size_;
+    bool mapped_;
+    std::vector<uint8_t> buf_;
+};
+
+// 64bit FNV-1a hash, used to identify the input files an index was built from
+class content_hash {
+public:
+    content_hash();
+
+    void update( const void *data, size_t size );
+    void update_file( const char *name );
+
+    uint64_t value() const {
+        return h_;
+    }
+
+private:
+    uint64_t h_;
+};
+
+// writes an index file. The data goes to a temporary file next to it, which replaces the file only in close() (via
+// rename, which is atomic). So readers that have the old file mapped (e.g., papara -D -i, or -U with the same file as
+// -B) keep the old version, and an index is never seen half-written. If close is not called (e.g., on an exception), the
+// temporary file is removed again and the old file stays as it is.
+class index_writer {
+public:
+    explicit index_writer( const char *name );
+    ~index_writer();
+
+    template<typename T>
+    void put( const T &v ) {
+        write( &v, sizeof(T) );
+    }
+
+    // writes a byte array (without its size) and pads it to 8 bytes
+    void put_bytes( const void *data, size_t size );
+
+    void put_string( const std::string &s );
+    void put_vector( const std::vector<uint8_t> &v );
+
+    // throws if anything went wrong while writing or replacing the file
+    void close();
+
+private:
+    void write( const void *data, size_t size );
+
+    const std::string name_;
+    const std::string tmp_name_;
+    std::ofstream os_;
+    uint64_t pos_;
+    bool closed_;
+};
+
+class index_reader {
+public:
+    index_reader( const uint8_t *data, size_t size ) : data_(data), size_(size), pos_(0) {}
+
+    template<typename T>
+    T get() {
+        T v;
+        std::memcpy( &v, take( sizeof(T) ), sizeof(T) );
+        return v;
+    }
+
+    // returns a pointer to a byte array of the given size (without copying it). Counterpart of put_bytes.
+    const uint8_t *get_bytes( size_t size );
+
+    std::string get_string();
+    void get_vector( std::vector<uint8_t> *v );
+
+private:
+    const uint8_t *take( size_t size );
+
+    const uint8_t *data_;
+    size_t size_;
+    size_t pos_;
+};
+
+struct ref_index_header {
+    const static uint32_t current_version = 3;
+
+    ref_index_header( uint32_t flags_ = 0, uint64_t key_ = 0 ) : version(current_version), flags(flags_), key(key_) {}
+
+    // flags: type of the references the index was built for
+    const static uint32_t flag_aa = 0x1;
+    const static uint32_t flag_cgap = 0x2;
+
+    void write( index_writer *w ) const;
+
+    // throws if the magic number or the version do not match
+    static ref_index_header read( index_reader *r );
+
+    uint32_t version;
+    uint32_t flags;
+
+    // content hash of the input files (0 = unknown)
+    uint64_t key;
+};
+
+}
+
+#endif
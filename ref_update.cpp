@@ -0,0 +1,166 @@
+/*
+ * Copyright (C) 2009-2012 Simon A. Berger
+ *
+ * This file is part of papara.
+ *
+ *  papara is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  papara is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with papara.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include "ref_update.h"
+#include "ref_index.h"
+
+const papara::directional_state::ref papara::directional_state::no_ref;
+
+papara::directional_state::directional_state( const std::vector<uint32_t> &site_patterns ) : site_patterns_(site_patterns) {}
+
+papara::directional_state::directional_state( index_reader *r ) {
+    site_patterns_.resize( size_t(r->get<uint64_t>()) );
+    if( !site_patterns_.empty() ) {
+        std::memcpy( &site_patterns_.front(), r->get_bytes( site_patterns_.size() * sizeof(uint32_t) ), site_patterns_.size() * sizeof(uint32_t) );
+    }
+
+    const size_t num_patterns = size_t(r->get<uint64_t>());
+
+    dir_children_.resize( size_t(r->get<uint64_t>()) );
+    dirs_.resize( dir_children_.size() );
+
+    for( size_t i = 0; i < dirs_.size(); ++i ) {
+        dir_children_[i].first = r->get<ref>();
+        dir_children_[i].second = r->get<ref>();
+
+        const size_t state_bits = size_t(r->get<uint64_t>());
+
+        // bind first to get the sizes of the packed data (see references::references)
+        packed_ref_vec &v = dirs_[i];
+        v.bind( num_patterns, state_bits, 0, 0 );
+
+        const uint8_t *states = r->get_bytes( v.state_bytes() );
+        const uint8_t *aux = r->get_bytes( v.aux_bytes() );
+
+        v.bind( num_patterns, state_bits, states, aux );
+    }
+
+    edge_ends_.resize( size_t(r->get<uint64_t>()) );
+    for( size_t i = 0; i < edge_ends_.size(); ++i ) {
+        edge_ends_[i].first = r->get<ref>();
+        edge_ends_[i].second = r->get<ref>();
+    }
+
+    finish();
+}
+
+void papara::directional_state::write( index_writer *w ) const {
+    w->put<uint64_t>( site_patterns_.size() );
+    w->put_bytes( site_patterns_.empty() ? 0 : &site_patterns_.front(), site_patterns_.size() * sizeof(uint32_t) );
+
+    w->put<uint64_t>( dirs_.empty() ? 0 : dirs_.front().size() );
+
+    w->put<uint64_t>( dirs_.size() );
+    for( size_t i = 0; i < dirs_.size(); ++i ) {
+        const packed_ref_vec &v = dirs_[i];
+
+        w->put<ref>( dir_children_[i].first );
+        w->put<ref>( dir_children_[i].second );
+        w->put<uint64_t>( v.state_bits() );
+        w->put_bytes( v.state_data(), v.state_bytes() );
+        w->put_bytes( v.aux_data(), v.aux_bytes() );
+    }
+
+    w->put<uint64_t>( edge_ends_.size() );
+    for( size_t i = 0; i < edge_ends_.size(); ++i ) {
+        w->put<ref>( edge_ends_[i].first );
+        w->put<ref>( edge_ends_[i].second );
+    }
+}
+
+void papara::directional_state::add_dir( ref c1, ref c2, const packed_ref_vec &v ) {
+    dir_children_.push_back( ref_pair( c1, c2 ));
+    dirs_.push_back( v );
+}
+
+void papara::directional_state::add_edge( ref e1, ref e2 ) {
+    edge_ends_.push_back( ref_pair( e1, e2 ));
+}
+
+void papara::directional_state::finish() {
+    dir_lookup_.resize( dir_children_.size() );
+
+    std::vector<std::pair<ref,ref> > child_parent;
+    child_parent.reserve( 2 * dir_children_.size() );
+
+    for( size_t i = 0; i < dir_children_.size(); ++i ) {
+        dir_lookup_[i] = std::make_pair( ordered( dir_children_[i].first, dir_children_[i].second ), dir_ref(i) );
+
+        child_parent.push_back( std::make_pair( dir_children_[i].first, dir_ref(i) ));
+        child_parent.push_back( std::make_pair( dir_children_[i].second, dir_ref(i) ));
+    }
+
+    std::sort( dir_lookup_.begin(), dir_lookup_.end() );
+    std::sort( child_parent.begin(), child_parent.end() );
+
+    parent_children_.resize( child_parent.size() );
+    parents_.resize( child_parent.size() );
+
+    for( size_t i = 0; i < child_parent.size(); ++i ) {
+        parent_children_[i] = child_parent[i].first;
+        parents_[i] = child_parent[i].second;
+    }
+
+    edge_lookup_.resize( edge_ends_.size() );
+    for( size_t i = 0; i < edge_ends_.size(); ++i ) {
+        edge_lookup_[i] = std::make_pair( ordered( edge_ends_[i].first, edge_ends_[i].second ), i );
+    }
+
+    std::sort( edge_lookup_.begin(), edge_lookup_.end() );
+}
+
+papara::directional_state::ref papara::directional_state::find_dir( ref c1, ref c2 ) const {
+    const ref_pair key = ordered( c1, c2 );
+
+    // the first entry that is not less than (key, -inf)
+    std::vector<std::pair<ref_pair,ref> >::const_iterator it = std::lower_bound( dir_lookup_.begin(), dir_lookup_.end(), std::make_pair( key, ref(-0x7fffffff - 1) ));
+
+    if( it == dir_lookup_.end() || it->first != key ) {
+        return no_ref;
+    }
+
+    return it->second;
+}
+
+size_t papara::directional_state::find_edge( ref e1, ref e2 ) const {
+    const ref_pair key = ordered( e1, e2 );
+
+    std::vector<std::pair<ref_pair,size_t> >::const_iterator it = std::lower_bound( edge_lookup_.begin(), edge_lookup_.end(), std::make_pair( key, size_t(0) ));
+
+    if( it == edge_lookup_.end() || it->first != key ) {
+        return size_t(-1);
+    }
+
+    return it->second;
+}
+
+std::pair<const papara::directional_state::ref *, const papara::directional_state::ref *> papara::directional_state::parents_of( ref r ) const {
+    const std::pair<std::vector<ref>::const_iterator, std::vector<ref>::const_iterator> range = std::equal_range( parent_children_.begin(), parent_children_.end(), r );
+
+    if( range.first == range.second ) {
+        return std::pair<const ref *, const ref *>( 0, 0 );
+    }
+
+    const ref *p = &parents_.front() + (range.first - parent_children_.begin());
+    return std::make_pair( p, p + (range.second - range.first) );
+}
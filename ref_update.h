@@ -0,0 +1,128 @@
+/*
+ * Copyright (C) 2009-2012 Simon A. Berger
+ *
+ * This file is part of papara.
+ *
+ *  papara is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  papara is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with papara.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __ref_update_h
+#define __ref_update_h
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+#include <stdint.h>
+
+#include "scoring_kernel.h"
+
+// Incremental reference updates (papara -B <new index> -U <old index>): a reference index built with -c also contains
+// the directional ancestral state vectors of the tree (the vector of the subtree behind each inner lnode, see
+// references::build_index_vecs), together with the two subtrees each of them was calculated from. When the index is
+// rebuilt after a few tips were added to or removed from the tree, a directional vector is taken from the old index
+// if its two subtrees have the same vectors as the two subtrees of an old one, and the vector of an edge is taken
+// from the old index if the vectors on both of its sides are the same as for an old edge. Only the vectors on the
+// paths from the changed tips are recalculated, until they are equal to the old vectors again.
+
+namespace papara {
+
+class index_reader;
+class index_writer;
+
+class directional_state {
+public:
+    // a subtree, i.e., a child of a directional vector or one side of an edge: either a tip (index of the reference
+    // sequence) or a directional vector
+    typedef int32_t ref;
+
+    const static ref no_ref = 0x7fffffff;
+
+    static ref tip_ref( size_t tip ) {
+        return -ref(tip) - 1;
+    }
+
+    static ref dir_ref( size_t dir ) {
+        return ref(dir);
+    }
+
+    static bool is_tip( ref r ) {
+        return r < 0;
+    }
+
+    // index of the tip or directional vector
+    static size_t index_of( ref r ) {
+        return r < 0 ? size_t(-(r + 1)) : size_t(r);
+    }
+
+    // site_patterns: site pattern of each column of the reference alignment. The directional vectors have one column
+    // per pattern.
+    explicit directional_state( const std::vector<uint32_t> &site_patterns );
+
+    // reads a state written by write (the packed vectors are bound to the data of the reader)
+    explicit directional_state( index_reader *r );
+
+    void write( index_writer *w ) const;
+
+    // the directional vectors must be added in the order of their indices
+    void add_dir( ref c1, ref c2, const packed_ref_vec &v );
+    void add_edge( ref e1, ref e2 );
+
+    // builds the lookup tables of find_dir, find_edge and parents_of. Must be called after all vectors were added.
+    void finish();
+
+    const std::vector<uint32_t> &site_patterns() const {
+        return site_patterns_;
+    }
+
+    size_t num_dirs() const {
+        return dirs_.size();
+    }
+
+    const packed_ref_vec &dir_at( size_t i ) const {
+        return dirs_.at(i);
+    }
+
+    // the directional vector calculated from the subtrees c1 and c2 (in any order), or no_ref
+    ref find_dir( ref c1, ref c2 ) const;
+
+    // the edge between the subtrees e1 and e2 (in any order), or -1
+    size_t find_edge( ref e1, ref e2 ) const;
+
+    // the directional vectors that have r as one of their children
+    std::pair<const ref *, const ref *> parents_of( ref r ) const;
+
+private:
+    typedef std::pair<ref,ref> ref_pair;
+
+    static ref_pair ordered( ref r1, ref r2 ) {
+        return r1 < r2 ? ref_pair( r1, r2 ) : ref_pair( r2, r1 );
+    }
+
+    std::vector<uint32_t> site_patterns_;
+
+    std::vector<ref_pair> dir_children_;
+    std::vector<packed_ref_vec> dirs_;
+    std::vector<ref_pair> edge_ends_;
+
+    // lookup tables: ordered children (or ends) and the directional vector (or edge), sorted. The (child, parent) pairs
+    // are sorted by child, parents_ contains the parents in the same order.
+    std::vector<std::pair<ref_pair,ref> > dir_lookup_;
+    std::vector<std::pair<ref_pair,size_t> > edge_lookup_;
+    std::vector<ref> parent_children_;
+    std::vector<ref> parents_;
+};
+
+}
+
+#endif
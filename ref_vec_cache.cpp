@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2009-2012 Simon A. Berger
+ *
+ * This file is part of papara.
+ *
+ *  papara is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  papara is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with papara.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "ref_vec_cache.h"
+#include "scoring_kernel.h"
+
+papara::ref_vec_cache::ref_vec_cache( const builder *b, size_t max_bytes )
+  : builder_(*b),
+    max_bytes_(max_bytes),
+    bytes_(0),
+    hits_(0),
+    misses_(0)
+{}
+
+papara::ref_vec_cache::handle papara::ref_vec_cache::get( size_t edge ) {
+    {
+        ivy_mike::lock_guard<ivy_mike::mutex> lock( mtx_ );
+
+        std::map<size_t, lru_list::iterator>::iterator it = index_.find( edge );
+
+        if( it != index_.end() ) {
+            ++hits_;
+            lru_.splice( lru_.begin(), lru_, it->second );
+            return it->second->second;
+        }
+
+        ++misses_;
+    }
+
+    // build outside of the lock, so that the threads build their vectors concurrently. If two threads miss the same
+    // edge, both build it, and the second one is not inserted.
+    packed_ref_vec *v = new packed_ref_vec;
+    handle h( v );
+    builder_.build( edge, v );
+
+    ivy_mike::lock_guard<ivy_mike::mutex> lock( mtx_ );
+
+    if( index_.find( edge ) == index_.end() ) {
+        lru_.push_front( std::make_pair( edge, h ));
+        index_[edge] = lru_.begin();
+        bytes_ += h->bytes();
+
+        // keep at least the new vector
+        while( bytes_ > max_bytes_ && lru_.size() > 1 ) {
+            bytes_ -= lru_.back().second->bytes();
+            index_.erase( lru_.back().first );
+            lru_.pop_back();
+        }
+    }
+
+    return h;
+}
@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2009-2012 Simon A. Berger
+ *
+ * This file is part of papara.
+ *
+ *  papara is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  papara is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with papara.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __ref_vec_cache_h
+#define __ref_vec_cache_h
+
+#include <cstddef>
+#include <list>
+#include <map>
+#include <utility>
+#include <stdint.h>
+
+#include "ivymike/smart_ptr.h"
+#include "ivymike/thread.h"
+
+// Memory budget mode (papara -M <mb>): if the ancestral state vectors of all edges do not fit into the budget, they are
+// not built up front (see references::build_ref_vecs). Instead the scoring workers build the vectors of their ref-blocks
+// on demand, and the most recently used vectors are kept in a cache shared by all threads, up to the budget. Vectors
+// that are still in use stay alive after they are evicted, until the last handle is dropped.
+
+namespace papara {
+
+class packed_ref_vec;
+
+class ref_vec_cache {
+public:
+    // builds the vector of an edge on a cache miss. Called concurrently by several threads.
+    class builder {
+    public:
+        virtual ~builder() {}
+        virtual void build( size_t edge, packed_ref_vec *v ) const = 0;
+    };
+
+    typedef sptr::shared_ptr<const packed_ref_vec> handle;
+
+    // the builder must outlive the cache
+    ref_vec_cache( const builder *b, size_t max_bytes );
+
+    // the vector of an edge (built if it is not in the cache)
+    handle get( size_t edge );
+
+    size_t max_bytes() const {
+        return max_bytes_;
+    }
+
+    uint64_t hits() const {
+        return hits_;
+    }
+
+    uint64_t misses() const {
+        return misses_;
+    }
+
+private:
+    typedef std::list<std::pair<size_t,handle> > lru_list;
+
+    const builder &builder_;
+    const size_t max_bytes_;
+
+    // most recently used first, and the position of each cached edge in the list
+    lru_list lru_;
+    std::map<size_t, lru_list::iterator> index_;
+    size_t bytes_;
+
+    uint64_t hits_;
+    uint64_t misses_;
+
+    ivy_mike::mutex mtx_;
+};
+
+}
+
+#endif
@@ -0,0 +1,227 @@
+/*
+ * Copyright (C) 2009-2012 Simon A. Berger
+ * 
+ * This file is part of papara.
+ * 
+ *  papara is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  papara is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with papara.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstdlib>
+#include <string>
+#include <stdexcept>
+#include <cassert>
+
+#include "scoring_kernel.h"
+
+// The available kernel variants are selected by the build system (see CMakeLists.txt), the baseline (sse2) is
+// always available.
+
+namespace {
+
+struct kernel_variant {
+    const char *name;
+    const char *cpu_feature;
+    std::auto_ptr<papara::scoring_kernel_factory> (*create)( bool aa, const papara::scoring_kernel_params &params );
+};
+
+// ordered from best to worst
+const kernel_variant variants[] = {
+#ifdef PAPARA_KERNEL_AVX512BW
+    { "avx512bw", "avx512bw", papara::create_scoring_kernel_factory_avx512bw },
+#endif
+#ifdef PAPARA_KERNEL_AVX2
+    { "avx2", "avx2", papara::create_scoring_kernel_factory_avx2 },
+#endif
+#ifdef PAPARA_KERNEL_SSE41
+    { "sse41", "sse4.1", papara::create_scoring_kernel_factory_sse41 },
+#endif
+    { "sse2", 0, papara::create_scoring_kernel_factory_sse2 }
+};
+
+const size_t num_variants = sizeof(variants) / sizeof(kernel_variant);
+
+bool cpu_supports( const kernel_variant &v ) {
+    if( v.cpu_feature == 0 ) {
+        return true;
+    }
+
+#if defined(__GNUC__)
+    // __builtin_cpu_supports needs a string literal
+    const std::string f( v.cpu_feature );
+    if( f == "avx512bw" ) {
+        return __builtin_cpu_supports( "avx512bw" );
+    } else if( f == "avx2" ) {
+        return __builtin_cpu_supports( "avx2" );
+    } else if( f == "sse4.1" ) {
+        return __builtin_cpu_supports( "sse4.1" );
+    }
+#endif
+    return false;
+}
+
+}
+
+std::auto_ptr<papara::scoring_kernel_factory> papara::create_scoring_kernel_factory( bool aa, const scoring_kernel_params &params ) {
+
+    // the PAPARA_KERNEL environment variable can be used to force a specific (supported) variant, e.g., for benchmarking
+    const char *forced = getenv( "PAPARA_KERNEL" );
+    if( forced != 0 && *forced == 0 ) {
+        forced = 0;
+    }
+
+    for( size_t i = 0; i < num_variants; ++i ) {
+        const kernel_variant &v = variants[i];
+
+        if( forced != 0 && std::string(forced) != v.name ) {
+            continue;
+        }
+
+        if( cpu_supports( v ) ) {
+            return v.create( aa, params );
+        }
+
+        if( forced != 0 ) {
+            throw std::runtime_error( std::string( "scoring kernel not supported by this cpu: " ) + forced );
+        }
+    }
+
+    if( forced != 0 ) {
+        throw std::runtime_error( std::string( "unknown scoring kernel: " ) + forced );
+    }
+
+    // unreachable: the baseline is always supported
+    throw std::runtime_error( "no scoring kernel available" );
+}
+
+papara::packed_ref_vec::packed_ref_vec( const packed_ref_vec &other )
+  : size_(0), state_bits_(0), states_(0), aux_(0)
+{
+    *this = other;
+}
+
+papara::packed_ref_vec &papara::packed_ref_vec::operator=( const packed_ref_vec &other ) {
+    if( this == &other ) {
+        return *this;
+    }
+
+    size_ = other.size_;
+    state_bits_ = other.state_bits_;
+    own_states_ = other.own_states_;
+    own_aux_ = other.own_aux_;
+
+    // owned data must point into the own copy, bound data is shared
+    const bool owned = !other.own_states_.empty() && other.states_ == &other.own_states_.front();
+
+    if( owned ) {
+        states_ = &own_states_.front();
+        aux_ = own_aux_.empty() ? 0 : &own_aux_.front();
+    } else {
+        states_ = other.states_;
+        aux_ = other.aux_;
+    }
+
+    return *this;
+}
+
+void papara::packed_ref_vec::assign( const std::vector<int> &states, const std::vector<unsigned int> &aux ) {
+    if( states.size() != aux.size() ) {
+        throw std::runtime_error( "packed_ref_vec: inconsistent sizes of states and aux" );
+    }
+
+    size_ = states.size();
+
+    // choose the smallest width that can represent all states
+    unsigned int all_bits = 0;
+    for( size_t i = 0; i < size_; ++i ) {
+        all_bits |= (unsigned int)(states[i]);
+    }
+
+    if( all_bits < (1u << 4) ) {
+        state_bits_ = 4;
+    } else if( all_bits < (1u << 8) ) {
+        state_bits_ = 8;
+    } else {
+        state_bits_ = 32;
+    }
+
+    // the references are allocated once and never grow, so do not use assign (which may over-allocate)
+    std::vector<uint8_t>( state_bytes(), 0 ).swap( own_states_ );
+    std::vector<uint8_t>( aux_bytes(), 0 ).swap( own_aux_ );
+
+    for( size_t i = 0; i < size_; ++i ) {
+        const unsigned int s = (unsigned int)(states[i]);
+
+        if( state_bits_ == 4 ) {
+            own_states_[i / 2] |= uint8_t(s << ((i % 2) * 4));
+        } else if( state_bits_ == 8 ) {
+            own_states_[i] = uint8_t(s);
+        } else {
+            for( size_t j = 0; j < 4; ++j ) {
+                own_states_[i * 4 + j] = uint8_t(s >> (j * 8));
+            }
+        }
+
+        if( aux[i] > 3 ) {
+            throw std::runtime_error( "packed_ref_vec: aux flags do not fit into 2 bits" );
+        }
+
+        own_aux_[i / 4] |= uint8_t(aux[i] << ((i % 4) * 2));
+    }
+
+    states_ = own_states_.empty() ? 0 : &own_states_.front();
+    aux_ = own_aux_.empty() ? 0 : &own_aux_.front();
+}
+
+void papara::packed_ref_vec::bind( size_t size, size_t state_bits, const uint8_t *states, const uint8_t *aux ) {
+    if( state_bits != 4 && state_bits != 8 && state_bits != 32 ) {
+        throw std::runtime_error( "packed_ref_vec: unsupported state width" );
+    }
+
+    size_ = size;
+    state_bits_ = state_bits;
+    states_ = states;
+    aux_ = aux;
+
+    std::vector<uint8_t>().swap( own_states_ );
+    std::vector<uint8_t>().swap( own_aux_ );
+}
+
+void papara::packed_ref_vec::unpack( size_t begin, size_t end, int *states, unsigned int *aux ) const {
+    assert( begin <= end && end <= size_ );
+
+    for( size_t i = begin; i < end; ++i, ++states, ++aux ) {
+        if( state_bits_ == 4 ) {
+            *states = (states_[i / 2] >> ((i % 2) * 4)) & 0xf;
+        } else if( state_bits_ == 8 ) {
+            *states = states_[i];
+        } else {
+            unsigned int s = 0;
+            for( size_t j = 0; j < 4; ++j ) {
+                s |= (unsigned int)(states_[i * 4 + j]) << (j * 8);
+            }
+            *states = int(s);
+        }
+
+        *aux = (aux_[i / 4] >> ((i % 4) * 2)) & 0x3;
+    }
+}
+
+void papara::packed_ref_vec::unpack( std::vector<int> *states, std::vector<unsigned int> *aux ) const {
+    states->resize( size_ );
+    aux->resize( size_ );
+
+    if( size_ > 0 ) {
+        unpack( 0, size_, &states->front(), &aux->front() );
+    }
+}
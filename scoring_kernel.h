@@ -0,0 +1,166 @@
+/*
+ * Copyright (C) 2009-2012 Simon A. Berger
+ * 
+ * This file is part of papara.
+ * 
+ *  papara is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  papara is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with papara.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __scoring_kernel_h
+#define __scoring_kernel_h
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+#include <utility>
+#include <stdint.h>
+
+// Interface between the scoring loop (papara.cpp) and the vectorized alignment kernels (pvec_aligner_vec).
+// The kernels are compiled several times with different instruction set flags (scoring_kernel_*.cpp), and
+// the best variant supported by the cpu is chosen at runtime. This interface must not depend on anything that
+// is compiled differently for the single variants (i.e., vec_unit.h and stepwise_align.h).
+
+namespace papara {
+
+// compact storage of the ancestral state vector and the aux flags (AUX_CGAP, AUX_OPEN) of one reference edge: the
+// states are stored with the smallest width that fits all of them (4bit for DNA, 8 or 32bit otherwise), the aux
+// flags with 2bit per column. The packed data is either owned, or bound to external memory (e.g., a memory mapped
+// reference index, see ref_index.h). The members are defined in scoring_kernel.cpp, so that they are not compiled
+// with the instruction set flags of the kernel variants.
+class packed_ref_vec {
+public:
+    packed_ref_vec() : size_(0), state_bits_(0), states_(0), aux_(0) {}
+
+    packed_ref_vec( const packed_ref_vec &other );
+    packed_ref_vec &operator=( const packed_ref_vec &other );
+
+    void assign( const std::vector<int> &states, const std::vector<unsigned int> &aux );
+
+    // binds to packed data (as returned by state_data/aux_data) without copying it
+    void bind( size_t size, size_t state_bits, const uint8_t *states, const uint8_t *aux );
+
+    // unpacks the columns [begin,end) into states and aux
+    void unpack( size_t begin, size_t end, int *states, unsigned int *aux ) const;
+
+    void unpack( std::vector<int> *states, std::vector<unsigned int> *aux ) const;
+
+    size_t size() const {
+        return size_;
+    }
+
+    size_t state_bits() const {
+        return state_bits_;
+    }
+
+    const uint8_t *state_data() const {
+        return states_;
+    }
+
+    const uint8_t *aux_data() const {
+        return aux_;
+    }
+
+    size_t state_bytes() const {
+        return (size_ * state_bits_ + 7) / 8;
+    }
+
+    size_t aux_bytes() const {
+        return (size_ + 3) / 4;
+    }
+
+    size_t bytes() const {
+        return state_bytes() + aux_bytes();
+    }
+
+private:
+    size_t size_;
+    size_t state_bits_;
+
+    // the packed data, points either into own_states_/own_aux_ or to external memory
+    const uint8_t *states_;
+    const uint8_t *aux_;
+
+    std::vector<uint8_t> own_states_;
+    std::vector<uint8_t> own_aux_;
+};
+
+struct scoring_kernel_params {
+    scoring_kernel_params( int match_, int match_cgap_, int gap_open_, int gap_extend_, const std::vector<int> &state_map_ )
+     : match(match_), match_cgap(match_cgap_), gap_open(gap_open_), gap_extend(gap_extend_), state_map(state_map_)
+    {}
+
+    int match;
+    int match_cgap;
+    int gap_open;
+    int gap_extend;
+
+    // maps the query character states to parsimony state bitmasks (i.e., model<seq_tag>::c2p)
+    std::vector<int> state_map;
+};
+
+// aligns queries against the profile of one block of width() reference edges.
+class scoring_kernel {
+public:
+    virtual ~scoring_kernel() {}
+
+    // if no bounds are available, a_start_idx and a_end_idx shall be size_t(-1) (='full range').
+    // writes width() scores to out_scores. If out_ends is not 0, the positions (ref, query) of the best cells are
+    // written to out_ends (width() elements, (-1,-1) if unknown).
+    virtual void align( const uint8_t *b_start, const uint8_t *b_end, size_t a_start_idx, size_t a_end_idx, int *out_scores, std::pair<int,int> *out_ends ) = 0;
+
+    virtual uint64_t ticks_all() = 0;
+    virtual uint64_t inner_iters_all() = 0;
+};
+
+class scoring_kernel_factory {
+public:
+    virtual ~scoring_kernel_factory() {}
+
+    // name of the instruction set variant, used for the log output
+    virtual const char *name() const = 0;
+
+    // number of reference edges aligned in one pass
+    virtual size_t width() const = 0;
+
+    // alignment of the memory passed to build_profile
+    const static size_t profile_alignment = 64;
+
+    // size of the profile of one block in bytes (used to choose the tile sizes of the scoring loop)
+    virtual size_t profile_bytes( size_t ref_len ) const = 0;
+
+    // size of the read-only part of the profile of one block in bytes (see build_profile)
+    virtual size_t shared_profile_bytes( size_t ref_len ) const = 0;
+
+    // builds the read-only profile of one block into mem (shared_profile_bytes(ref_len) bytes). It can be shared by
+    // all kernels (i.e., threads) that align against this block.
+    // refs must contain at least width() elements
+    virtual void build_profile( const packed_ref_vec * const *refs, size_t ref_len, void *mem ) const = 0;
+
+    // creates a kernel that is bound to a profile created by build_profile. Neither the profile nor the ref vectors are
+    // copied, so they must outlive the kernel.
+    virtual scoring_kernel *create( const packed_ref_vec * const *refs, size_t ref_len, const void *profile ) const = 0;
+};
+
+// returns the kernel for the widest instruction set that is supported by the cpu
+std::auto_ptr<scoring_kernel_factory> create_scoring_kernel_factory( bool aa, const scoring_kernel_params &params );
+
+// the single instruction set variants. Only available if the corresponding PAPARA_KERNEL_* macro is defined.
+std::auto_ptr<scoring_kernel_factory> create_scoring_kernel_factory_sse2( bool aa, const scoring_kernel_params &params );
+std::auto_ptr<scoring_kernel_factory> create_scoring_kernel_factory_sse41( bool aa, const scoring_kernel_params &params );
+std::auto_ptr<scoring_kernel_factory> create_scoring_kernel_factory_avx2( bool aa, const scoring_kernel_params &params );
+std::auto_ptr<scoring_kernel_factory> create_scoring_kernel_factory_avx512bw( bool aa, const scoring_kernel_params &params );
+
+}
+
+#endif
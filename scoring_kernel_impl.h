@@ -0,0 +1,397 @@
+/*
+ * Copyright (C) 2009-2012 Simon A. Berger
+ * 
+ * This file is part of papara.
+ * 
+ *  papara is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  papara is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with papara.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Implementation of the scoring kernels. This file is included by the scoring_kernel_*.cpp files, one per instruction
+// set variant. Before including it, they have to define:
+//
+// PAPARA_KERNEL_NAMESPACE:  namespace for everything that is compiled for the instruction set
+// PAPARA_KERNEL_NAME:       name of the instruction set variant (for the log output)
+// PAPARA_KERNEL_FACTORY_FN: name of the factory function declared in scoring_kernel.h
+// PAPARA_KERNEL_DNA_WIDTH:  vector width for DNA with 16bit scores (the 8bit first pass uses twice the width)
+//
+// and optionally (not for the baseline):
+//
+// PAPARA_KERNEL_TARGET:     instruction sets as accepted by the target attribute, e.g., "avx2"
+// VEC_UNIT_TARGET_*:        the matching vector unit code in vec_unit.h, e.g., VEC_UNIT_TARGET_AVX2
+//
+// The variants are not compiled with instruction set flags (-mavx2 etc.). Instead, only the code inside of
+// PAPARA_KERNEL_NAMESPACE is compiled for PAPARA_KERNEL_TARGET (#pragma GCC target). With the flags, the
+// instantiations of the shared templates and inline functions (std::vector, ivy_mike::aligned_buffer, ...) would
+// also be compiled with AVX2 instructions, and the linker is free to pick these copies for the whole program, which
+// then crashes on a cpu without AVX2.
+// vec_unit.h and stepwise_align.h are included inside of PAPARA_KERNEL_NAMESPACE, so that the kernel templates
+// (pvec_aligner_vec, vector_unit) instantiated in the different variants get different symbol names.
+// For this to work, all headers that they depend on must be included here first (outside of the namespace).
+
+#ifndef __scoring_kernel_impl_h
+#define __scoring_kernel_impl_h
+
+#if !defined(PAPARA_KERNEL_NAMESPACE) || !defined(PAPARA_KERNEL_NAME) || !defined(PAPARA_KERNEL_FACTORY_FN) || !defined(PAPARA_KERNEL_DNA_WIDTH)
+#error "scoring_kernel_impl.h: kernel macros not defined"
+#endif
+
+#include <iostream>
+#include <ostream>
+#include <iterator>
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <stdexcept>
+#include <algorithm>
+#include <vector>
+#include <memory>
+#include <stdint.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+
+#include "ivymike/aligned_buffer.h"
+#include "ivymike/fasta.h"
+#include "ivymike/cycle.h"
+#include "parsimony.h"
+#include "scoring_kernel.h"
+
+#ifdef PAPARA_KERNEL_TARGET
+#define PAPARA_KERNEL_PRAGMA(x) _Pragma(#x)
+#ifdef __clang__
+#define PAPARA_KERNEL_TARGET_PUSH(t) PAPARA_KERNEL_PRAGMA(clang attribute push (__attribute__((target(t))), apply_to = function))
+#define PAPARA_KERNEL_TARGET_POP PAPARA_KERNEL_PRAGMA(clang attribute pop)
+#else
+#define PAPARA_KERNEL_TARGET_PUSH(t) PAPARA_KERNEL_PRAGMA(GCC push_options) PAPARA_KERNEL_PRAGMA(GCC target(t))
+#define PAPARA_KERNEL_TARGET_POP PAPARA_KERNEL_PRAGMA(GCC pop_options)
+#endif
+
+PAPARA_KERNEL_TARGET_PUSH(PAPARA_KERNEL_TARGET)
+#endif
+
+namespace PAPARA_KERNEL_NAMESPACE {
+#include "vec_unit.h"
+#include "stepwise_align.h"
+
+template<typename score_t>
+class state_map_fn {
+public:
+    state_map_fn( const std::vector<int> &map ) : map_(map) {}
+
+    score_t operator()( size_t s ) const {
+        return score_t(map_.at(s));
+    }
+private:
+    const std::vector<int> &map_;
+};
+
+// plain (unpacked) copy of the ref vectors of a block, used as input for building the profiles
+class unpacked_refs {
+public:
+    unpacked_refs( const papara::packed_ref_vec * const *refs, size_t n, size_t ref_len )
+     : states_( n * ref_len ),
+       aux_( n * ref_len ),
+       seqptrs_( n ),
+       auxptrs_( n )
+    {
+        for( size_t i = 0; i < n; ++i ) {
+            refs[i]->unpack( 0, ref_len, &states_[i * ref_len], &aux_[i * ref_len] );
+
+            seqptrs_[i] = &states_[i * ref_len];
+            auxptrs_[i] = &aux_[i * ref_len];
+        }
+    }
+
+    const int **seqptrs() {
+        return &seqptrs_.front();
+    }
+
+    const unsigned int **auxptrs() {
+        return &auxptrs_.front();
+    }
+
+private:
+    std::vector<int> states_;
+    std::vector<unsigned int> aux_;
+    std::vector<const int *> seqptrs_;
+    std::vector<const unsigned int *> auxptrs_;
+};
+
+// the kernels have the aligners of stepwise_align.h as members, which are in an anonymous namespace, so the kernels
+// are in one as well
+namespace {
+
+template<typename score_t, size_t W>
+class pvec_kernel : public papara::scoring_kernel {
+public:
+    pvec_kernel( const void *profile, size_t ref_len, const papara::scoring_kernel_params &params )
+     : params_(params),
+       aligner_( static_cast<const score_t *>(profile), ref_len, params.state_map.size() ),
+       out_scores_(W)
+    {}
+
+    void align( const uint8_t *b_start, const uint8_t *b_end, size_t a_start_idx, size_t a_end_idx, int *out_scores, std::pair<int,int> *out_ends ) {
+        aligner_.align( b_start, b_end, params_.match, params_.match_cgap, params_.gap_open, params_.gap_extend, out_scores_.begin(), a_start_idx, a_end_idx, out_ends );
+
+        std::copy( out_scores_.begin(), out_scores_.end(), out_scores );
+    }
+
+    uint64_t ticks_all() {
+        return aligner_.ticks_all();
+    }
+
+    uint64_t inner_iters_all() {
+        return aligner_.inner_iters_all();
+    }
+
+private:
+    const papara::scoring_kernel_params &params_;
+    pvec_aligner_vec<score_t,W> aligner_;
+    ivy_mike::aligned_buffer<score_t> out_scores_;
+};
+
+}
+
+// Adaptive 8bit/16bit kernel (for DNA): the queries are first scored against 2*W edges with saturating 8bit arithmetic.
+// If the scores of a lane may have saturated, the corresponding half of the block (W edges) is re-scored with 16bit.
+//
+// Overflow detection:
+// - upwards: the 8bit kernel keeps track of the maximum cell score of each lane (not only of the last row/column). As
+//   the first saturated cell would be clamped to 127, no saturation can have happened if max + 'max. score increment'
+//   is below 127.
+// - downwards: the score of each cell is bounded from below by the free-shift gap from the first row (gap_open + (i-1) * gap_extend
+//   in row i), which only depends on the query length. The 8bit pass is only used if this bound (minus the largest penalty
+//   of a single step) cannot reach -128. The initial -128 values (SMALL_VALUE) only act as -infinity and are never
+//   chosen over a real value.
+
+// in an anonymous namespace for the same reason as pvec_kernel
+namespace {
+
+template<size_t W>
+class pvec_kernel_adaptive : public papara::scoring_kernel {
+    typedef signed char score8_t;
+    typedef pvec_aligner_vec<score8_t,2*W> aligner8_t;
+    typedef pvec_aligner_vec<short,W> aligner16_t;
+
+    const static int max8 = 127;
+    const static int min8 = -128;
+
+public:
+    pvec_kernel_adaptive( const papara::packed_ref_vec * const *refs, size_t ref_len, const void *profile8, const papara::scoring_kernel_params &params )
+     : params_(params),
+       ref_len_(ref_len),
+       profile8_(static_cast<const score8_t *>(profile8)),
+       out8_(2*W),
+       out16_(W)
+    {
+        std::copy( refs, refs + 2*W, refs_ );
+
+        max_inc_ = std::max( 0, std::max( params.match, params.match + params.match_cgap ));
+        const int min_inc = std::min( 0, std::min( params.match_cgap, params.match + params.match_cgap ));
+        min_step_ = std::min( params.gap_open + params.gap_extend, min_inc );
+
+        use_8bit_ = usable_8bit( params );
+        assert( !use_8bit_ || profile8_ != 0 );
+    }
+
+    // the 8bit profile is only built (and the 8bit pass only used) if the lower bound holds, which is not the case for positive gap penalties
+    static bool usable_8bit( const papara::scoring_kernel_params &params ) {
+        return params.gap_open <= 0 && params.gap_extend <= 0 && params.match_cgap <= 0 && params.match <= max8;
+    }
+
+    static size_t profile8_bytes( size_t ref_len, const papara::scoring_kernel_params &params ) {
+        return usable_8bit( params ) ? aligner8_t::profile_size( ref_len, params.state_map.size() ) * sizeof(score8_t) : 0;
+    }
+
+    static void build_profile8( const papara::packed_ref_vec * const *refs, size_t ref_len, const papara::scoring_kernel_params &params, void *mem ) {
+        if( usable_8bit( params )) {
+            unpacked_refs ur( refs, 2*W, ref_len );
+            aligner8_t::build_profile( ur.seqptrs(), ur.auxptrs(), ref_len, score8_t(params.match), score8_t(params.match_cgap), state_map_fn<score8_t>(params.state_map), params.state_map.size(), static_cast<score8_t *>(mem) );
+        }
+    }
+
+    void align( const uint8_t *b_start, const uint8_t *b_end, size_t a_start_idx, size_t a_end_idx, int *out_scores, std::pair<int,int> *out_ends ) {
+        bool rescore[2] = {true, true};
+
+        if( fits_8bit( b_end - b_start ) ) {
+            if( aligner8_.get() == 0 ) {
+                aligner8_.reset( new aligner8_t( profile8_, ref_len_, params_.state_map.size() ));
+            }
+
+            aligner8_->align( b_start, b_end, score8_t(params_.match), score8_t(params_.match_cgap), score8_t(params_.gap_open), score8_t(params_.gap_extend), out8_.begin(), a_start_idx, a_end_idx, out_ends );
+
+            const score8_t *max_cell = aligner8_->max_cell_scores();
+
+            for( size_t h = 0; h < 2; ++h ) {
+                rescore[h] = false;
+
+                for( size_t i = h * W; i < (h + 1) * W; ++i ) {
+                    rescore[h] = rescore[h] || (max_cell[i] + max_inc_ >= max8);
+                    out_scores[i] = out8_[i];
+                }
+            }
+        }
+
+        for( size_t h = 0; h < 2; ++h ) {
+            if( !rescore[h] ) {
+                continue;
+            }
+
+            if( aligner16_[h].get() == 0 ) {
+                unpacked_refs ur( refs_ + h * W, W, ref_len_ );
+                aligner16_[h].reset( new aligner16_t( ur.seqptrs(), ur.auxptrs(), ref_len_, params_.match, params_.match_cgap, params_.gap_open, params_.gap_extend, state_map_fn<short>(params_.state_map), params_.state_map.size() ));
+            }
+
+            aligner16_[h]->align( b_start, b_end, params_.match, params_.match_cgap, params_.gap_open, params_.gap_extend, out16_.begin(), a_start_idx, a_end_idx, out_ends != 0 ? out_ends + h * W : 0 );
+            std::copy( out16_.begin(), out16_.end(), out_scores + h * W );
+        }
+    }
+
+    uint64_t ticks_all() {
+        uint64_t t = aligner8_.get() != 0 ? aligner8_->ticks_all() : 0;
+
+        for( size_t h = 0; h < 2; ++h ) {
+            t += aligner16_[h].get() != 0 ? aligner16_[h]->ticks_all() : 0;
+        }
+        return t;
+    }
+
+    uint64_t inner_iters_all() {
+        uint64_t n = aligner8_.get() != 0 ? aligner8_->inner_iters_all() : 0;
+
+        for( size_t h = 0; h < 2; ++h ) {
+            n += aligner16_[h].get() != 0 ? aligner16_[h]->inner_iters_all() : 0;
+        }
+        return n;
+    }
+
+private:
+    bool fits_8bit( size_t qs_len ) const {
+        if( !use_8bit_ || qs_len == 0 ) {
+            return false;
+        }
+
+        const long lower_bound = long(params_.gap_open) + long(qs_len - 1) * params_.gap_extend + min_step_;
+        return lower_bound > min8;
+    }
+
+    const papara::scoring_kernel_params &params_;
+    const size_t ref_len_;
+
+    // the shared 8bit profile of all 2*W edges. The 16bit profiles are only built for the halves that overflow.
+    const score8_t *profile8_;
+
+    const papara::packed_ref_vec *refs_[2*W];
+
+    int max_inc_;
+    int min_step_;
+    bool use_8bit_;
+
+    // the aligners are only created when they are needed (i.e., the 16bit ones are never created if no lane overflows)
+    std::auto_ptr<aligner8_t> aligner8_;
+    std::auto_ptr<aligner16_t> aligner16_[2];
+
+    ivy_mike::aligned_buffer<score8_t> out8_;
+    ivy_mike::aligned_buffer<short> out16_;
+};
+
+}
+
+template<size_t W>
+class pvec_kernel_adaptive_factory : public papara::scoring_kernel_factory {
+public:
+    pvec_kernel_adaptive_factory( const papara::scoring_kernel_params &params ) : params_(params) {}
+
+    const char *name() const {
+        return PAPARA_KERNEL_NAME;
+    }
+
+    size_t width() const {
+        return 2 * W;
+    }
+
+    size_t profile_bytes( size_t ref_len ) const {
+        // 8bit profile for all edges plus the 16bit profiles of both halves (in case of overflows)
+        return ref_len * 2 * W * params_.state_map.size() * (sizeof(signed char) + sizeof(short));
+    }
+
+    size_t shared_profile_bytes( size_t ref_len ) const {
+        return pvec_kernel_adaptive<W>::profile8_bytes( ref_len, params_ );
+    }
+
+    void build_profile( const papara::packed_ref_vec * const *refs, size_t ref_len, void *mem ) const {
+        pvec_kernel_adaptive<W>::build_profile8( refs, ref_len, params_, mem );
+    }
+
+    papara::scoring_kernel *create( const papara::packed_ref_vec * const *refs, size_t ref_len, const void *profile ) const {
+        return new pvec_kernel_adaptive<W>( refs, ref_len, profile, params_ );
+    }
+
+private:
+    const papara::scoring_kernel_params params_;
+};
+
+template<typename score_t, size_t W>
+class pvec_kernel_factory : public papara::scoring_kernel_factory {
+public:
+    pvec_kernel_factory( const papara::scoring_kernel_params &params ) : params_(params) {}
+
+    const char *name() const {
+        return PAPARA_KERNEL_NAME;
+    }
+
+    size_t width() const {
+        return W;
+    }
+
+    size_t profile_bytes( size_t ref_len ) const {
+        // the (W interleaved) per-state match score increments of pvec_aligner_vec
+        return shared_profile_bytes( ref_len );
+    }
+
+    size_t shared_profile_bytes( size_t ref_len ) const {
+        return pvec_aligner_vec<score_t,W>::profile_size( ref_len, params_.state_map.size() ) * sizeof(score_t);
+    }
+
+    void build_profile( const papara::packed_ref_vec * const *refs, size_t ref_len, void *mem ) const {
+        unpacked_refs ur( refs, W, ref_len );
+        pvec_aligner_vec<score_t,W>::build_profile( ur.seqptrs(), ur.auxptrs(), ref_len, score_t(params_.match), score_t(params_.match_cgap), state_map_fn<score_t>(params_.state_map), params_.state_map.size(), static_cast<score_t *>(mem) );
+    }
+
+    papara::scoring_kernel *create( const papara::packed_ref_vec * const *, size_t ref_len, const void *profile ) const {
+        return new pvec_kernel<score_t,W>( profile, ref_len, params_ );
+    }
+
+private:
+    const papara::scoring_kernel_params params_;
+};
+
+}
+
+#ifdef PAPARA_KERNEL_TARGET
+PAPARA_KERNEL_TARGET_POP
+#endif
+
+std::auto_ptr<papara::scoring_kernel_factory> papara::PAPARA_KERNEL_FACTORY_FN( bool aa, const scoring_kernel_params &params ) {
+    if( aa ) {
+        return std::auto_ptr<scoring_kernel_factory>( new PAPARA_KERNEL_NAMESPACE::pvec_kernel_factory<int,4>( params ));
+    } else {
+        return std::auto_ptr<scoring_kernel_factory>( new PAPARA_KERNEL_NAMESPACE::pvec_kernel_adaptive_factory<PAPARA_KERNEL_DNA_WIDTH>( params ));
+    }
+}
+
+#endif
@@ -0,0 +1,26 @@
+/*
+ * Copyright (C) 2009-2012 Simon A. Berger
+ * 
+ * This file is part of papara.
+ * 
+ *  papara is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  papara is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with papara.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// baseline scoring kernel: compiled without additional instruction set flags (i.e., SSE2 on x86-64)
+#define PAPARA_KERNEL_NAMESPACE papara_kernel_sse2
+#define PAPARA_KERNEL_NAME "sse2"
+#define PAPARA_KERNEL_FACTORY_FN create_scoring_kernel_factory_sse2
+#define PAPARA_KERNEL_DNA_WIDTH 8
+
+#include "scoring_kernel_impl.h"
@@ -0,0 +1,330 @@
+/*
+ * Copyright (C) 2009-2012 Simon A. Berger
+ *
+ * This file is part of papara.
+ *
+ *  papara is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  papara is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with papara.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+
+#include "ivymike/thread.h"
+
+#include "ref_index.h"
+#include "seq_reader.h"
+
+namespace {
+
+typedef const uint8_t *cptr_t;
+
+// same as isspace in the "C" locale, but without the function call
+inline bool is_space( uint8_t c ) {
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+inline cptr_t line_end( cptr_t p, cptr_t end ) {
+    const void *nl = std::memchr( p, '\n', end - p );
+    return nl == 0 ? end : static_cast<cptr_t>(nl);
+}
+
+// result of one chunk. In the first pass only the names and lengths are collected, in the second pass (fill) the
+// residues are copied to dest.
+struct chunk_t {
+    chunk_t() : begin(0), end(0), fill(false), dest(0) {}
+
+    cptr_t begin;
+    cptr_t end;
+
+    std::vector<std::string> names;
+    std::vector<size_t> lengths;
+
+    bool fill;
+    uint8_t *dest;
+};
+
+// same semantics as read_fasta: the header is the whole line after the '>', empty lines and lines before the first
+// header are ignored, whitespace is removed from the sequences.
+void parse_fasta_chunk( chunk_t *chunk, papara::name_filter_t name_filter ) {
+    const bool fill = chunk->fill;
+    uint8_t *dest = chunk->dest;
+
+    bool in_record = false;
+    size_t len = 0;
+
+    for( cptr_t p = chunk->begin; p < chunk->end; ) {
+        cptr_t le = line_end( p, chunk->end );
+
+        if( p != le && *p == '>' ) {
+            if( !fill ) {
+                if( in_record ) {
+                    chunk->lengths.push_back( len );
+                }
+
+                chunk->names.push_back( std::string( p + 1, le ));
+
+                if( name_filter != 0 ) {
+                    name_filter( chunk->names.back() );
+                }
+            }
+
+            in_record = true;
+            len = 0;
+        } else if( in_record ) {
+            for( ; p != le; ++p ) {
+                if( !is_space(*p) ) {
+                    if( fill ) {
+                        *(dest++) = *p;
+                    }
+                    ++len;
+                }
+            }
+        }
+
+        p = le + 1;
+    }
+
+    if( !fill && in_record ) {
+        chunk->lengths.push_back( len );
+    }
+}
+
+// one taxon per line: the name is the first token, the sequence is the rest of the line (without whitespace).
+// Lines that only contain whitespace are ignored.
+void parse_phylip_chunk( chunk_t *chunk ) {
+    const bool fill = chunk->fill;
+    uint8_t *dest = chunk->dest;
+
+    for( cptr_t p = chunk->begin; p < chunk->end; ) {
+        cptr_t le = line_end( p, chunk->end );
+
+        while( p != le && is_space(*p) ) {
+            ++p;
+        }
+
+        if( p != le ) {
+            cptr_t name_begin = p;
+
+            while( p != le && !is_space(*p) ) {
+                ++p;
+            }
+
+            if( !fill ) {
+                chunk->names.push_back( std::string( name_begin, p ));
+            }
+
+            size_t len = 0;
+            for( ; p != le; ++p ) {
+                if( !is_space(*p) ) {
+                    if( fill ) {
+                        *(dest++) = *p;
+                    }
+                    ++len;
+                }
+            }
+
+            if( !fill ) {
+                chunk->lengths.push_back( len );
+            }
+        }
+
+        p = le + 1;
+    }
+}
+
+class chunk_worker {
+public:
+    chunk_worker( std::vector<chunk_t> &chunks, bool fasta, papara::name_filter_t name_filter, size_t rank, size_t n_threads )
+      : chunks_(chunks), fasta_(fasta), name_filter_(name_filter), rank_(rank), n_threads_(n_threads)
+    {}
+
+    void operator()() {
+        for( size_t i = rank_; i < chunks_.size(); i += n_threads_ ) {
+            if( fasta_ ) {
+                parse_fasta_chunk( &chunks_[i], name_filter_ );
+            } else {
+                parse_phylip_chunk( &chunks_[i] );
+            }
+        }
+    }
+
+private:
+    std::vector<chunk_t> &chunks_;
+    const bool fasta_;
+    const papara::name_filter_t name_filter_;
+    const size_t rank_;
+    const size_t n_threads_;
+};
+
+void run_chunk_workers( std::vector<chunk_t> &chunks, bool fasta, papara::name_filter_t name_filter, size_t n_threads ) {
+    n_threads = std::max( size_t(1), std::min( n_threads, chunks.size() ));
+
+    ivy_mike::thread_group tg;
+
+    for( size_t i = 1; i < n_threads; ++i ) {
+        tg.create_thread( chunk_worker( chunks, fasta, name_filter, i, n_threads ));
+    }
+
+    chunk_worker( chunks, fasta, name_filter, 0, n_threads )();
+
+    tg.join_all();
+}
+
+// splits [begin,end) into (up to) n chunks, which start at the beginning of a line (and for fasta at a header line)
+std::vector<chunk_t> split_chunks( cptr_t begin, cptr_t end, size_t n, bool fasta ) {
+    // very small files are not worth the threads
+    const size_t min_chunk_size = 64 * 1024;
+
+    const size_t size = end - begin;
+    n = std::max( size_t(1), std::min( n, size / min_chunk_size ));
+
+    std::vector<cptr_t> bounds;
+    bounds.push_back( begin );
+
+    for( size_t i = 1; i < n; ++i ) {
+        cptr_t p = std::max( begin + (size * i) / n, bounds.back() );
+
+        if( p != begin && p[-1] != '\n' ) {
+            p = std::min( end, line_end( p, end ) + 1 );
+        }
+
+        while( fasta && p < end && *p != '>' ) {
+            p = std::min( end, line_end( p, end ) + 1 );
+        }
+
+        bounds.push_back( p );
+    }
+
+    bounds.push_back( end );
+
+    std::vector<chunk_t> chunks;
+    for( size_t i = 0; i < n; ++i ) {
+        if( bounds[i] != bounds[i+1] ) {
+            chunks.push_back( chunk_t() );
+            chunks.back().begin = bounds[i];
+            chunks.back().end = bounds[i+1];
+        }
+    }
+
+    return chunks;
+}
+
+// pass 1 on all chunks, concatenation of names and lengths, pass 2 into the arena
+void read_parallel( cptr_t begin, cptr_t end, size_t n_threads, bool fasta, papara::name_filter_t name_filter, std::vector<std::string> *names, papara::seq_arena *seqs ) {
+    std::vector<chunk_t> chunks = split_chunks( begin, end, n_threads, fasta );
+
+    run_chunk_workers( chunks, fasta, name_filter, n_threads );
+
+    names->clear();
+    std::vector<size_t> lengths;
+
+    for( std::vector<chunk_t>::iterator it = chunks.begin(); it != chunks.end(); ++it ) {
+        assert( it->names.size() == it->lengths.size() );
+
+        lengths.insert( lengths.end(), it->lengths.begin(), it->lengths.end() );
+
+        for( std::vector<std::string>::iterator nit = it->names.begin(); nit != it->names.end(); ++nit ) {
+            names->push_back( std::string() );
+            names->back().swap( *nit );
+        }
+    }
+
+    uint8_t *dest = seqs->reset( lengths );
+
+    for( std::vector<chunk_t>::iterator it = chunks.begin(); it != chunks.end(); ++it ) {
+        it->fill = true;
+        it->dest = dest;
+
+        for( std::vector<size_t>::const_iterator lit = it->lengths.begin(); lit != it->lengths.end(); ++lit ) {
+            dest += *lit;
+        }
+    }
+
+    run_chunk_workers( chunks, fasta, name_filter, n_threads );
+}
+
+}
+
+uint8_t *papara::seq_arena::reset( const std::vector<size_t> &lengths ) {
+    offsets_.resize( lengths.size() + 1 );
+    offsets_[0] = 0;
+
+    for( size_t i = 0; i < lengths.size(); ++i ) {
+        offsets_[i+1] = offsets_[i] + lengths[i];
+    }
+
+    data_.resize( offsets_.back() );
+
+    return data_.empty() ? 0 : &data_.front();
+}
+
+void papara::seq_arena::clear() {
+    std::vector<uint8_t>().swap( data_ );
+    offsets_.assign( 1, 0 );
+}
+
+void papara::seq_arena::swap( seq_arena &other ) {
+    data_.swap( other.data_ );
+    offsets_.swap( other.offsets_ );
+}
+
+void papara::read_fasta_parallel( const char *name, size_t n_threads, name_filter_t name_filter, std::vector<std::string> *names, seq_arena *seqs ) {
+    mapped_file file( name );
+
+    read_fasta_parallel( file.data(), file.data() + file.size(), n_threads, name_filter, names, seqs );
+}
+
+void papara::read_fasta_parallel( const uint8_t *begin, const uint8_t *end, size_t n_threads, name_filter_t name_filter, std::vector<std::string> *names, seq_arena *seqs ) {
+    read_parallel( begin, end, n_threads, true, name_filter, names, seqs );
+}
+
+void papara::read_phylip_parallel( const char *name, size_t n_threads, std::vector<std::string> *names, seq_arena *seqs ) {
+    mapped_file file( name );
+
+    try {
+        read_phylip_parallel( file.data(), file.data() + file.size(), n_threads, names, seqs );
+    } catch( std::runtime_error &x ) {
+        throw std::runtime_error( std::string( x.what() ) + " (file: " + name + ")" );
+    }
+}
+
+void papara::read_phylip_parallel( const uint8_t *begin, const uint8_t *end, size_t n_threads, std::vector<std::string> *names, seq_arena *seqs ) {
+    // header: number of taxa and alignment length
+    cptr_t header_end = line_end( begin, end );
+
+    std::istringstream header( std::string( begin, header_end ));
+    size_t num_taxa = 0;
+    size_t num_columns = 0;
+
+    header >> num_taxa >> num_columns;
+
+    if( header.fail() ) {
+        throw std::runtime_error( "bad phylip header" );
+    }
+
+    read_parallel( std::min( end, header_end + 1 ), end, n_threads, false, 0, names, seqs );
+
+    if( names->size() != num_taxa ) {
+        throw std::runtime_error( "number of sequences does not match the phylip header" );
+    }
+
+    for( size_t i = 0; i < seqs->size(); ++i ) {
+        if( seqs->length(i) != num_columns ) {
+            throw std::runtime_error( "sequence length does not match the phylip header: " + (*names)[i] );
+        }
+    }
+}
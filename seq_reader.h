@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) 2009-2012 Simon A. Berger
+ *
+ * This file is part of papara.
+ *
+ *  papara is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  papara is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with papara.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __seq_reader_h
+#define __seq_reader_h
+
+#include <cassert>
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+// Parallel readers for the input files (query fasta and reference phylip). The file is memory mapped (see mapped_file)
+// and split into one chunk per thread at record boundaries. Each thread parses its chunk twice: the first pass collects
+// the names and sequence lengths, the second pass copies the residues directly to their final position in a seq_arena.
+// The results are the same as those of read_fasta and multiple_alignment::load_phylip.
+
+namespace papara {
+
+// sequences stored back to back in one contiguous buffer (plus an offset table)
+class seq_arena {
+public:
+    seq_arena() : offsets_(1, 0) {}
+
+    size_t size() const {
+        return offsets_.size() - 1;
+    }
+
+    const uint8_t *begin( size_t i ) const {
+        assert( i < size() );
+        return data_.empty() ? 0 : &data_.front() + offsets_[i];
+    }
+
+    const uint8_t *end( size_t i ) const {
+        assert( i < size() );
+        return data_.empty() ? 0 : &data_.front() + offsets_[i+1];
+    }
+
+    size_t length( size_t i ) const {
+        assert( i < size() );
+        return offsets_[i+1] - offsets_[i];
+    }
+
+    size_t bytes() const {
+        return data_.size() + offsets_.size() * sizeof(size_t);
+    }
+
+    // sets up the arena for sequences of the given lengths and returns the (uninitialized) buffer
+    uint8_t *reset( const std::vector<size_t> &lengths );
+
+    template<typename iter>
+    void push_back( iter first, iter last ) {
+        data_.insert( data_.end(), first, last );
+        offsets_.push_back( data_.size() );
+    }
+
+    void reserve( size_t num_seqs, size_t num_bytes ) {
+        offsets_.reserve( num_seqs + 1 );
+        data_.reserve( num_bytes );
+    }
+
+    void clear();
+    void swap( seq_arena &other );
+
+private:
+    std::vector<uint8_t> data_;
+    std::vector<size_t> offsets_;
+};
+
+// optional transformation of the sequence names, which is done by the parser threads (e.g., queries::normalize_name)
+typedef void (*name_filter_t)( std::string & );
+
+// reads a fasta file. The residues are stored as they are (without whitespace). name_filter may be 0.
+void read_fasta_parallel( const char *name, size_t n_threads, name_filter_t name_filter, std::vector<std::string> *names, seq_arena *seqs );
+
+// same as above, for fasta records in memory
+void read_fasta_parallel( const uint8_t *begin, const uint8_t *end, size_t n_threads, name_filter_t name_filter, std::vector<std::string> *names, seq_arena *seqs );
+
+// reads a (sequential, one taxon per line) phylip file. Throws if the number or lengths of the sequences do not match the header.
+void read_phylip_parallel( const char *name, size_t n_threads, std::vector<std::string> *names, seq_arena *seqs );
+
+// same as above, for a phylip alignment in memory
+void read_phylip_parallel( const uint8_t *begin, const uint8_t *end, size_t n_threads, std::vector<std::string> *names, seq_arena *seqs );
+
+}
+
+#endif
@@ -25,6 +25,8 @@
 #include <ostream>
 #include <iterator>
 #include <cassert>
+#include <cmath>
+#include <algorithm>
 
 #include "ivymike/aligned_buffer.h"
 #include "ivymike/fasta.h"
@@ -608,71 +610,81 @@ public:
 
     template<typename mapf>
     pvec_aligner_vec( const int *seqptrs[W], const unsigned int *auxptrs[W], size_t reflen, const score_t match_score_sc, const score_t match_cgap_sc, const score_t gap_open_sc, const score_t gap_extend_sc, mapf map, size_t nstates )
-     : pvec_prof_( W * reflen ),
-       aux_prof_( W * reflen ),
-       sm_inc_prof_( W * reflen * nstates ),
+     : own_sm_inc_prof_( profile_size( reflen, nstates )),
+       sm_inc_prof_( own_sm_inc_prof_.base() ),
+       reflen_(reflen),
+       max_cell_scores_( W ),
+       end_tmp_( W ),
+       end_col_max_( W ),
+       end_row_max_( W ),
+       end_col_row_( W ),
+       end_row_col_( W ),
        num_cstates_(nstates),
        ticks_all_(0),
        inner_iters_all_(0)
-//       gap_open_cgap_prof_( W * reflen ),
-//       gap_extend_cgap_prof_( W * reflen )
-
     {
+        build_profile( seqptrs, auxptrs, reflen, match_score_sc, match_cgap_sc, map, nstates, own_sm_inc_prof_.base() );
+    }
 
+    // binds to a profile that was created by build_profile (e.g., one that is shared by all threads). The profile is
+    // not copied, so it must outlive the aligner. It must be aligned to the vector size.
+    pvec_aligner_vec( const score_t *sm_inc_prof, size_t reflen, size_t nstates )
+     : sm_inc_prof_( sm_inc_prof ),
+       reflen_(reflen),
+       max_cell_scores_( W ),
+       end_tmp_( W ),
+       end_col_max_( W ),
+       end_row_max_( W ),
+       end_col_row_( W ),
+       end_row_col_( W ),
+       num_cstates_(nstates),
+       ticks_all_(0),
+       inner_iters_all_(0)
+    {
+        assert( size_t(sm_inc_prof) % sizeof(vec_t) == 0 );
+    }
 
-        typename ivy_mike::aligned_buffer<score_t>::iterator it = pvec_prof_.begin();
-        typename ivy_mike::aligned_buffer<score_t>::iterator ait = aux_prof_.begin();
-//        typename aligned_buffer<score_t>::iterator oit = gap_open_cgap_prof_.begin();
-//        typename aligned_buffer<score_t>::iterator eit = gap_extend_cgap_prof_.begin();
-
-        for( size_t i = 0; i < reflen; ++i ) {
-            for( size_t j = 0; j < W; ++j ) {
-                *it = score_t(seqptrs[j][i]);
-                *ait = (auxptrs[j][i] == AUX_CGAP) ? score_t(-1) : 0;
-
-//                *oit = (auxptrs[j][i] == AUX_CGAP) ? 0 : gap_open_sc;
-//                *eit = (auxptrs[j][i] == AUX_CGAP) ? 0 : gap_extend_sc;
+    // number of elements of the profile for W sequences of length reflen
+    static size_t profile_size( size_t reflen, size_t nstates ) {
+        return W * reflen * nstates;
+    }
 
-                ++it;
-                ++ait;
-//                ++oit;
-//                ++eit;
-            }
-        }
+    // the profile contains the match score increment (match score plus match_cgap penalty) for each query state and each
+    // position of the W interleaved sequences, so that the inner loop only needs a single load per cell.
+    template<typename mapf>
+    static void build_profile( const int * const *seqptrs, const unsigned int * const *auxptrs, size_t reflen, const score_t match_score_sc, const score_t match_cgap_sc, mapf map, size_t nstates, score_t *sm_inc_prof ) {
+        assert( match_cgap_sc + match_score_sc < 0 );
 
-        assert( it == pvec_prof_.end() );
-        assert( ait == aux_prof_.end() );
+        score_t *it = sm_inc_prof;
 
-        assert( match_cgap_sc + match_score_sc < 0 );
-//        assert( W == 8 );
         for( size_t i = 0; i < nstates; i++ ) {
-            typename ivy_mike::aligned_buffer<score_t>::iterator it = sm_inc_prof_.begin() + i * reflen * W;
+            const score_t bc = map(i);
 
-            typename ivy_mike::aligned_buffer<score_t>::iterator pit = pvec_prof_.begin();
-            typename ivy_mike::aligned_buffer<score_t>::iterator ait = aux_prof_.begin();
-            score_t bc = map(i);
-            for( size_t j = 0; j < reflen * W; ++j, ++it, ++pit, ++ait ) {
-                bool match = (bc & *pit) != 0;
+            for( size_t j = 0; j < reflen; ++j ) {
+                for( size_t k = 0; k < W; ++k, ++it ) {
+                    const bool match = (bc & score_t(seqptrs[k][j])) != 0;
 
-                if( match ) {
-                    *it = match_score_sc;
-                } else {
-                    *it = 0;
-                }
+                    if( match ) {
+                        *it = match_score_sc;
+                    } else {
+                        *it = 0;
+                    }
 
-                if( *ait == score_t(-1) ) {
-                    *it += match_cgap_sc;
+                    if( auxptrs[k][j] == AUX_CGAP ) {
+                        *it += match_cgap_sc;
+                    }
                 }
-
             }
         }
 
-
+        assert( it == sm_inc_prof + profile_size( reflen, nstates ));
     }
 
 
+    // if out_ends is not 0, the positions (ref, query) of the best cells are written to out_ends (W elements). Ties are broken
+    // the same way as in align_freeshift_pvec, so that they can be used to seed the banded traceback.
     template<typename biter, typename oiter>
-    inline void align( biter b_start, biter b_end, const score_t match_score_sc, const score_t match_cgap_sc, const score_t gap_open_sc, const score_t gap_extend_sc, oiter out_start, size_t a_start_idx = -1, size_t a_end_idx = -1 ) {
+    inline void align( biter b_start, biter b_end, const score_t match_score_sc, const score_t match_cgap_sc, const score_t gap_open_sc, const score_t gap_extend_sc, oiter out_start, size_t a_start_idx = -1, size_t a_end_idx = -1, std::pair<int,int> *out_ends = 0 ) {
         typedef typename ivy_mike::aligned_buffer<score_t>::iterator aiter;
         
 //         aiter a_start, a_end, a_aux_start;
@@ -711,7 +723,7 @@ public:
             assert( a_start_idx == a_end_idx );
             
             a_start_idx = 0;
-            a_end_idx = pvec_prof_.size() / W;
+            a_end_idx = reflen_;
         }
    
 
@@ -722,7 +734,7 @@ public:
 
         
         // overall size of a whole row of vectors (=length of 'a' * vector width)
-        const size_t av_size_all = pvec_prof_.size();
+        const size_t av_size_all = reflen_ * W;
 //         const size_t a_size_all = av_size_all / W;
         const size_t block_width = 512;
 //         assert( av_size >= block_width * W ); // the code below should handle this case, but is untested
@@ -753,6 +765,14 @@ public:
 
 
         vec_t max_score = vu::set1(SMALL);
+        vec_t max_cell_score = vu::set1(SMALL);
+
+        if( out_ends != 0 ) {
+            std::fill( end_col_max_.begin(), end_col_max_.end(), SMALL );
+            std::fill( end_row_max_.begin(), end_row_max_.end(), SMALL );
+            std::fill( end_col_row_.begin(), end_col_row_.end(), -1 );
+            std::fill( end_row_col_.begin(), end_row_col_.end(), -1 );
+        }
 
         const vec_t zero = vu::setzero();
         const vec_t gap_extend = vu::set1(gap_extend_sc);
@@ -845,8 +865,8 @@ public:
                 score_t * si_iter = si_.base();
 //                score_t * __restrict a_aux_prof_iter = &(*(a_aux_start + block_start * W));
 //                score_t * __restrict a_aux_prof_end = &(*(a_aux_start + block_end * W));
-                score_t * sm_inc_iter = &(*(sm_inc_prof_.begin() + (*it_b) * av_size_all + block_start * W));
-                score_t * sm_inc_end = &(*(sm_inc_prof_.begin() + (*it_b) * av_size_all + block_end * W));
+                const score_t * sm_inc_iter = sm_inc_prof_ + (*it_b) * av_size_all + block_start * W;
+                const score_t * sm_inc_end = sm_inc_prof_ + (*it_b) * av_size_all + block_end * W;
 
 			
 
@@ -952,6 +972,39 @@ public:
                 if( lastrow ) {
                     max_score = vu::max( max_score, row_max_score );
                 }
+                max_cell_score = vu::max( max_cell_score, row_max_score );
+
+                if( out_ends != 0 ) {
+                    // in the last (empty) block, last_sc contains the last column. The last row is searched in s_ after each block
+                    // (only for the lanes where the block contains a new maximum, to keep this cheap).
+                    if( done && !lastrow ) {
+                        vu::store( last_sc, end_tmp_.base() );
+
+                        for( size_t l = 0; l < W; ++l ) {
+                            if( end_tmp_[l] > end_col_max_[l] ) {
+                                end_col_max_[l] = end_tmp_[l];
+                                end_col_row_[l] = int(std::distance( b_start, it_b ));
+                            }
+                        }
+                    }
+
+                    if( lastrow ) {
+                        vu::store( row_max_score, end_tmp_.base() );
+
+                        for( size_t l = 0; l < W; ++l ) {
+                            if( end_tmp_[l] > end_row_max_[l] ) {
+                                size_t j = 0;
+                                while( s_[j * W + l] != end_tmp_[l] ) {
+                                    ++j;
+                                }
+                                assert( block_start + j < block_end );
+
+                                end_row_max_[l] = end_tmp_[l];
+                                end_row_col_[l] = int(block_start + j);
+                            }
+                        }
+                    }
+                }
 
                 //*it_block = block;
 
@@ -972,8 +1025,26 @@ public:
         //
 
         vu::store( max_score, &(*out_start) );
+        vu::store( max_cell_score, max_cell_scores_.base() );
+
+        if( out_ends != 0 ) {
+            for( size_t l = 0; l < W; ++l ) {
+                if( end_row_max_[l] > end_col_max_[l] ) {
+                    out_ends[l] = std::make_pair( end_row_col_[l], int(bsize) - 1 );
+                } else if( end_col_row_[l] != -1 ) {
+                    out_ends[l] = std::make_pair( int(a_end_idx) - 1, end_col_row_[l] );
+                } else {
+                    out_ends[l] = std::make_pair( -1, -1 );
+                }
+            }
+        }
     }
 
+    // maximum score of all cells in the last call to align (not only the ones in the last row/column). Used to
+    // detect overflows when scoring with saturating 8bit arithmetic.
+    const score_t *max_cell_scores() const {
+        return max_cell_scores_.base();
+    }
 
     double ticks_per_inner_iter() {
         return ticks_all_ / double(inner_iters_all_);
@@ -997,9 +1068,20 @@ private:
     ivy_mike::aligned_buffer<score_t> s_;
     ivy_mike::aligned_buffer<score_t> si_;
 
-    ivy_mike::aligned_buffer<score_t> pvec_prof_;
-    ivy_mike::aligned_buffer<score_t> aux_prof_;
-    ivy_mike::aligned_buffer<score_t> sm_inc_prof_;
+    // the profile is either owned by the aligner, or a shared one (see build_profile)
+    ivy_mike::aligned_buffer<score_t> own_sm_inc_prof_;
+    const score_t *sm_inc_prof_;
+    const size_t reflen_;
+
+    ivy_mike::aligned_buffer<score_t> max_cell_scores_;
+
+    // temporary state for tracking the positions of the best cells
+    ivy_mike::aligned_buffer<score_t> end_tmp_;
+    std::vector<score_t> end_col_max_;
+    std::vector<score_t> end_row_max_;
+    std::vector<int> end_col_row_;
+    std::vector<int> end_row_col_;
+
     const size_t num_cstates_;
 
     uint64_t ticks_all_;
@@ -1027,185 +1109,293 @@ private:
 
 template<typename score_t>
 struct align_arrays_traceback {
+    // above this number of cells (=bytes), align_freeshift_pvec does not keep the full traceback matrix but
+    // uses checkpoints instead (see align_freeshift_pvec_checkpointed).
+    const static size_t default_max_tb_size = size_t(256) * 1024 * 1024;
+
+    align_arrays_traceback() : max_tb_size( default_max_tb_size ) {}
+
     ivy_mike::aligned_buffer<score_t> s;
     ivy_mike::aligned_buffer<score_t> si;  
     
     std::vector<uint8_t> tb;
-};
 
+    // checkpoints of s/si (only used by the checkpointed traceback)
+    std::vector<score_t> cp;
 
-template<typename score_t, typename aiter, typename auxiter, typename biter>
-score_t align_freeshift_pvec( aiter astart, aiter aend, auxiter auxstart, biter bstart, biter bend, score_t match_score, score_t match_cgap, score_t gap_open, score_t gap_extend, std::vector<uint8_t>& tb_out, align_arrays_traceback<score_t> &arr ) {
+    // upper bounds of s/si (only used by the banded traceback)
+    std::vector<score_t> s_hi;
+    std::vector<score_t> si_hi;
 
-    const uint8_t b_sl_stay = 0x1;
-    const uint8_t b_su_stay = 0x2;
-    const uint8_t b_s_l = 0x4;
-    const uint8_t b_s_u = 0x8;
+    size_t max_tb_size;
+};
 
+// bits in the freeshift traceback matrix. The *_amb bits are only set by the banded alignment: the decision of the
+// cell (s_l/s_u, sl_stay or su_stay) could be different in the full matrix.
+struct freeshift_tb_bits {
+    const static uint8_t sl_stay = 0x1;
+    const static uint8_t su_stay = 0x2;
+    const static uint8_t s_l = 0x4;
+    const static uint8_t s_u = 0x8;
+    const static uint8_t s_amb = 0x10;
+    const static uint8_t sl_amb = 0x20;
+    const static uint8_t su_amb = 0x40;
+};
 
-    const size_t asize = std::distance(astart, aend);
-    const size_t bsize = std::distance(bstart, bend);
+// row-major (query positions) view of (a part of) the traceback matrix, starting at column col0 and row row0
+class freeshift_tb_matrix {
+public:
+    freeshift_tb_matrix( const uint8_t *base, size_t asize, size_t col0, size_t row0, size_t num_rows ) : base_(base), asize_(asize), col0_(col0), row0_(row0), num_rows_(num_rows) {}
 
-    if( arr.s.size() < asize  ) {
-        arr.s.resize( asize );
-        arr.si.resize( asize );
+    uint8_t operator()( size_t ia, size_t ib ) const {
+        assert( ia >= col0_ && ia < col0_ + asize_ );
+        assert( ib >= row0_ && ib < row0_ + num_rows_ );
+
+        return base_[(ib - row0_) * asize_ + (ia - col0_)];
     }
 
-    std::fill( arr.s.begin(), arr.s.end(), 0 );
-    std::fill( arr.si.begin(), arr.si.end(), 0 );
+private:
+    const uint8_t *base_;
+    const size_t asize_;
+    const size_t col0_;
+    const size_t row0_;
+    const size_t num_rows_;
+};
+
+
+// one row (=query position ib) of the freeshift alignment. s and si contain the state of the previous row and are updated in place.
+// If store_tb is true, the traceback bits of the row are written to tb_row.
+// left_sc and left_sdiag are the main-cell scores left of astart in this and the previous row (0 at the start of the
+// reference, where the query may start with free gaps).
+template<bool store_tb, typename score_t, typename aiter, typename auxiter>
+inline void align_freeshift_pvec_row( aiter astart, auxiter auxstart, size_t asize, int bc, size_t ib, bool lastrow, score_t match_score, score_t match_cgap, score_t gap_open, score_t gap_extend,
+                                      score_t * __restrict s_iter, score_t * __restrict si_iter, uint8_t *tb_row, score_t &max_score, int &max_a, int &max_b, score_t left_sc = 0, score_t left_sdiag = 0 ) {
+
     const score_t SMALL = -32000;
 
-    score_t max_score = SMALL;
-    int max_a = 0;
-    int max_b = 0;
+    score_t last_sl = SMALL;
+    score_t last_sc = left_sc;
+    score_t last_sdiag = left_sdiag;
 
-    arr.tb.resize( asize * bsize );
+    for( size_t ia = 0; ia < asize; ++ia, ++s_iter, ++si_iter ) {
+        //score_t match = sm.get_score( a[ia], bc );
+        uint8_t tb_val = 0;
+        int ac = *(astart + ia);
+        const bool cgap = *(auxstart + ia)  == AUX_CGAP;
 
+            // determine match or mis-match according to parsimony bits coming from the tree.
+        score_t match = ( ac & bc ) != 0 ? match_score : 0;
 
-    struct index_calc {
-        const size_t as, bs;
-        index_calc( size_t as_, size_t bs_ ) : as(as_), bs(bs_) {}
 
-        size_t operator()(size_t ia, size_t ib ) {
-            assert( ia < as );
-            assert( ib < bs );
 
-            //return ia * bs + ib;
-            return ib * as + ia;
-        }
+        score_t sm = last_sdiag + match;
 
-    };
+        last_sdiag = *s_iter;
 
-    index_calc ic( asize, bsize );
+        score_t last_sc_OPEN;
+        score_t sl_score_stay;
 
+        if( cgap ) {
+            last_sc_OPEN = last_sc;
+            sl_score_stay = last_sl;
+            sm += match_cgap;
+        } else {
+            last_sc_OPEN = last_sc + gap_open;
+            sl_score_stay = last_sl + gap_extend;
+        }
 
-    for( size_t ib = 0; ib < bsize; ib++ ) {
-        int bc = *(bstart + ib);
+        score_t sl;
+        if( sl_score_stay > last_sc_OPEN ) {
+            sl = sl_score_stay;
+            tb_val |= freeshift_tb_bits::sl_stay;
+        } else {
+            sl = last_sc_OPEN;
+        }
 
-        score_t last_sl = SMALL;
-        score_t last_sc = score_t(0.0);
-        score_t last_sdiag = score_t(0.0);
+        last_sl = sl;
 
-        score_t * __restrict s_iter = arr.s.base();
-        score_t * __restrict si_iter = arr.si.base();
-        score_t * __restrict s_end = s_iter + asize;
-        bool lastrow = ib == (bsize - 1);
 
-        //for( ; s_iter != s_end; s_iter += W, si_iter += W, qpp_iter += W ) {
+        score_t su_gap_open = last_sdiag + gap_open;
+        score_t su_GAP_EXTEND = *si_iter + gap_extend;
 
-        for( size_t ia = 0; ia < asize; ++ia, ++s_iter, ++si_iter ) {
-            //score_t match = sm.get_score( a[ia], bc );
-            uint8_t tb_val = 0;
-            int ac = *(astart + ia);
-            const bool cgap = *(auxstart + ia)  == AUX_CGAP;
+        score_t su;// = max( su_GAP_EXTEND,  );
+        if( su_GAP_EXTEND > su_gap_open ) {
+            su = su_GAP_EXTEND;
+            tb_val |= freeshift_tb_bits::su_stay;
+        } else {
+            su = su_gap_open;
+        }
 
-                // determine match or mis-match according to parsimony bits coming from the tree.
-            score_t match = ( ac & bc ) != 0 ? match_score : 0;
 
+        *si_iter = su;
 
+        score_t sc;
+        if( (su > sl) && su > sm ) {
+            sc = su;
+            tb_val |= freeshift_tb_bits::s_u;
+        } else if( ( sl >= su ) && sl > sm ) {
+            sc = sl;
+            tb_val |= freeshift_tb_bits::s_l;
+        } else { // implicit: sm_zero > sl && sm_zero > su
+            sc = sm;
+        }
 
-            score_t sm = last_sdiag + match;
 
-            last_sdiag = *s_iter;
+        last_sc = sc;
+        *s_iter = sc;
 
-            score_t last_sc_OPEN;
-            score_t sl_score_stay;
+        if( store_tb ) {
+            tb_row[ia] = tb_val;
+        }
 
-            if( cgap ) {
-                last_sc_OPEN = last_sc;
-                sl_score_stay = last_sl;
-                sm += match_cgap;
-            } else {
-                last_sc_OPEN = last_sc + gap_open;
-                sl_score_stay = last_sl + gap_extend;
+        if( ia == asize - 1 || lastrow ) {
+            if( sc > max_score ) {
+                max_a = int(ia);
+                max_b = int(ib);
+                max_score = sc;
             }
 
-            score_t sl;
-            if( sl_score_stay > last_sc_OPEN ) {
-                sl = sl_score_stay;
-                //arr.sl_stay[ic(ia,ib)] = true;
-                tb_val |= b_sl_stay;
-            } else {
-                sl = last_sc_OPEN;
-            }
 
-            last_sl = sl;
+        }
+    }
+}
 
+// one row of the banded freeshift alignment (see align_freeshift_pvec_banded). The row is calculated twice: the lower
+// bound (s_lo/si_lo) with the cells left of the band as -infinity, which is what align_freeshift_pvec_row would calculate,
+// and the upper bound (s_hi/si_hi) with the cells left of the band at an upper bound of their score (left_*_hi). The
+// scores in the full matrix are in between. The traceback bits are the ones of the lower bound. A decision is marked as
+// ambiguous if its outcome is not the same for all scores between the bounds.
+template<typename score_t, typename aiter, typename auxiter>
+inline void align_freeshift_pvec_row_bounded( aiter astart, auxiter auxstart, size_t asize, int bc, score_t match_score, score_t match_cgap, score_t gap_open, score_t gap_extend,
+                                              score_t * __restrict s_lo, score_t * __restrict si_lo, score_t * __restrict s_hi, score_t * __restrict si_hi, uint8_t *tb_row,
+                                              score_t left_sc_lo, score_t left_sdiag_lo, score_t left_sl_hi, score_t left_sc_hi, score_t left_sdiag_hi ) {
 
-            score_t su_gap_open = last_sdiag + gap_open;
-            score_t su_GAP_EXTEND = *si_iter + gap_extend;
+    const score_t SMALL = -32000;
 
-            score_t su;// = max( su_GAP_EXTEND,  );
-            if( su_GAP_EXTEND > su_gap_open ) {
-                su = su_GAP_EXTEND;
-                //arr.su_stay[ic(ia,ib)] = true;
-                tb_val |= b_su_stay;
-            } else {
-                su = su_gap_open;
-            }
+    score_t last_sl_lo = SMALL;
+    score_t last_sc_lo = left_sc_lo;
+    score_t last_sdiag_lo = left_sdiag_lo;
 
+    score_t last_sl_hi = left_sl_hi;
+    score_t last_sc_hi = left_sc_hi;
+    score_t last_sdiag_hi = left_sdiag_hi;
 
-            *si_iter = su;
+    for( size_t ia = 0; ia < asize; ++ia ) {
+        uint8_t tb_val = 0;
+        const int ac = *(astart + ia);
+        const bool cgap = *(auxstart + ia)  == AUX_CGAP;
 
-            score_t sc;
-            if( (su > sl) && su > sm ) {
-                sc = su;
-                //arr.s_u[ic(ia,ib)] = true;
-                tb_val |= b_s_u;
-            } else if( ( sl >= su ) && sl > sm ) {
-                sc = sl;
-                //arr.s_l[ic(ia,ib)] = true;
-                tb_val |= b_s_l;
-            } else { // implicit: sm_zero > sl && sm_zero > su
-                sc = sm;
+        const score_t match = (( ac & bc ) != 0 ? match_score : 0) + (cgap ? match_cgap : 0);
+        const score_t open = cgap ? 0 : gap_open;
+        const score_t extend = cgap ? 0 : gap_extend;
+
+        const score_t sm_lo = last_sdiag_lo + match;
+        const score_t sm_hi = last_sdiag_hi + match;
+
+        last_sdiag_lo = s_lo[ia];
+        last_sdiag_hi = s_hi[ia];
+
+        // horizontal gap
+        const score_t sl_stay_lo = last_sl_lo + extend;
+        const score_t sl_stay_hi = last_sl_hi + extend;
+        const score_t sl_open_lo = last_sc_lo + open;
+        const score_t sl_open_hi = last_sc_hi + open;
+
+        if( sl_stay_lo > sl_open_lo ) {
+            tb_val |= freeshift_tb_bits::sl_stay;
+            last_sl_lo = sl_stay_lo;
+
+            if( sl_stay_lo <= sl_open_hi ) {
+                tb_val |= freeshift_tb_bits::sl_amb;
             }
+        } else {
+            last_sl_lo = sl_open_lo;
 
+            if( sl_open_lo < sl_stay_hi ) {
+                tb_val |= freeshift_tb_bits::sl_amb;
+            }
+        }
 
-            last_sc = sc;
-            *s_iter = sc;
-            arr.tb[ic(ia,ib)] = tb_val;
+        last_sl_hi = std::max( sl_stay_hi, sl_open_hi );
 
-            if( s_iter == s_end - 1 || lastrow ) {
-                if( sc > max_score ) {
-                    max_a = int(ia);
-                    max_b = int(ib);
-                    max_score = sc;
-                }
+        // vertical gap
+        const score_t su_stay_lo = si_lo[ia] + gap_extend;
+        const score_t su_stay_hi = si_hi[ia] + gap_extend;
+        const score_t su_open_lo = last_sdiag_lo + gap_open;
+        const score_t su_open_hi = last_sdiag_hi + gap_open;
 
+        if( su_stay_lo > su_open_lo ) {
+            tb_val |= freeshift_tb_bits::su_stay;
+            si_lo[ia] = su_stay_lo;
 
+            if( su_stay_lo <= su_open_hi ) {
+                tb_val |= freeshift_tb_bits::su_amb;
+            }
+        } else {
+            si_lo[ia] = su_open_lo;
+
+            if( su_open_lo < su_stay_hi ) {
+                tb_val |= freeshift_tb_bits::su_amb;
             }
         }
 
-    }
+        si_hi[ia] = std::max( su_stay_hi, su_open_hi );
 
-//    std::cout << "max score: " << max_score << "\n";
-//    std::cout << "max " << max_a << " " << max_b << "\n";
+        // main cell: same priorities as in align_freeshift_pvec_row (sm before sl before su on ties)
+        const score_t sl_lo = last_sl_lo;
+        const score_t su_lo = si_lo[ia];
+        const score_t sl_hi = last_sl_hi;
+        const score_t su_hi = si_hi[ia];
 
-	
-    ptrdiff_t ia = asize - 1;
-    ptrdiff_t ib = bsize - 1;
+        score_t sc_lo;
+        if( (su_lo > sl_lo) && su_lo > sm_lo ) {
+            sc_lo = su_lo;
+            tb_val |= freeshift_tb_bits::s_u;
 
-    assert( ia == max_a || ib == max_b );
+            if( su_lo <= sl_hi || su_lo <= sm_hi ) {
+                tb_val |= freeshift_tb_bits::s_amb;
+            }
+        } else if( ( sl_lo >= su_lo ) && sl_lo > sm_lo ) {
+            sc_lo = sl_lo;
+            tb_val |= freeshift_tb_bits::s_l;
 
-    bool in_l = false;
-    bool in_u = false;
+            if( sl_lo < su_hi || sl_lo <= sm_hi ) {
+                tb_val |= freeshift_tb_bits::s_amb;
+            }
+        } else {
+            sc_lo = sm_lo;
 
-    while( ia > max_a ) {
-        tb_out.push_back(1);
-        --ia;
-    }
+            if( sm_lo < su_hi || sm_lo < sl_hi ) {
+                tb_val |= freeshift_tb_bits::s_amb;
+            }
+        }
 
-    while( ib > max_b ) {
-        tb_out.push_back(2);
-        --ib;
+        last_sc_lo = sc_lo;
+        s_lo[ia] = sc_lo;
+
+        last_sc_hi = std::max( sm_hi, std::max( sl_hi, su_hi ));
+        s_hi[ia] = last_sc_hi;
+
+        tb_row[ia] = tb_val;
     }
+}
 
-    while( ia >= 0 && ib >= 0 ) {
-        size_t c = ic( ia, ib );
+// follows the traceback from (ia,ib) until ia drops below ia_stop or ib drops below ib_stop (i.e., leaves the
+// part of the matrix covered by tb). The traceback state is kept in ia/ib/in_l/in_u, so that it can be continued.
+// Returns false if the traceback used a decision that is marked as ambiguous (see freeshift_tb_bits).
+inline bool align_freeshift_pvec_traceback( const freeshift_tb_matrix &tb, ptrdiff_t &ia, ptrdiff_t &ib, ptrdiff_t ia_stop, ptrdiff_t ib_stop, bool &in_l, bool &in_u, std::vector<uint8_t>& tb_out ) {
+    bool unambiguous = true;
+
+    while( ia >= ia_stop && ib >= ib_stop ) {
+        const uint8_t c = tb( ia, ib );
 
         if( !in_l && !in_u ) {
-            in_l = (arr.tb[c] & b_s_l) != 0;
-            in_u = (arr.tb[c] & b_s_u) != 0;
+            if( (c & freeshift_tb_bits::s_amb) != 0 ) {
+                unambiguous = false;
+            }
+
+            in_l = (c & freeshift_tb_bits::s_l) != 0;
+            in_u = (c & freeshift_tb_bits::s_u) != 0;
 
             if( !in_l && !in_u ) {
                 tb_out.push_back(0);
@@ -1216,20 +1406,34 @@ score_t align_freeshift_pvec( aiter astart, aiter aend, auxiter auxstart, biter
         }
 
         if( in_u ) {
+            if( (c & freeshift_tb_bits::su_amb) != 0 ) {
+                unambiguous = false;
+            }
+
             tb_out.push_back(2);
             --ib;
 
-            in_u = (arr.tb[c] & b_su_stay) != 0;
+            in_u = (c & freeshift_tb_bits::su_stay) != 0;
         } else if( in_l ) {
+            if( (c & freeshift_tb_bits::sl_amb) != 0 ) {
+                unambiguous = false;
+            }
+
             tb_out.push_back(1);
             --ia;
 
-            in_l = (arr.tb[c] & b_sl_stay) != 0;
+            in_l = (c & freeshift_tb_bits::sl_stay) != 0;
         }
 
 
     }
 
+    return unambiguous;
+}
+
+// the part of the traceback that is outside of the DP matrix: from the corner to the best cell and from the
+// first row/column to the origin.
+inline void align_freeshift_pvec_tb_tail( ptrdiff_t ia, ptrdiff_t ib, std::vector<uint8_t>& tb_out ) {
     while( ia >= 0 ) {
         tb_out.push_back(1);
         --ia;
@@ -1239,9 +1443,254 @@ score_t align_freeshift_pvec( aiter astart, aiter aend, auxiter auxstart, biter
         tb_out.push_back(2);
         --ib;
     }
+}
+
+inline void align_freeshift_pvec_tb_head( ptrdiff_t &ia, ptrdiff_t &ib, int max_a, int max_b, std::vector<uint8_t>& tb_out ) {
+    assert( ia == max_a || ib == max_b );
+
+    while( ia > max_a ) {
+        tb_out.push_back(1);
+        --ia;
+    }
+
+    while( ib > max_b ) {
+        tb_out.push_back(2);
+        --ib;
+    }
+}
+
+// Checkpointed version of align_freeshift_pvec for large matrices: the forward pass only keeps the s/si rows at every
+// k-th query position (k ~ sqrt(bsize)). The traceback then recomputes the traceback matrix segment by segment, starting
+// with the last one. This needs O(asize * sqrt(bsize)) memory instead of O(asize * bsize), at the cost of a second pass over
+// the matrix. The recomputed rows are bit-identical, so the result is exactly the same as for the full matrix.
+template<typename score_t, typename aiter, typename auxiter, typename biter>
+score_t align_freeshift_pvec_checkpointed( aiter astart, aiter aend, auxiter auxstart, biter bstart, biter bend, score_t match_score, score_t match_cgap, score_t gap_open, score_t gap_extend, std::vector<uint8_t>& tb_out, align_arrays_traceback<score_t> &arr ) {
+    const size_t asize = std::distance(astart, aend);
+    const size_t bsize = std::distance(bstart, bend);
+
+    const score_t SMALL = -32000;
+
+    score_t max_score = SMALL;
+    int max_a = 0;
+    int max_b = 0;
+
+    if( arr.s.size() < asize  ) {
+        arr.s.resize( asize );
+        arr.si.resize( asize );
+    }
+
+    std::fill( arr.s.begin(), arr.s.end(), 0 );
+    std::fill( arr.si.begin(), arr.si.end(), 0 );
+
+    const size_t seg_size = std::max( size_t(1), size_t(std::sqrt( double(bsize) )));
+    const size_t num_segs = (bsize + seg_size - 1) / seg_size;
+
+    // checkpoint i: s and si before row i * seg_size
+    arr.cp.resize( num_segs * 2 * asize );
+
+    for( size_t ib = 0; ib < bsize; ib++ ) {
+        if( ib % seg_size == 0 ) {
+            typename std::vector<score_t>::iterator cp = arr.cp.begin() + (ib / seg_size) * 2 * asize;
+            std::copy( arr.s.base(), arr.s.base() + asize, cp );
+            std::copy( arr.si.base(), arr.si.base() + asize, cp + asize );
+        }
+
+        align_freeshift_pvec_row<false>( astart, auxstart, asize, int(*(bstart + ib)), ib, ib == (bsize - 1), match_score, match_cgap, gap_open, gap_extend, arr.s.base(), arr.si.base(), (uint8_t *)0, max_score, max_a, max_b );
+    }
+
+    ptrdiff_t ia = asize - 1;
+    ptrdiff_t ib = bsize - 1;
+
+    align_freeshift_pvec_tb_head( ia, ib, max_a, max_b, tb_out );
+
+    bool in_l = false;
+    bool in_u = false;
+
+    arr.tb.resize( seg_size * asize );
+
+    for( ptrdiff_t seg = ptrdiff_t(num_segs) - 1; seg >= 0 && ia >= 0 && ib >= 0; --seg ) {
+        const size_t row0 = seg * seg_size;
+
+        if( ptrdiff_t(row0) > ib ) {
+            continue;
+        }
+
+        // recompute the traceback matrix for the rows [row0,ib]
+        typename std::vector<score_t>::iterator cp = arr.cp.begin() + seg * 2 * asize;
+        std::copy( cp, cp + asize, arr.s.base() );
+        std::copy( cp + asize, cp + 2 * asize, arr.si.base() );
+
+        score_t dummy_max = SMALL;
+        int dummy_a = 0;
+        int dummy_b = 0;
+        for( size_t r = row0; r <= size_t(ib); ++r ) {
+            align_freeshift_pvec_row<true>( astart, auxstart, asize, int(*(bstart + r)), r, false, match_score, match_cgap, gap_open, gap_extend, arr.s.base(), arr.si.base(), &arr.tb[(r - row0) * asize], dummy_max, dummy_a, dummy_b );
+        }
+
+        const freeshift_tb_matrix tb( &arr.tb.front(), asize, 0, row0, ib - row0 + 1 );
+        align_freeshift_pvec_traceback( tb, ia, ib, 0, row0, in_l, in_u, tb_out );
+    }
+
+    align_freeshift_pvec_tb_tail( ia, ib, tb_out );
+
+    return max_score;
+}
+
+template<typename score_t, typename aiter, typename auxiter, typename biter>
+score_t align_freeshift_pvec( aiter astart, aiter aend, auxiter auxstart, biter bstart, biter bend, score_t match_score, score_t match_cgap, score_t gap_open, score_t gap_extend, std::vector<uint8_t>& tb_out, align_arrays_traceback<score_t> &arr ) {
+
+    const size_t asize = std::distance(astart, aend);
+    const size_t bsize = std::distance(bstart, bend);
+
+    if( asize * bsize > arr.max_tb_size ) {
+        return align_freeshift_pvec_checkpointed( astart, aend, auxstart, bstart, bend, match_score, match_cgap, gap_open, gap_extend, tb_out, arr );
+    }
+
+    if( arr.s.size() < asize  ) {
+        arr.s.resize( asize );
+        arr.si.resize( asize );
+    }
+
+    std::fill( arr.s.begin(), arr.s.end(), 0 );
+    std::fill( arr.si.begin(), arr.si.end(), 0 );
+    const score_t SMALL = -32000;
+
+    score_t max_score = SMALL;
+    int max_a = 0;
+    int max_b = 0;
+
+    arr.tb.resize( asize * bsize );
+
+    for( size_t ib = 0; ib < bsize; ib++ ) {
+        align_freeshift_pvec_row<true>( astart, auxstart, asize, int(*(bstart + ib)), ib, ib == (bsize - 1), match_score, match_cgap, gap_open, gap_extend, arr.s.base(), arr.si.base(), &arr.tb[ib * asize], max_score, max_a, max_b );
+    }
+
+//    std::cout << "max score: " << max_score << "\n";
+//    std::cout << "max " << max_a << " " << max_b << "\n";
+
+	
+    ptrdiff_t ia = asize - 1;
+    ptrdiff_t ib = bsize - 1;
+
+    align_freeshift_pvec_tb_head( ia, ib, max_a, max_b, tb_out );
+
+    bool in_l = false;
+    bool in_u = false;
+
+    if( !arr.tb.empty() ) {
+        const freeshift_tb_matrix tb( &arr.tb.front(), asize, 0, 0, bsize );
+        align_freeshift_pvec_traceback( tb, ia, ib, 0, 0, in_l, in_u, tb_out );
+    }
+
+    align_freeshift_pvec_tb_tail( ia, ib, tb_out );
+
     return max_score;
 }
 
+// Banded version of align_freeshift_pvec, for the case that the score and the end cell (end_a,end_b) of the best alignment
+// are already known (i.e., from the vectorized score pass): only the columns [a_lo,end_a] of the rows [0,end_b] are filled,
+// where a_lo is chosen so that the band contains end_b + 1 + 'band' non-cgap reference columns. The cells left of the band
+// are treated as -infinity (except at the start of the reference), so that the band only contains valid alignments.
+// If the score of the end cell is not the expected one, the best alignment does not fit into the band, and the band
+// is widened. As a last resort (or if the end cell is not plausible), the full matrix is used.
+// A co-optimal alignment that leaves the band can still change the tie-breaking of the traceback. So each row is
+// also calculated with the cells left of the band at an upper bound of their score (see align_freeshift_pvec_row_bounded),
+// and the banded traceback is only used if none of its decisions could be different in the full matrix. This way the
+// result is always the same as the one of align_freeshift_pvec.
+template<typename score_t, typename aiter, typename auxiter, typename biter>
+score_t align_freeshift_pvec_banded( aiter astart, aiter aend, auxiter auxstart, biter bstart, biter bend, score_t match_score, score_t match_cgap, score_t gap_open, score_t gap_extend,
+                                     score_t expected_score, int end_a, int end_b, std::vector<uint8_t>& tb_out, align_arrays_traceback<score_t> &arr ) {
+    const size_t asize = std::distance(astart, aend);
+    const size_t bsize = std::distance(bstart, bend);
+
+    const score_t SMALL = -32000;
+
+    // the best cell is always in the last row or the last column
+    const bool end_valid = end_a >= 0 && end_b >= 0 && size_t(end_a) < asize && size_t(end_b) < bsize && (size_t(end_a) == asize - 1 || size_t(end_b) == bsize - 1);
+
+    // upper bound of the score gained per query position. Only valid if gaps never increase the score.
+    const score_t row_gain = std::max( score_t(0), match_score ) + std::max( score_t(0), match_cgap );
+    const bool bound_valid = gap_open <= 0 && gap_extend <= 0;
+
+    const size_t tb_out_size = tb_out.size();
+
+    for( size_t band = 16 + bsize / 8; end_valid && bound_valid; band *= 4 ) {
+        size_t a_lo = end_a;
+        size_t num_cols = *(auxstart + a_lo) == AUX_CGAP ? 0 : 1;
+
+        while( a_lo > 0 && num_cols < size_t(end_b) + 1 + band ) {
+            --a_lo;
+
+            if( *(auxstart + a_lo) != AUX_CGAP ) {
+                ++num_cols;
+            }
+        }
+
+        const size_t width = end_a - a_lo + 1;
+        const size_t height = end_b + 1;
+
+        if( width * height > arr.max_tb_size ) {
+            break;
+        }
+
+        if( arr.s.size() < width  ) {
+            arr.s.resize( width );
+            arr.si.resize( width );
+        }
+
+        std::fill( arr.s.begin(), arr.s.end(), 0 );
+        std::fill( arr.si.begin(), arr.si.end(), 0 );
+
+        arr.s_hi.assign( width, 0 );
+        arr.si_hi.assign( width, 0 );
+
+        arr.tb.resize( width * height );
+
+        // at the start of the reference the usual free-shift boundary applies
+        const bool free_left = a_lo == 0;
+
+        for( size_t ib = 0; ib < height; ++ib ) {
+            const score_t left_sc = free_left ? 0 : SMALL;
+            const score_t left_sdiag = (free_left || ib == 0) ? 0 : SMALL;
+
+            // no alignment of the first ib + 1 query positions scores more than (ib + 1) * row_gain
+            const score_t left_sl_hi = free_left ? SMALL : score_t((ib + 1) * row_gain);
+            const score_t left_sc_hi = free_left ? 0 : score_t((ib + 1) * row_gain);
+            const score_t left_sdiag_hi = (free_left || ib == 0) ? 0 : score_t(ib * row_gain);
+
+            align_freeshift_pvec_row_bounded( astart + a_lo, auxstart + a_lo, width, int(*(bstart + ib)), match_score, match_cgap, gap_open, gap_extend,
+                                              arr.s.base(), arr.si.base(), &arr.s_hi.front(), &arr.si_hi.front(), &arr.tb[ib * width], left_sc, left_sdiag, left_sl_hi, left_sc_hi, left_sdiag_hi );
+        }
+
+        if( arr.s.base()[width - 1] == expected_score ) {
+            ptrdiff_t ia = asize - 1;
+            ptrdiff_t ib = bsize - 1;
+
+            align_freeshift_pvec_tb_head( ia, ib, end_a, end_b, tb_out );
+
+            bool in_l = false;
+            bool in_u = false;
+
+            const freeshift_tb_matrix tb( &arr.tb.front(), width, a_lo, 0, height );
+            const bool unambiguous = align_freeshift_pvec_traceback( tb, ia, ib, a_lo, 0, in_l, in_u, tb_out );
+
+            // a valid traceback leaves the band through the first row (or the start of the reference)
+            if( unambiguous && (ib < 0 || ia < 0) ) {
+                align_freeshift_pvec_tb_tail( ia, ib, tb_out );
+                return expected_score;
+            }
+
+            tb_out.resize( tb_out_size );
+        }
+
+        if( a_lo == 0 ) {
+            break;
+        }
+    }
+
+    return align_freeshift_pvec( astart, aend, auxstart, bstart, bend, match_score, match_cgap, gap_open, gap_extend, tb_out, arr );
+}
+
 // backward compatibility wrapper
 template<typename score_t, typename state_t>
 inline score_t align_freeshift_pvec( std::vector<state_t> &a, std::vector<state_t> &a_aux, std::vector<state_t> &b, score_t match_score, score_t match_cgap, score_t gap_open, score_t gap_extend, std::vector<uint8_t>& tb_out, align_arrays_traceback<score_t> &arr ) {
@@ -0,0 +1,211 @@
+/*
+ * Copyright (C) 2009-2012 Simon A. Berger
+ *
+ * This file is part of papara.
+ *
+ *  papara is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  papara is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with papara.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cassert>
+#include <stdexcept>
+
+#include "tree_search.h"
+
+namespace {
+
+const uint32_t no_edge = uint32_t(-1);
+
+}
+
+papara::clade_hierarchy::clade_hierarchy( const std::vector<std::pair<uint32_t,uint32_t> > &edges, size_t fanout, size_t leaf_size )
+  : fanout_(fanout),
+    leaf_size_(leaf_size),
+    parent_(edges.size(), no_edge),
+    local_pos_(edges.size(), no_edge),
+    order_(edges.size(), 0),
+    next_order_(0),
+    depth_(0)
+{
+    if( fanout_ < 2 || leaf_size_ < 1 ) {
+        throw std::runtime_error( "clade_hierarchy: fanout must be >= 2 and leaf_size >= 1" );
+    }
+
+    if( edges.empty() ) {
+        reps_.push_back( 0 );
+        children_.push_back( std::vector<uint32_t>() );
+        return;
+    }
+
+    //
+    // adjacency lists of the nodes
+    //
+    uint32_t num_nodes = 0;
+    for( size_t i = 0; i < edges.size(); ++i ) {
+        num_nodes = std::max( num_nodes, std::max( edges[i].first, edges[i].second ) + 1 );
+    }
+
+    std::vector<size_t> adj_offsets( num_nodes + 1, 0 );
+    for( size_t i = 0; i < edges.size(); ++i ) {
+        ++adj_offsets[edges[i].first + 1];
+        ++adj_offsets[edges[i].second + 1];
+    }
+
+    for( size_t v = 1; v < adj_offsets.size(); ++v ) {
+        adj_offsets[v] += adj_offsets[v - 1];
+    }
+
+    std::vector<uint32_t> adj( adj_offsets.back() );
+    {
+        std::vector<size_t> pos( adj_offsets.begin(), adj_offsets.end() - 1 );
+
+        for( size_t i = 0; i < edges.size(); ++i ) {
+            adj[pos[edges[i].first]++] = uint32_t(i);
+            adj[pos[edges[i].second]++] = uint32_t(i);
+        }
+    }
+
+    //
+    // root the tree at an inner node and collect the edges in preorder, i.e., each edge after the edge above it and
+    // the edges of each subtree contiguously
+    //
+    uint32_t root = edges.front().first;
+    for( uint32_t v = 0; v < num_nodes; ++v ) {
+        if( adj_offsets[v + 1] - adj_offsets[v] > 1 ) {
+            root = v;
+            break;
+        }
+    }
+
+    std::vector<uint32_t> preorder;
+    preorder.reserve( edges.size() );
+
+    // (node, edge through which it was reached)
+    std::vector<std::pair<uint32_t,uint32_t> > stack;
+    stack.push_back( std::make_pair( root, no_edge ));
+
+    while( !stack.empty() ) {
+        const uint32_t v = stack.back().first;
+        const uint32_t in = stack.back().second;
+        stack.pop_back();
+
+        if( in != no_edge ) {
+            preorder.push_back( in );
+        }
+
+        for( size_t j = adj_offsets[v]; j < adj_offsets[v + 1]; ++j ) {
+            const uint32_t e = adj[j];
+
+            if( e != in ) {
+                parent_[e] = in;
+                stack.push_back( std::make_pair( edges[e].first == v ? edges[e].second : edges[e].first, e ));
+            }
+        }
+    }
+
+    if( preorder.size() != edges.size() ) {
+        throw std::runtime_error( "clade_hierarchy: the edges do not form a tree" );
+    }
+
+    build( preorder, 0 );
+
+    std::vector<uint32_t>().swap( parent_ );
+    std::vector<uint32_t>().swap( local_pos_ );
+}
+
+uint32_t papara::clade_hierarchy::build( const std::vector<uint32_t> &edges, size_t level ) {
+    assert( !edges.empty() );
+
+    const uint32_t c = uint32_t(reps_.size());
+    reps_.push_back( edges.front() );
+    children_.push_back( std::vector<uint32_t>() );
+
+    if( edges.size() == 1 ) {
+        order_[edges.front()] = next_order_++;
+        return c;
+    }
+
+    depth_ = std::max( depth_, level + 1 );
+
+    std::vector<std::vector<uint32_t> > parts;
+    if( edges.size() > leaf_size_ ) {
+        split( edges, &parts );
+    }
+
+    if( parts.size() < 2 ) {
+        parts.assign( edges.size(), std::vector<uint32_t>() );
+
+        for( size_t i = 0; i < edges.size(); ++i ) {
+            parts[i].push_back( edges[i] );
+        }
+    }
+
+    for( size_t i = 0; i < parts.size(); ++i ) {
+        const uint32_t child = build( parts[i], level + 1 );
+
+        // (children_ may have been reallocated by the recursion)
+        children_[c].push_back( child );
+    }
+
+    return c;
+}
+
+void papara::clade_hierarchy::split( const std::vector<uint32_t> &edges, std::vector<std::vector<uint32_t> > *parts ) {
+    // bottom-up: each edge collects the number of edges below it that are not yet part of a sub-clade. An edge where
+    // this number reaches the target size becomes the representative of a new sub-clade. The remaining edges at the
+    // top (i.e., those connected to edges.front()) form one more sub-clade.
+    const size_t n = edges.size();
+    const uint32_t target = uint32_t((n + fanout_ - 1) / fanout_);
+
+    for( size_t i = 0; i < n; ++i ) {
+        local_pos_[edges[i]] = uint32_t(i);
+    }
+
+    std::vector<uint32_t> open( n, 0 );
+    std::vector<uint8_t> cut( n, 0 );
+
+    for( size_t i = n; i-- > 0; ) {
+        ++open[i];
+
+        const uint32_t p = parent_[edges[i]];
+        const bool parent_inside = p != no_edge && local_pos_[p] != no_edge;
+
+        if( i != 0 && open[i] >= target ) {
+            cut[i] = 1;
+        } else if( parent_inside ) {
+            open[local_pos_[p]] += open[i];
+        }
+    }
+
+    // assign the edges to the sub-clades (in preorder, so that the edge above is always assigned first)
+    std::vector<uint32_t> part_of( n, 0 );
+    parts->assign( 1, std::vector<uint32_t>() );
+
+    for( size_t i = 0; i < n; ++i ) {
+        const uint32_t p = parent_[edges[i]];
+
+        if( cut[i] ) {
+            part_of[i] = uint32_t(parts->size());
+            parts->push_back( std::vector<uint32_t>() );
+        } else if( i != 0 && p != no_edge && local_pos_[p] != no_edge ) {
+            part_of[i] = part_of[local_pos_[p]];
+        }
+
+        (*parts)[part_of[i]].push_back( edges[i] );
+    }
+
+    for( size_t i = 0; i < n; ++i ) {
+        local_pos_[edges[i]] = no_edge;
+    }
+}
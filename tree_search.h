@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2009-2012 Simon A. Berger
+ *
+ * This file is part of papara.
+ *
+ *  papara is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  papara is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with papara.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __tree_search_h
+#define __tree_search_h
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+#include <stdint.h>
+
+// Optional tree-guided search (papara -T <margin>): the edges of the reference tree are decomposed into a hierarchy of
+// clades (connected sets of edges). Each query is first scored against the representative edges of the top-level
+// clades, then only the clades whose representative scores within the margin of the best score of the query are
+// refined, down to the single edges (see driver::score_queries).
+
+namespace papara {
+
+class clade_hierarchy {
+public:
+    // edges: the two nodes of each edge (see references::edge_nodes). Each clade is split into about fanout sub-clades,
+    // clades with at most leaf_size edges are split into their single edges.
+    clade_hierarchy( const std::vector<std::pair<uint32_t,uint32_t> > &edges, size_t fanout = 8, size_t leaf_size = 32 );
+
+    size_t num_edges() const {
+        return order_.size();
+    }
+
+    size_t num_clades() const {
+        return reps_.size();
+    }
+
+    // the clade that contains all edges
+    size_t root() const {
+        return 0;
+    }
+
+    // the representative of a clade is its edge that is closest to the root of the tree
+    uint32_t rep_at( size_t c ) const {
+        return reps_[c];
+    }
+
+    // sub-clades of a clade (empty for the clades that consist of a single edge)
+    const std::vector<uint32_t> &children_at( size_t c ) const {
+        return children_[c];
+    }
+
+    // position of an edge in an order in which the edges of each clade are contiguous
+    uint32_t order_at( size_t edge ) const {
+        return order_[edge];
+    }
+
+    // number of levels below the root
+    size_t depth() const {
+        return depth_;
+    }
+
+private:
+    uint32_t build( const std::vector<uint32_t> &edges, size_t level );
+    void split( const std::vector<uint32_t> &edges, std::vector<std::vector<uint32_t> > *parts );
+
+    const size_t fanout_;
+    const size_t leaf_size_;
+
+    // edge above each edge (or -1 for the edges at the root of the tree), and the position of each edge in the clade
+    // that is currently split (scratch space of split)
+    std::vector<uint32_t> parent_;
+    std::vector<uint32_t> local_pos_;
+
+    std::vector<uint32_t> reps_;
+    std::vector<std::vector<uint32_t> > children_;
+    std::vector<uint32_t> order_;
+    uint32_t next_order_;
+    size_t depth_;
+};
+
+}
+
+#endif
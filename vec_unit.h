@@ -85,6 +85,21 @@
 //#include <immintrin.h>
 #endif
 
+// instruction sets used by the vector units: either enabled for the whole translation unit by the compiler flags, or
+// only for the code of a scoring kernel variant via VEC_UNIT_TARGET_* (see scoring_kernel_impl.h). Each of them
+// implies the smaller ones.
+#if defined (__AVX512BW__) || defined (VEC_UNIT_TARGET_AVX512BW)
+#define VEC_UNIT_AVX512BW
+#endif
+
+#if defined (__AVX2__) || defined (VEC_UNIT_AVX512BW) || defined (VEC_UNIT_TARGET_AVX2)
+#define VEC_UNIT_AVX2
+#endif
+
+#if defined (__SSE4_1__) || defined (VEC_UNIT_AVX2) || defined (VEC_UNIT_TARGET_SSE41)
+#define VEC_UNIT_SSE41
+#endif
+
 
 #ifdef min
 #error min defined as macro. this is evil. Please #define NOMINMAX before including any windows headers.
@@ -210,8 +225,108 @@ struct vector_unit<short, 8> {
     
 };
 
-#ifndef __AVX__
-// vector unit specialization: future AVX 16x16bit integer
+// vector unit specialization: SSE 16x8bit signed integer
+// WARNING: in contrast to the 16bit units, add is saturating. The 8bit units are used for a first scoring pass
+// that relies on saturation instead of wrap-around to detect overflows (see scoring_kernel_impl.h).
+
+template<>
+struct vector_unit<signed char, 16> {
+
+    const static bool do_checks = false;
+
+    typedef __m128i vec_t;
+    typedef signed char T;
+
+    const static T POS_MAX_VALUE = 0x7f;
+    const static T LARGE_VALUE = 127;
+    const static T SMALL_VALUE = -128;
+    const static T BIAS = 0;
+    const static size_t W = 16;
+
+    static inline vec_t setzero() {
+        return _mm_setzero_si128();
+    }
+
+    static inline vec_t set1( T val ) {
+        return _mm_set1_epi8( val );
+    }
+
+    static inline void store( const vec_t &v, T *addr ) {
+
+        if( do_checks && addr == 0 ) {
+            throw std::runtime_error( "store: addr == 0" );
+        }
+
+        _mm_store_si128( (vec_t*)addr, v );
+    }
+
+    static inline const vec_t load( const T* addr ) {
+        return _mm_load_si128( (vec_t*)addr );
+    }
+
+    static inline const vec_t bit_and( const vec_t &a, const vec_t &b ) {
+        return _mm_and_si128( a, b );
+    }
+
+    static inline const vec_t bit_or( const vec_t &a, const vec_t &b ) {
+        return _mm_or_si128( a, b );
+    }
+    static inline const vec_t bit_andnot( const vec_t &a, const vec_t &b ) {
+        return _mm_andnot_si128( a, b );
+    }
+    static inline const vec_t bit_invert( const vec_t &a ) {
+        return _mm_xor_si128( a, set1(T(-1)) );
+    }
+
+    static inline const vec_t add( const vec_t &a, const vec_t &b ) {
+        return _mm_adds_epi8( a, b );
+    }
+    static inline const vec_t adds( const vec_t &a, const vec_t &b ) {
+        return _mm_adds_epi8( a, b );
+    }
+
+    static inline const vec_t sub( const vec_t &a, const vec_t &b ) {
+        return _mm_subs_epi8( a, b );
+    }
+    static inline const vec_t cmp_zero( const vec_t &a ) {
+        return _mm_cmpeq_epi8( a, setzero() );
+    }
+
+    static inline const vec_t cmp_eq( const vec_t &a, const vec_t &b ) {
+        return _mm_cmpeq_epi8( a, b );
+    }
+
+    static inline const vec_t cmp_lt( const vec_t &a, const vec_t &b ) {
+        return _mm_cmplt_epi8( a, b );
+    }
+
+    static inline const vec_t min( const vec_t &a, const vec_t &b ) {
+#ifdef VEC_UNIT_SSE41
+        return _mm_min_epi8( a, b );
+#else
+        // signed 8bit min/max are SSE4.1
+        const vec_t lt = cmp_lt( a, b );
+        return bit_or( bit_and( lt, a ), bit_andnot( lt, b ));
+#endif
+    }
+
+    static inline const vec_t max( const vec_t &a, const vec_t &b ) {
+#ifdef VEC_UNIT_SSE41
+        return _mm_max_epi8( a, b );
+#else
+        const vec_t lt = cmp_lt( a, b );
+        return bit_or( bit_and( lt, b ), bit_andnot( lt, a ));
+#endif
+    }
+
+    static inline void assert_alignment( T * p ) {
+        assert( size_t(p) % required_alignment == 0 );
+    }
+
+};
+
+#ifndef VEC_UNIT_AVX2
+// vector unit specialization: 16x16bit integer emulated by two SSE registers (the native AVX2 version is further below)
 
 template<>
 struct vector_unit<short, 16> {
@@ -406,7 +521,7 @@ struct vector_unit<int, 4> {
     
     static inline const vec_t min( const vec_t &a, const vec_t &b ) {
         // sse 4.1, no shit! what were they smoking...
-#ifdef __SSE4_1__
+#ifdef VEC_UNIT_SSE41
         return _mm_min_epi32( a, b );
 #else
 		//#warning "probably untested code!"
@@ -418,7 +533,7 @@ struct vector_unit<int, 4> {
     }
     
     static inline const vec_t max( const vec_t &a, const vec_t &b ) {
-#ifdef __SSE4_1__
+#ifdef VEC_UNIT_SSE41
         return _mm_max_epi32( a, b );
 #else      
 	//#warning "probably untested code!"
@@ -745,182 +860,371 @@ struct vector_unit<double, 2> {
 
 
 
-#ifdef HAVE_AVX
-// AVX is the most pointless thing in the world, as far as integers are concerned.
-// waiting for AVX5.7
+#ifdef VEC_UNIT_AVX2
+// AVX2 finally brought 256bit integer operations, so the 16x16bit unit is no longer emulated by two SSE registers.
+// The loads/stores are unaligned, as the buffers are only guaranteed to be aligned to required_alignment (16 bytes).
+// On anything that supports AVX2 there is no penalty for unaligned access to aligned addresses.
 
-// AVX 16x16bit vector unit
+// vector unit specialization: AVX2 16x16bit integer
 template<>
 struct vector_unit<short, 16> {
 
     const static bool do_checks = false;
-    
+
     typedef __m256i vec_t;
     typedef short T;
-    
+
+    const static T POS_MAX_VALUE = 0x7fff;
+    const static T LARGE_VALUE = 32000;
     const static T SMALL_VALUE = -32000;
     const static T BIAS = 0;
-    const static size_t W = 8;
-    
+    const static size_t W = 16;
+
     static inline vec_t setzero() {
         return _mm256_setzero_si256();
     }
-    
+
     static inline vec_t set1( T val ) {
         return _mm256_set1_epi16( val );
     }
-    
+
     static inline void store( const vec_t &v, T *addr ) {
 
         if( do_checks && addr == 0 ) {
             throw std::runtime_error( "store: addr == 0" );
         }
-        //std::cout << "store to: " << addr << "\n";
-        
-        _mm256_store_si256( (vec_t*)addr, v );
+
+        _mm256_storeu_si256( (vec_t*)addr, v );
     }
-    
-    static inline const vec_t load( T* addr ) {
-        return _mm256_load_si256( (vec_t*)addr );
+
+    static inline const vec_t load( const T* addr ) {
+        return _mm256_loadu_si256( (const vec_t*)addr );
     }
-    
+
     static inline const vec_t bit_and( const vec_t &a, const vec_t &b ) {
-        __m128i lowa = _mm256_castsi256_si128(a);
-        const __m128i lowb = _mm256_castsi256_si128(b);
-        
-        lowa = _mm_and_si128( lowa, lowb );
-        
-        
-        __m128i higha = _mm256_extractf128_si256(a,1);
-        const __m128i highb = _mm256_extractf128_si256(b,1);
-        
-        higha = _mm_and_si128( higha, highb );
-        
-        
-        return _mm256_insertf128_si256( _mm256_castsi128_si256(lowa), higha, 1 );
+        return _mm256_and_si256( a, b );
+    }
+
+    static inline const vec_t bit_or( const vec_t &a, const vec_t &b ) {
+        return _mm256_or_si256( a, b );
     }
-    
     static inline const vec_t bit_andnot( const vec_t &a, const vec_t &b ) {
-        __m128i lowa = _mm256_castsi256_si128(a);
-        const __m128i lowb = _mm256_castsi256_si128(b);
-        
-        lowa = _mm_andnot_si128( lowa, lowb );
-        
-        
-        __m128i higha = _mm256_extractf128_si256(a,1);
-        const __m128i highb = _mm256_extractf128_si256(b,1);
-        
-        higha = _mm_andnot_si128( higha, highb );
-        
-        
-        return _mm256_insertf128_si256( _mm256_castsi128_si256(lowa), higha, 1 );
+        return _mm256_andnot_si256( a, b );
     }
-    
-//     static inline const vec_t bit_invert( const vec_t &a ) {
-//         //return _mm_andnot_pd(a, set1(0xffff));
-//     }
-    
+    static inline const vec_t bit_invert( const vec_t &a ) {
+        return _mm256_xor_si256( a, set1(T(0xffff)) );
+    }
+
     static inline const vec_t add( const vec_t &a, const vec_t &b ) {
-        const __m128i lowa = _mm256_extractf128_si256(a,0);
-        const __m128i lowb = _mm256_extractf128_si256(b,0);
-        
-        //lowa = _mm_add_epi16( lowa, lowb );
-        
-        
-        const __m128i higha = _mm256_extractf128_si256(a,1);
-        const __m128i highb = _mm256_extractf128_si256(b,1);
-        
-        //higha = _mm_add_epi16( higha, highb );
-        
-        
-        return _mm256_insertf128_si256( _mm256_castsi128_si256(_mm_add_epi16( lowa, lowb )),  _mm_add_epi16( higha, highb ), 1 );
+        return _mm256_add_epi16( a, b );
+    }
+    static inline const vec_t adds( const vec_t &a, const vec_t &b ) {
+        return _mm256_adds_epi16( a, b );
     }
+
     static inline const vec_t sub( const vec_t &a, const vec_t &b ) {
-        __m128i lowa = _mm256_castsi256_si128(a);
-        const __m128i lowb = _mm256_castsi256_si128(b);
-        
-        lowa = _mm_sub_epi16( lowa, lowb );
-        
-        
-        __m128i higha = _mm256_extractf128_si256(a,1);
-        const __m128i highb = _mm256_extractf128_si256(b,1);
-        
-        higha = _mm_sub_epi16( higha, highb );
-        
-        
-        return _mm256_insertf128_si256( _mm256_castsi128_si256(lowa), higha, 1 );
+        return _mm256_sub_epi16( a, b );
     }
     static inline const vec_t cmp_zero( const vec_t &a ) {
-        return cmp_eq( a, setzero() );
+        return _mm256_cmpeq_epi16( a, setzero() );
     }
-    
+
     static inline const vec_t cmp_eq( const vec_t &a, const vec_t &b ) {
-        __m128i lowa = _mm256_castsi256_si128(a);
-        const __m128i lowb = _mm256_castsi256_si128(b);
-        
-        lowa = _mm_cmpeq_epi16( lowa, lowb );
-        
-        
-        __m128i higha = _mm256_extractf128_si256(a,1);
-        const __m128i highb = _mm256_extractf128_si256(b,1);
-        
-        higha = _mm_cmpeq_epi16( higha, highb );
-        
-        
-        return _mm256_insertf128_si256( _mm256_castsi128_si256(lowa), higha, 1 );
+        return _mm256_cmpeq_epi16( a, b );
     }
-    
+
     static inline const vec_t cmp_lt( const vec_t &a, const vec_t &b ) {
-     
-        __m128i lowa = _mm256_castsi256_si128(a);
-        const __m128i lowb = _mm256_castsi256_si128(b);
-        
-        lowa = _mm_cmplt_epi16( lowa, lowb );
-        
-        
-        __m128i higha = _mm256_extractf128_si256(a,1);
-        const __m128i highb = _mm256_extractf128_si256(b,1);
-        
-        higha = _mm_cmplt_epi16( higha, highb );
-        
-        
-        return _mm256_insertf128_si256( _mm256_castsi128_si256(lowa), higha, 1 );
+        // there is no cmplt for 256bit integers
+        return _mm256_cmpgt_epi16( b, a );
     }
-    
+
     static inline const vec_t min( const vec_t &a, const vec_t &b ) {
-        __m128i lowa = _mm256_castsi256_si128(a);
-        const __m128i lowb = _mm256_castsi256_si128(b);
-        
-        lowa = _mm_min_epi16( lowa, lowb );
-        
-        
-        __m128i higha = _mm256_extractf128_si256(a,1);
-        const __m128i highb = _mm256_extractf128_si256(b,1);
-        
-        higha = _mm_min_epi16( higha, highb );
-        
-        
-        return _mm256_insertf128_si256( _mm256_castsi128_si256(lowa), higha, 1 );
+        return _mm256_min_epi16( a, b );
     }
-    
+
     static inline const vec_t max( const vec_t &a, const vec_t &b ) {
-        __m128i lowa = _mm256_castsi256_si128(a);
-        const __m128i lowb = _mm256_castsi256_si128(b);
-        
-        lowa = _mm_max_epi16( lowa, lowb );
-        
-        
-        __m128i higha = _mm256_extractf128_si256(a,1);
-        const __m128i highb = _mm256_extractf128_si256(b,1);
-        
-        higha = _mm_max_epi16( higha, highb );
-        
-        
-        return _mm256_insertf128_si256( _mm256_castsi128_si256(lowa), higha, 1 );
+        return _mm256_max_epi16( a, b );
+    }
+
+    static inline const vec_t abs_diff( const vec_t &a, const vec_t &b ) {
+        return _mm256_abs_epi16(sub(a,b));
+    }
+
+    static inline void assert_alignment( T * p ) {
+        assert( size_t(p) % required_alignment == 0 );
+    }
+
+};
+
+// vector unit specialization: AVX2 32x8bit signed integer (add is saturating, see vector_unit<signed char,16>)
+template<>
+struct vector_unit<signed char, 32> {
+
+    const static bool do_checks = false;
+
+    typedef __m256i vec_t;
+    typedef signed char T;
+
+    const static T POS_MAX_VALUE = 0x7f;
+    const static T LARGE_VALUE = 127;
+    const static T SMALL_VALUE = -128;
+    const static T BIAS = 0;
+    const static size_t W = 32;
+
+    static inline vec_t setzero() {
+        return _mm256_setzero_si256();
+    }
+
+    static inline vec_t set1( T val ) {
+        return _mm256_set1_epi8( val );
+    }
+
+    static inline void store( const vec_t &v, T *addr ) {
+
+        if( do_checks && addr == 0 ) {
+            throw std::runtime_error( "store: addr == 0" );
+        }
+
+        _mm256_storeu_si256( (vec_t*)addr, v );
+    }
+
+    static inline const vec_t load( const T* addr ) {
+        return _mm256_loadu_si256( (const vec_t*)addr );
+    }
+
+    static inline const vec_t bit_and( const vec_t &a, const vec_t &b ) {
+        return _mm256_and_si256( a, b );
+    }
+
+    static inline const vec_t bit_or( const vec_t &a, const vec_t &b ) {
+        return _mm256_or_si256( a, b );
+    }
+    static inline const vec_t bit_andnot( const vec_t &a, const vec_t &b ) {
+        return _mm256_andnot_si256( a, b );
+    }
+    static inline const vec_t bit_invert( const vec_t &a ) {
+        return _mm256_xor_si256( a, set1(T(-1)) );
+    }
+
+    static inline const vec_t add( const vec_t &a, const vec_t &b ) {
+        return _mm256_adds_epi8( a, b );
+    }
+    static inline const vec_t adds( const vec_t &a, const vec_t &b ) {
+        return _mm256_adds_epi8( a, b );
+    }
+
+    static inline const vec_t sub( const vec_t &a, const vec_t &b ) {
+        return _mm256_subs_epi8( a, b );
+    }
+    static inline const vec_t cmp_zero( const vec_t &a ) {
+        return _mm256_cmpeq_epi8( a, setzero() );
+    }
+
+    static inline const vec_t cmp_eq( const vec_t &a, const vec_t &b ) {
+        return _mm256_cmpeq_epi8( a, b );
+    }
+
+    static inline const vec_t cmp_lt( const vec_t &a, const vec_t &b ) {
+        return _mm256_cmpgt_epi8( b, a );
     }
+
+    static inline const vec_t min( const vec_t &a, const vec_t &b ) {
+        return _mm256_min_epi8( a, b );
+    }
+
+    static inline const vec_t max( const vec_t &a, const vec_t &b ) {
+        return _mm256_max_epi8( a, b );
+    }
+
+    static inline void assert_alignment( T * p ) {
+        assert( size_t(p) % required_alignment == 0 );
+    }
+
 };
+#endif // VEC_UNIT_AVX2
+
+#ifdef VEC_UNIT_AVX512BW
+// vector unit specialization: AVX-512BW 32x16bit integer
+// The AVX-512 comparisons produce mask registers. They are expanded back into vectors, so that the
+// interface (and the kernels built on it) stay the same as for SSE/AVX2.
+template<>
+struct vector_unit<short, 32> {
+
+    const static bool do_checks = false;
+
+    typedef __m512i vec_t;
+    typedef short T;
+
+    const static T POS_MAX_VALUE = 0x7fff;
+    const static T LARGE_VALUE = 32000;
+    const static T SMALL_VALUE = -32000;
+    const static T BIAS = 0;
+    const static size_t W = 32;
+
+    static inline vec_t setzero() {
+        return _mm512_setzero_si512();
+    }
+
+    static inline vec_t set1( T val ) {
+        return _mm512_set1_epi16( val );
+    }
+
+    static inline void store( const vec_t &v, T *addr ) {
+
+        if( do_checks && addr == 0 ) {
+            throw std::runtime_error( "store: addr == 0" );
+        }
+
+        _mm512_storeu_si512( (void*)addr, v );
+    }
 
+    static inline const vec_t load( const T* addr ) {
+        return _mm512_loadu_si512( (const void*)addr );
+    }
+
+    static inline const vec_t bit_and( const vec_t &a, const vec_t &b ) {
+        return _mm512_and_si512( a, b );
+    }
+
+    static inline const vec_t bit_or( const vec_t &a, const vec_t &b ) {
+        return _mm512_or_si512( a, b );
+    }
+    static inline const vec_t bit_andnot( const vec_t &a, const vec_t &b ) {
+        return _mm512_andnot_si512( a, b );
+    }
+    static inline const vec_t bit_invert( const vec_t &a ) {
+        return _mm512_xor_si512( a, set1(T(0xffff)) );
+    }
 
+    static inline const vec_t add( const vec_t &a, const vec_t &b ) {
+        return _mm512_add_epi16( a, b );
+    }
+    static inline const vec_t adds( const vec_t &a, const vec_t &b ) {
+        return _mm512_adds_epi16( a, b );
+    }
+
+    static inline const vec_t sub( const vec_t &a, const vec_t &b ) {
+        return _mm512_sub_epi16( a, b );
+    }
+    static inline const vec_t cmp_zero( const vec_t &a ) {
+        return _mm512_movm_epi16( _mm512_cmpeq_epi16_mask( a, setzero() ));
+    }
+
+    static inline const vec_t cmp_eq( const vec_t &a, const vec_t &b ) {
+        return _mm512_movm_epi16( _mm512_cmpeq_epi16_mask( a, b ));
+    }
+
+    static inline const vec_t cmp_lt( const vec_t &a, const vec_t &b ) {
+        return _mm512_movm_epi16( _mm512_cmplt_epi16_mask( a, b ));
+    }
+
+    static inline const vec_t min( const vec_t &a, const vec_t &b ) {
+        return _mm512_min_epi16( a, b );
+    }
+
+    static inline const vec_t max( const vec_t &a, const vec_t &b ) {
+        return _mm512_max_epi16( a, b );
+    }
+
+    static inline const vec_t abs_diff( const vec_t &a, const vec_t &b ) {
+        return _mm512_abs_epi16(sub(a,b));
+    }
+
+    static inline void assert_alignment( T * p ) {
+        assert( size_t(p) % required_alignment == 0 );
+    }
+
+};
+
+// vector unit specialization: AVX-512BW 64x8bit signed integer (add is saturating, see vector_unit<signed char,16>)
+template<>
+struct vector_unit<signed char, 64> {
+
+    const static bool do_checks = false;
+
+    typedef __m512i vec_t;
+    typedef signed char T;
+
+    const static T POS_MAX_VALUE = 0x7f;
+    const static T LARGE_VALUE = 127;
+    const static T SMALL_VALUE = -128;
+    const static T BIAS = 0;
+    const static size_t W = 64;
+
+    static inline vec_t setzero() {
+        return _mm512_setzero_si512();
+    }
+
+    static inline vec_t set1( T val ) {
+        return _mm512_set1_epi8( val );
+    }
+
+    static inline void store( const vec_t &v, T *addr ) {
+
+        if( do_checks && addr == 0 ) {
+            throw std::runtime_error( "store: addr == 0" );
+        }
+
+        _mm512_storeu_si512( (void*)addr, v );
+    }
+
+    static inline const vec_t load( const T* addr ) {
+        return _mm512_loadu_si512( (const void*)addr );
+    }
+
+    static inline const vec_t bit_and( const vec_t &a, const vec_t &b ) {
+        return _mm512_and_si512( a, b );
+    }
+
+    static inline const vec_t bit_or( const vec_t &a, const vec_t &b ) {
+        return _mm512_or_si512( a, b );
+    }
+    static inline const vec_t bit_andnot( const vec_t &a, const vec_t &b ) {
+        return _mm512_andnot_si512( a, b );
+    }
+    static inline const vec_t bit_invert( const vec_t &a ) {
+        return _mm512_xor_si512( a, set1(T(-1)) );
+    }
+
+    static inline const vec_t add( const vec_t &a, const vec_t &b ) {
+        return _mm512_adds_epi8( a, b );
+    }
+    static inline const vec_t adds( const vec_t &a, const vec_t &b ) {
+        return _mm512_adds_epi8( a, b );
+    }
+
+    static inline const vec_t sub( const vec_t &a, const vec_t &b ) {
+        return _mm512_subs_epi8( a, b );
+    }
+    static inline const vec_t cmp_zero( const vec_t &a ) {
+        return _mm512_movm_epi8( _mm512_cmpeq_epi8_mask( a, setzero() ));
+    }
+
+    static inline const vec_t cmp_eq( const vec_t &a, const vec_t &b ) {
+        return _mm512_movm_epi8( _mm512_cmpeq_epi8_mask( a, b ));
+    }
+
+    static inline const vec_t cmp_lt( const vec_t &a, const vec_t &b ) {
+        return _mm512_movm_epi8( _mm512_cmplt_epi8_mask( a, b ));
+    }
+
+    static inline const vec_t min( const vec_t &a, const vec_t &b ) {
+        return _mm512_min_epi8( a, b );
+    }
+
+    static inline const vec_t max( const vec_t &a, const vec_t &b ) {
+        return _mm512_max_epi8( a, b );
+    }
+
+    static inline void assert_alignment( T * p ) {
+        assert( size_t(p) % required_alignment == 0 );
+    }
+
+};
+#endif // VEC_UNIT_AVX512BW
+
+
+#ifdef HAVE_AVX
 
 template<>
 struct vector_unit<double, 4> {